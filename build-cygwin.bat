@@ -2,7 +2,7 @@
 
 rem Compile AVM library
 echo Compiling avm library...
-g++ -shared -o bin/avm.dll -std=gnu++11 -O2 -w -Iinclude/ -Iinclude/avm/ src/avm/arraylist.cpp src/avm/avm.cpp src/avm/byte_stream.cpp src/avm/frame.cpp src/avm/function.cpp src/avm/heap.cpp src/avm/object.cpp src/avm/reference.cpp src/avm/variable.cpp src/avm/vm_state.cpp src/avm/check_args.cpp
+g++ -shared -o bin/avm.dll -std=gnu++11 -O2 -w -Iinclude/ -Iinclude/avm/ src/avm/arraylist.cpp src/avm/avm.cpp src/avm/byte_stream.cpp src/avm/frame.cpp src/avm/function.cpp src/avm/heap.cpp src/avm/object.cpp src/avm/program.cpp src/avm/reference.cpp src/avm/value.cpp src/avm/variable.cpp src/avm/vm_state.cpp src/avm/check_args.cpp src/avm/jit.cpp src/avm/slab_allocator.cpp src/avm/shape.cpp src/avm/value_stack.cpp
 
 rem Compile the ARES compiler
 echo Compiling ARES compiler...
@@ -10,6 +10,6 @@ g++ -shared -o bin/alang.dll -std=gnu++11 -w -Iinclude/ -Iinclude/compiler/ src/
 
 rem Compile the executable
 echo Compiling ARES executable...
-g++ -o bin/ares.exe -std=gnu++11 -w -Iinclude/ -Iinclude/ares/ -Iinclude/compiler/ -Iinclude/avm/ src/ares/ascript.cpp src/ares/rtlib.cpp src/ares/main.cpp -Lbin/ -lavm -lalang
+g++ -o bin/ares.exe -std=gnu++11 -w -Iinclude/ -Iinclude/ares/ -Iinclude/compiler/ -Iinclude/avm/ src/ares/ascript.cpp src/ares/rtlib.cpp src/ares/cpp_emitter.cpp src/ares/main.cpp -Lbin/ -lavm -lalang
 
 pause
\ No newline at end of file
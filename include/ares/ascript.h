@@ -8,6 +8,11 @@
 #include <string>
 #include <fstream>
 
+namespace avm {
+class VMInstance;
+struct CompiledProgram;
+} // namespace avm
+
 namespace ares {
 /** Script Build Steps:
  *  Lexer
@@ -34,6 +39,9 @@ namespace ares {
  *  - Begins to write them to the "filepath", supplied with the emit(filepath) function
  *  - Will stop writing if an unrecognized instruction is encountered (indicates an unimplemented feature)
  *  - The final stage of building the script and the file can be executed from "filepath" afterwords
+ *
+ *  Scripts may run on different threads at once. A script's VM allocates from the
+ *  heap memory of the thread that runs it, so a script must stay on one thread.
 */
 class Script {
 public:
@@ -42,6 +50,26 @@ public:
 
     bool CompileAndRun(const std::string &code, const std::string &original_path, const std::string &output_file);
     void RunFromBytecode(avm::ByteStream *stream);
+    // Runs a program that was translated to C++ with EmitCpp, and linked into the executable
+    void RunCompiled(const avm::CompiledProgram &compiled);
+    // Translates bytecode to a C++ source file, which defines an avm::CompiledProgram
+    // named after the output file. Returns false if the bytecode is invalid.
+    bool EmitCpp(avm::ByteStream *stream, const std::string &source_path, const std::string &output_file);
+
+    // Whether the VM compiles hot functions to native code
+    bool jit_enabled;
+    // Whether the VM marks the heap on a separate thread during garbage collection
+    bool concurrent_marking;
+    // No. threads that sweep the heap during garbage collection
+    size_t sweep_threads;
+    // Whether the VM compacts the heap after major collections
+    bool compact_heap;
+    // No. bytes the VM's heap may hold, or 0 for no limit
+    size_t max_heap_size;
+
+private:
+    // Binds the runtime library to a new VM
+    avm::VMInstance *CreateVM();
 };
 } // namespace ares
 
@@ -0,0 +1,50 @@
+#ifndef CPP_EMITTER_H
+#define CPP_EMITTER_H
+
+#include <detail/program.h>
+
+#include <string>
+#include <ostream>
+#include <set>
+
+namespace ares {
+/** Translates a decoded program to a C++ translation unit, which defines an
+    avm::CompiledProgram with the given name. The instructions are kept as data, so
+    that the runtime can still point into them, but each one is also given its own
+    block of code: jumps become gotos, constants are pushed directly, and arithmetic
+    on inline numbers is done in place. Everything else calls into the VM, either
+    to the Variable operation or to the handler of the instruction.
+*/
+class CppEmitter {
+public:
+    CppEmitter(const avm::Program &program, const std::string &symbol);
+
+    // Writes the translation unit. The path is only mentioned in a comment
+    void Emit(std::ostream &os, const std::string &source_path);
+
+    // Turns a file name into a C++ identifier
+    static std::string SymbolName(const std::string &path);
+
+private:
+    // Writes the function that fills in the constants and the instructions
+    void EmitLoad(std::ostream &os);
+    // Writes the function that runs the instructions
+    void EmitRun(std::ostream &os);
+    // Returns the statements that perform an instruction, with the read level equal to
+    // the frame level. Execution falls through to the next instruction at the end
+    std::string Translate(size_t index);
+    // Statements that perform an instruction through its handler
+    std::string TranslateHandlerCall(size_t index);
+    // Statements that perform an arithmetic or comparison operation on the stack
+    std::string TranslateOperation(size_t index);
+    // Statement that continues at the instruction, which is reached with the pc not stored
+    std::string Goto(size_t index);
+
+    const avm::Program &program;
+    std::string symbol;
+    // Instructions that are the target of a goto
+    std::set<size_t> labels;
+};
+} // namespace ares
+
+#endif
@@ -23,6 +23,7 @@ public:
     static void Runtime_loadlib(VMState *state, Object **args, uint32_t argc); // takes 1 args
     static void Runtime_loadfunc(VMState *state, Object **args, uint32_t argc); // takes 2 args
     static void Runtime_invoke(VMState *state, Object **args, uint32_t argc); // takes atleast 1 args
+    static void Runtime_allocations(VMState *state, Object **args, uint32_t argc); // takes 0 args
 
     static void Console_println(VMState *state, Object **args, uint32_t argc); // takes 1 args
     //static void Console_printf(VMState *state, Object **args, uint32_t argc); // takes atleast 1 args
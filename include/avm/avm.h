@@ -4,13 +4,16 @@
 #include <common/instructions.h>
 #include <common/types.h>
 
+#include <detail/vm_config.h>
 #include <detail/vm_state.h>
 #include <detail/variable.h>
+#include <detail/value.h>
 #include <detail/function.h>
 #include <detail/native_function.h>
 #include <detail/object.h>
 #include <detail/frame.h>
 #include <detail/heap.h>
+#include <detail/jit.h>
 
 #include <string>
 #include <stack>
@@ -23,6 +26,18 @@ namespace avm {
 typedef Variable &(Variable::*BinOp_t)(VMState *, Variable *);
 typedef Variable &(Variable::*UnOp_t)(VMState *);
 
+class VMInstance;
+
+/** A program that was translated to C++ ahead of time (see ares -emit-cpp).
+    Load fills in the decoded instructions, so no bytecode is parsed at startup.
+    Run performs instructions from the pc while it is below the pc limit, as the
+    dispatch loop would, and returns when the program ends or an exception is raised.
+*/
+struct CompiledProgram {
+    void (*load)(Program &program);
+    void (*run)(VMInstance *vm);
+};
+
 class VMInstance {
 public:
     VMInstance();
@@ -33,10 +48,12 @@ public:
     // Deletes the current stack frame and decreases the current level
     void CloseFrame();
 
-    // Creates a new object with integer value and pushes it to the stack
+    // Pushes an integer to the stack, held inline
     void PushInt(AVMInteger_t);
-    // Creates a new object with float value and pushes it to the stack
+    // Pushes a float to the stack, held inline
     void PushFloat(AVMFloat_t);
+    // Pushes null to the stack, held inline
+    void PushNull();
     // Creates a new object with string value and pushes it to the stack
     void PushString(const AVMString_t &);
     // Pushes a reference to the stack
@@ -50,6 +67,24 @@ public:
     // Performs an operation on the last object in the stack.
     // The result will be pushed onto the stack
     void Operation(UnOp_t);
+    // Returns the typed form of an operation that suits the operands on the stack
+    Opcode_t ObserveOperands(Opcode_t generic);
+    // Performs a generic operation, and records the types of its operands so that
+    // the instruction can be rewritten to a typed form
+    void QuickenOperation(DecodedInstruction &ins, BinOp_t op);
+    // Changes a rewritten instruction back to its generic form
+    void Deoptimize(DecodedInstruction &ins);
+    // Performs an operation on the last two values in the stack, which are expected
+    // to be integers. If they are not, the generic operation is performed instead.
+    template <typename Op>
+    void IntegerOperation(DecodedInstruction &ins, BinOp_t generic);
+    // Performs an operation on the last two values in the stack, which are expected
+    // to be floats. If they are not, the generic operation is performed instead.
+    template <typename Op>
+    void FloatOperation(DecodedInstruction &ins, BinOp_t generic);
+    // Concatenates the last two values in the stack, which are expected to be strings.
+    // If they are not, the generic addition is performed instead.
+    void Concatenate(DecodedInstruction &ins);
     // Performs an assigment on the last two objects in the stack.
     // The result will be pushed onto the stack
     void Assignment();
@@ -59,17 +94,43 @@ public:
     // Prints the top object from the stack.
     void PrintObjects(size_t);
 
-    // Runs the GC immediately (mark and sweep)
+    // Runs the GC immediately (mark and sweep), finishing any collection in progress
     void GC();
-    // Runs the GC if conditions are met
+    // Runs the GC on the young generation only (see detail/heap.h)
+    void MinorGC();
+    // Runs the GC if conditions are met, or the next step of a collection in progress
     void SuggestGC();
 
     // Handle instructions
-    void HandleInstruction(Opcode_t opcode);
-    // Execute instructions in the stream until the end is reached
+    void HandleInstruction(DecodedInstruction *ins);
+    // Skip an instruction that is not to be executed at the current read level
+    void SkipInstruction(DecodedInstruction *ins);
+    // Run instructions until the end of the program is reached. Calls and returns
+    // happen within this loop, without recursing.
+    void Dispatch();
+    // Decode the stream, then execute the instructions until the end is reached
     void Execute(ByteStream *);
+    // Execute a program that was translated to C++, instead of interpreting it
+    void Execute(const CompiledProgram &compiled);
+#if AVM_JIT
+    // Counts an execution of the instruction at the start of a call, or of a backward jump.
+    // Compiles the function once it is hot, then continues in native code if there is any.
+    void CountExecution(size_t index, size_t function);
+#endif
 
     VMState *state;
+    // Whether hot functions are compiled to native code. Has no effect unless the VM
+    // was built with AVM_JIT
+    bool jit_enabled;
+    // Whether the old generation is marked by a thread of its own, while the program
+    // keeps running. Has no effect unless the VM was built with AVM_GC_CONCURRENT
+    bool concurrent_marking;
+    // No. threads that sweep the heap, including the one that runs the VM. Has no
+    // effect unless the VM was built with AVM_GC_PARALLEL_SWEEP
+    size_t sweep_threads;
+    // Whether the heap is compacted after every AVM_GC_COMPACT_INTERVAL major
+    // collections. Has no effect unless the VM was built with AVM_GC_COMPACT
+    bool compact_heap;
 
     /** Bind a function with no arguments, and a return type */
     /*template <typename ReturnType>
@@ -95,15 +156,97 @@ public:
     void BindFunction(const AVMString_t &name, void(*ptr) (VMState*, Object**, uint32_t))
     {
         Reference ref(*state->heap.AllocObject<NativeFunc>(ptr));
-        state->frames[state->frame_level]->locals.push_back({ name, ref });
+        Heap::AddRef(ref.Ptr());
+        state->natives[name] = ref;
     }
 
 private:
-    // GC Mark all objects
-    void MarkObjects();
+    // Adds the handles held by the stack, frames and natives to the heap's grey list
+    void GreyRoots();
+#if AVM_GC_REFCOUNT
+    // Deletes the objects whose counts have dropped to zero, other than those that the stack refers to
+    void ReclaimUnreferenced();
+#endif
+    // Collects the young generation, then starts marking the old generation
+    void BeginCollection();
+    // Performs up to 'work' units of marking or sweeping. Returns true once the collection is done
+    bool CollectStep(size_t work);
+    // Sets the no. bytes at which the next major collection begins, once one has finished
+    void SetTrigger();
+    // Collects the heap if 'size' more bytes would pass its limit. Raises OutOfMemoryException
+    // and returns false if they still would
+    bool ReserveHeap(size_t size);
+
+    // Delete the object of a value taken off the stack, if it is temporary
+    void Release(const Value &);
+    // Converts the value of a condition to a boolean
+    bool IsTrue(const Value &);
+    // Moves to the handler of the exception that was raised
+    void UnwindException();
 
     // Create an instance of a natively binded class type
     bool NewNativeObject(const AVMString_t &name);
+
+#if AVM_JIT
+    // Creates the compiler for the program that is being executed
+    Jit *CreateJit();
+    // Stops the dispatch loop after the current instruction, if there is native code at the pc
+    void EnterCompiledCode();
+    // Continues in native code, once the dispatch loop has been stopped for it
+    void RunCompiledCode();
+    // Performs an instruction with the given opcode, for compiled code
+    template <Opcode_t opcode>
+    void HandleOpcode(DecodedInstruction *ins);
+    template <Opcode_t opcode>
+    static void CompiledHandler(VMInstance *vm, DecodedInstruction *ins);
+    static void CompiledUnrecognized(VMInstance *vm, DecodedInstruction *ins);
+    static const uint8_t *ResumeCompiledCode(VMInstance *vm);
+
+    // Null unless a program is being executed with the JIT enabled
+    Jit *jit;
+#endif
+
+    // No. major collections that have finished
+    size_t num_collections;
+    // No. bytes the heap held when the major collection in progress began
+    size_t collection_bytes;
+
+    // Instruction handlers, called with the read level equal to the frame level
+    void Handle_ifl();
+    void Handle_dfl();
+    void Handle_irl();
+    void Handle_drl(const DecodedInstruction &ins);
+    void Handle_irl_if_true();
+    void Handle_irl_if_false();
+    void Handle_jump(const DecodedInstruction &ins);
+    void Handle_jump_if_true(const DecodedInstruction &ins);
+    void Handle_jump_if_false(const DecodedInstruction &ins);
+    void Handle_store_as_local(const DecodedInstruction &ins);
+    void Handle_new_native_object(const DecodedInstruction &ins);
+    void Handle_array_index();
+    void Handle_new_member(const DecodedInstruction &ins);
+    void Handle_load_member(DecodedInstruction &ins);
+    void Handle_load_member_cached(DecodedInstruction &ins);
+    void Handle_new_structure();
+    void Handle_new_function(const DecodedInstruction &ins);
+    void Handle_invoke_object(const DecodedInstruction &ins);
+    void Handle_tail_invoke(const DecodedInstruction &ins);
+    void Handle_leave();
+    void Handle_return();
+    void Handle_break(const DecodedInstruction &ins);
+    void Handle_continue(const DecodedInstruction &ins);
+    void Handle_print(const DecodedInstruction &ins);
+    void Handle_load_local(const DecodedInstruction &ins);
+    void Handle_load_field(const DecodedInstruction &ins);
+    void Handle_load_global(const DecodedInstruction &ins);
+    void Handle_load_integer(const DecodedInstruction &ins);
+    void Handle_load_float(const DecodedInstruction &ins);
+    void Handle_load_string(const DecodedInstruction &ins);
+    void Handle_load_null();
+
+    // Superinstructions, given the frame that holds the field
+    void IncrementField(DecodedInstruction &ins, Frame *frame);
+    void JumpIfNotLessField(DecodedInstruction &ins, Frame *frame);
 };
 } // namespace avm
 
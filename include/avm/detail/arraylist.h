@@ -15,6 +15,8 @@ public:
     void invoke(VMState *, uint32_t);
 
     virtual Reference Clone(VMState *state);
+    virtual Object *Relocate(void *memory);
+    virtual size_t Size() const;
 
     std::string ToString() const;
     std::string TypeString() const;
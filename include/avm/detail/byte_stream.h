@@ -6,23 +6,30 @@
 #include <fstream>
 #include <string>
 #include <sstream>
+#include <cstring>
 
 namespace avm {
 class ByteStream {
 public:
     ByteStream(char *buffer, size_t max);
 
-    inline void ReadBytes(char *ptr, size_t size)
+    // Returns false, and zeroes the bytes instead, if fewer than 'size' are left
+    inline bool ReadBytes(char *ptr, size_t size)
     {
-        for (size_t i = 0; i < size; i++) {
-            ptr[i] = buffer[pos++];
+        if (pos > max || size > max - pos) {
+            std::memset(ptr, 0, size);
+            overrun = true;
+            return false;
         }
+        std::memcpy(ptr, buffer + pos, size);
+        pos += size;
+        return true;
     }
 
     template <typename T>
-    inline void Read(T *ptr, size_t size = sizeof(T))
+    inline bool Read(T *ptr, size_t size = sizeof(T))
     {
-        ReadBytes(reinterpret_cast<char*>(ptr), size);
+        return ReadBytes(reinterpret_cast<char*>(ptr), size);
     }
 
     inline size_t Position() const { return pos; }
@@ -30,11 +37,14 @@ public:
     inline void Seek(size_t address) { pos = address; }
     inline void Skip(size_t amount) { pos += amount; }
     inline bool Eof() const { return pos >= max; }
+    // Whether a read has failed since the stream was created
+    inline bool Overrun() const { return overrun; }
 
 private:
     char *buffer;
     size_t pos;
     size_t max;
+    bool overrun;
 };
 } // namespace avm
 
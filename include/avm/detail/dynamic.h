@@ -24,16 +24,40 @@ public:
 
     explicit Dynamic(const Dynamic &other)
     {
-        auto copy = other.holder->Clone();
-        holder = std::move(copy.first);
-        ptr = copy.second;
+        ptr = nullptr;
+        holder = nullptr;
+        if (other.holder != nullptr) {
+            auto copy = other.holder->Clone();
+            holder = std::move(copy.first);
+            ptr = copy.second;
+        }
+    }
+
+    Dynamic(Dynamic &&other)
+        : holder(std::move(other.holder)),
+          ptr(other.ptr)
+    {
+        other.ptr = nullptr;
+    }
+
+    Dynamic &operator=(Dynamic &&other)
+    {
+        holder = std::move(other.holder);
+        ptr = other.ptr;
+        other.ptr = nullptr;
+        return *this;
     }
 
     Dynamic &operator=(const Dynamic &other)
     {
-        auto copy = other.holder->Clone();
-        holder = std::move(copy.first);
-        ptr = copy.second;
+        if (other.holder == nullptr) {
+            holder = nullptr;
+            ptr = nullptr;
+        } else {
+            auto copy = other.holder->Clone();
+            holder = std::move(copy.first);
+            ptr = copy.second;
+        }
         return *this;
     }
 
@@ -52,7 +76,7 @@ public:
     inline bool Compatible() const
     {
         typedef typename std::decay<T>::type U;
-        return holder->TypeInfo() == typeid(U);
+        return holder != nullptr && holder->TypeInfo() == typeid(U);
     }
 
     template <typename T>
@@ -85,6 +85,14 @@ struct MemberNotFoundException : public Exception {
     }
 };
 
+struct OutOfMemoryException : public Exception {
+    OutOfMemoryException(size_t size, size_t max_size)
+        : Exception("out of memory, the heap holds " + util::to_string(size) +
+            " bytes, but may only hold " + util::to_string(max_size))
+    {
+    }
+};
+
 struct LibraryLoadException : public Exception {
     LibraryLoadException(const std::string &path)
         : Exception("library '" + path + "' could not be loaded")
@@ -25,8 +25,22 @@ public:
     std::vector<std::pair<AVMString_t, Reference>> locals;
     // Last result from a conditional statement
     bool last_cond;
-    // Has an exception occured
-    bool exception_occured;
+};
+
+/** A function call that has not yet returned. Calls are kept in an array in
+    the VM state rather than on the native stack, so making a call only appends
+    to the array, and the depth of recursion is limited by the heap alone. The
+    locals of the call are held by the frames that its body opens.
+*/
+struct CallFrame {
+    // Index of the instruction to continue from when the call returns
+    size_t return_pc;
+    // Read level of the caller, which the return instruction is read at
+    int read_level;
+    // Size of the operand stack before the arguments were pushed
+    size_t stack_base;
+    // Index of the first instruction of the function, to find its exception handlers
+    size_t function;
 };
 } // namespace avm
 
@@ -17,6 +17,8 @@ public:
     size_t NumArgs() const;
 
     virtual Reference Clone(VMState *state);
+    virtual Object *Relocate(void *memory);
+    virtual size_t Size() const;
 
     std::string ToString() const;
     std::string TypeString() const;
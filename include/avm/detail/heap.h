@@ -2,12 +2,32 @@
 #define HEAP_H
 
 #include <detail/object.h>
+#include <detail/vm_config.h>
 
 #include <ostream>
+#include <vector>
+#include <cstdint>
+#if AVM_GC_CONCURRENT || AVM_GC_PARALLEL_SWEEP
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+#if AVM_GC_PARALLEL_SWEEP
+#include <atomic>
+#endif
 
 namespace avm {
+/** Holds the handles that references point to, in blocks that never move, and
+    collects their objects (see vm_config.h for the collector's options).
+*/
 class Heap {
 public:
+    enum Phase {
+        Phase_idle,
+        Phase_mark,
+        Phase_sweep,
+    };
+
     Heap();
     ~Heap();
 
@@ -19,32 +39,319 @@ public:
     {
         static_assert(std::is_base_of<Object, T>::value, "T must be a derived class of object");
 
-        auto *ptr = new HeapObject();
-        ptr->id = num_objects++;
-        ptr->obj = new T(args...);
-        if (head != nullptr) {
-            head->after = ptr;
+        ObjectPtr *handle = AllocNull();
+        *handle = new T(args...);
+        return handle;
+    }
+
+    /** Deletes the object held by the handle, and gives it the new object. Objects
+        held by handles must only be deleted or replaced through this, as the
+        marking thread may be reading them.
+    */
+    void ReplaceObject(ObjectPtr *handle, ObjectPtr obj);
+    inline void DeleteObject(ObjectPtr *handle) { ReplaceObject(handle, nullptr); }
+
+    /** Must be held while an object that is already in the heap gains a field,
+        so that the marking thread does not read its fields meanwhile.
+    */
+    class MutationScope {
+    public:
+        explicit MutationScope(Heap &heap);
+        ~MutationScope();
+
+    private:
+        Heap &heap;
+        bool locked;
+    };
+
+    /** Counts a reference to the handle from a frame, a field or a native. Must be
+        called once the handle has its object, as the count is held by the object.
+    */
+    static inline void AddRef(ObjectPtr *handle)
+    {
+#if AVM_GC_REFCOUNT
+        Object *obj = *handle;
+        if (obj != nullptr && obj->refcount != Object::REFCOUNT_UNKNOWN) {
+            ++obj->refcount;
+        }
+#endif
+    }
+
+    /** Removes a reference counted by AddRef. Handles whose counts drop to zero are
+        only listed while the heap is idle, so that the collector never sees a handle
+        being freed by the count. Those that are not listed are left to the GC.
+    */
+    inline void RemoveRef(ObjectPtr *handle)
+    {
+#if AVM_GC_REFCOUNT
+        Handle *ptr = reinterpret_cast<Handle*>(handle);
+        Object *obj = ptr->obj;
+        if (obj != nullptr && obj->refcount > 0 && --obj->refcount == 0 &&
+            phase == Phase_idle && !ptr->zero_count) {
+            ptr->zero_count = true;
+            zero_count.push_back(ptr);
+        }
+#endif
+    }
+
+#if AVM_GC_REFCOUNT
+    // Whether any handle's count has dropped to zero since the last ReclaimZeroCount
+    inline bool HasZeroCount() const { return !zero_count.empty(); }
+    /** Keeps a handle that the stack refers to from being reclaimed, until it is
+        unpinned. Handles are only marked by collections, so while the heap is idle,
+        the mark is free to be used for this.
+    */
+    inline void Pin(ObjectPtr *handle) { reinterpret_cast<Handle*>(handle)->marked = true; }
+    inline void Unpin(ObjectPtr *handle) { reinterpret_cast<Handle*>(handle)->marked = false; }
+    /** Deletes the objects of the listed handles whose counts are still zero, and
+        that are not pinned. Must only be called while the heap is idle.
+    */
+    void ReclaimZeroCount();
+#endif
+
+    // Whether the handle has survived a collection
+    static inline bool IsOld(const ObjectPtr *handle)
+    {
+        return reinterpret_cast<const Handle*>(handle)->old;
+    }
+
+    /** Marks the handle, so that its fields are marked by the next step. While the
+        heap is idle, only young handles are marked, for a minor collection. While
+        the old generation is being marked, only old handles are.
+    */
+    inline void Grey(ObjectPtr *handle)
+    {
+        Handle *ptr = reinterpret_cast<Handle*>(handle);
+        if (!ptr->marked && ptr->old == (phase != Phase_idle)) {
+            ptr->marked = true;
+            PushGrey(ptr);
+        }
+    }
+
+    // Must be called after an object held by the handle gains a reference to
+    // another handle, or after the handle is given a new object
+    inline void WriteBarrier(ObjectPtr *handle)
+    {
+        Handle *ptr = reinterpret_cast<Handle*>(handle);
+        if (phase == Phase_mark && !concurrent && ptr->marked) {
+            // a black handle is made grey again, so that its fields are marked
+            PushGrey(ptr);
+        }
+        if (ptr->old && !ptr->remembered) {
+            ptr->remembered = true;
+            remembered.push_back(ptr);
         }
-        ptr->before = head;
-        head = ptr;
-        return &ptr->obj;
     }
 
-    void Sweep();
+    // Marks the young handles that are referred to by old handles recorded by the write barrier
+    void MarkRemembered();
+    // Sweeps the young handles only, and promotes those that were marked
+    void SweepYoung();
+
+    // Starts marking the old generation. The young generation must be empty
+    void BeginMark();
+    // Marks the fields of up to 'work' grey handles. Returns true once none are left
+    bool MarkStep(size_t work);
+    // Starts sweeping the old generation, once marking has finished
+    void BeginSweep();
+    /** Sweeps blocks until 'work' handles have been visited, by each sweep thread.
+        Returns true once all have been.
+    */
+    bool SweepStep(size_t work);
+#if AVM_GC_PARALLEL_SWEEP
+    // Sets the no. threads that sweep the heap, including the main thread
+    void SetSweepThreads(size_t num_threads);
+#endif
+
+    inline Phase GetPhase() const { return phase; }
+
+#if AVM_GC_COMPACT
+    /** Moves the objects of sparse slabs to other slabs, in the order of their
+        handles, and releases the sparse slabs. References are unaffected, as only
+        the handles' objects change. Must only be called while the heap is idle, at
+        a point where no object is referred to directly. Returns the no. bytes released.
+    */
+    size_t Compact();
+#endif
+
+#if AVM_GC_CONCURRENT
+    // Hands the grey handles to the marking thread, which is started if it is not running
+    void BeginConcurrentMark();
+    // If the marking thread has no grey handles left, stops it and returns true
+    bool FinishConcurrentMark();
+    // Marks the fields of up to 'work' grey handles on this thread, alongside the marking thread
+    void AssistConcurrentMark(size_t work);
+    // Stops the marking thread, leaving any grey handles to MarkStep
+    void StopConcurrentMark();
+#endif
+    // Whether the old generation is being marked by the marking thread
+    inline bool IsMarkingConcurrently() const { return concurrent; }
+
+    // Measures the objects of the handles allocated since this was last called
+    void MeasureYoung();
+    // No. bytes held by the objects of the heap, as last measured
+    inline size_t NumBytes() const { return num_bytes; }
+    // No. bytes held by the objects of the young generation, as last measured
+    inline size_t YoungBytes() const { return young_bytes; }
+
     void DumpHeap(std::ostream &os) const;
     uint32_t NumObjects() const;
+    // No. handles allocated since the heap was created
+    inline size_t NumAllocated() const { return num_allocated; }
+    uint32_t NumYoung() const;
 
 private:
-    struct HeapObject {
-        unsigned long id;
-        ObjectPtr obj = nullptr;
-        HeapObject *before = nullptr;
-        HeapObject *after = nullptr;
+    struct Handle {
+        // Must be first, as references point to it
+        ObjectPtr obj;
+        // Next handle in the free list, or the handle itself while it is in use
+        Handle *next_free;
+        // Whether the handle has survived a collection
+        bool old;
+        // Whether the handle is in the remembered set
+        bool remembered;
+        // Whether the handle has been reached by the collection that is running
+        bool marked;
+        // Whether the handle is in the list of handles whose counts have dropped to zero
+        bool zero_count;
+        // No. bytes the object held when it was last measured. Saturates
+        uint32_t size;
     };
 
-    HeapObject *head;
+    struct HandleBlock {
+        Handle *free_list;
+        size_t num_used;
+        Handle handles[AVM_HEAP_BLOCK_SIZE];
+    };
+
+    // Blocks are aligned to their size, so that the block of a handle is found by masking
+    static const size_t BLOCK_ALIGNMENT;
+
+    static inline HandleBlock *BlockOf(Handle *handle)
+    {
+        return reinterpret_cast<HandleBlock*>(reinterpret_cast<uintptr_t>(handle) & ~(uintptr_t)(BLOCK_ALIGNMENT - 1));
+    }
+
+    inline void Measure(Handle *handle)
+    {
+        size_t size = (handle->obj != nullptr) ? handle->obj->Size() : 0;
+        if (size > UINT32_MAX) {
+            size = UINT32_MAX;
+        }
+        num_bytes = num_bytes - handle->size + size;
+        if (!handle->old) {
+            young_bytes = young_bytes - handle->size + size;
+        }
+        handle->size = (uint32_t)size;
+    }
+
+    inline void PushGrey(Handle *ptr)
+    {
+        if (grey.size() < AVM_GC_MARK_STACK_SIZE) {
+            grey.push_back(ptr);
+        } else {
+            grey_overflow = true;
+        }
+    }
+
+    // Marks the fields of up to 'work' grey handles, without rescanning the heap. Returns the no. marked
+    size_t MarkGrey(size_t work);
+    /** Greys the fields of every marked handle of the generation being marked,
+        after the grey list has overflowed. Only the main thread may call this, as
+        it reads the list of blocks.
+    */
+    void RescanMarked();
+
+#if AVM_GC_REFCOUNT
+    // Empties the list of handles whose counts have dropped to zero, before the GC frees any handle
+    void ClearZeroCount();
+#endif
+
+    // Deletes the object of the handle, and gives it the new one
+    void SetObject(Handle *handle, ObjectPtr obj);
+
+    // Finds a block with a free handle, allocating one if there is none
+    void FindFreeBlock();
+    /** Deletes the object of a handle, and adds the handle to its block's free list.
+        The no. objects is left to the caller, as blocks may be swept in parallel.
+    */
+    void FreeHandle(Handle *handle);
+    // Sweeps the old handles of a block. Returns the no. handles freed, and adds the bytes they held
+    size_t SweepBlock(HandleBlock *block, size_t &freed_bytes);
+#if AVM_GC_CONCURRENT
+    // Run by the marking thread until the heap is destroyed
+    void MarkerLoop();
+#endif
+#if AVM_GC_PARALLEL_SWEEP
+    // Sweeps the blocks from sweep_index up to 'end' on every sweep thread
+    void SweepInParallel(size_t end);
+    // Sweeps the blocks that are left in the step, one at a time. Returns the no. handles freed
+    size_t SweepClaimedBlocks(SlabAllocator::FreeBatch &batch, size_t &freed_bytes);
+    // Run by each sweep thread but the main thread, until the heap is destroyed
+    void SweeperLoop(size_t round);
+    void StopSweepers();
+#endif
+
+    // Blocks that have been released by the sweep are null until it finishes
+    std::vector<HandleBlock*> blocks;
+    // Index of the block that handles are being allocated from
+    size_t alloc_index;
+    // Handles allocated since the last collection
+    std::vector<Handle*> young;
+    // No. young handles that have been measured since the last collection
+    size_t num_measured;
+    // Old handles that may refer to young handles
+    std::vector<Handle*> remembered;
+    // Marked handles whose fields have not yet been marked
+    std::vector<Handle*> grey;
+    // Whether a handle has been marked while the grey list was full
+    bool grey_overflow;
+#if AVM_GC_REFCOUNT
+    // Handles whose counts have dropped to zero since the last ReclaimZeroCount
+    std::vector<Handle*> zero_count;
+#endif
+    Phase phase;
+    // Index of the next block to sweep, and the no. blocks when the sweep began
+    size_t sweep_index;
+    size_t sweep_end;
+    // Whether the sweep has kept a block with no handles in use
+    bool kept_empty;
+    // Only changed by the main thread, with the lock held
+    bool concurrent;
+#if AVM_GC_CONCURRENT
+    std::thread marker;
+    // Held by the marking thread while it marks, and by the main thread while it changes old handles
+    std::mutex lock;
+    // Wakes the marking thread when there are grey handles, or when it is to exit
+    std::condition_variable wake;
+    bool marker_exit;
+#endif
+#if AVM_GC_PARALLEL_SWEEP
+    size_t sweep_threads;
+    std::vector<std::thread> sweepers;
+    // Held while a step is handed to the sweep threads, and while they finish it
+    std::mutex sweep_lock;
+    std::condition_variable sweep_wake;
+    std::condition_variable sweep_done;
+    // Incremented for each step that is swept in parallel
+    size_t sweep_round;
+    // No. sweep threads that have not finished the step
+    size_t sweep_pending;
+    // Next block of the step to be claimed, and the end of the step
+    std::atomic<size_t> sweep_next;
+    size_t sweep_stop;
+    // No. handles freed by the sweep threads during the step, and the bytes they held
+    size_t sweep_freed;
+    size_t sweep_freed_bytes;
+    // Memory freed by the sweep threads, added to the free lists of the main thread
+    std::vector<SlabAllocator::FreeBatch> sweep_batches;
+    bool sweepers_exit;
+#endif
     uint32_t num_objects;
+    size_t num_allocated;
+    size_t num_bytes;
+    size_t young_bytes;
 };
 }
 
-#endif
\ No newline at end of file
+#endif
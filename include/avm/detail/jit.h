@@ -0,0 +1,131 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <detail/vm_config.h>
+#include <detail/program.h>
+
+#if AVM_JIT
+
+#include <vector>
+#include <utility>
+#include <exception>
+#include <cstdint>
+#include <cstddef>
+
+namespace avm {
+class VMInstance;
+class VMState;
+class CodeBuffer;
+
+// Performs a single instruction for compiled code, with the read level equal to the frame level
+typedef void (*JitHandler_t)(VMInstance *, DecodedInstruction *);
+// Skips instructions as the interpreter would, then returns the native code to continue
+// at, or null if execution must continue in the interpreter
+typedef const uint8_t *(*JitResume_t)(VMInstance *);
+
+/** Baseline compiler from decoded instructions to x86-64 code.
+    Each instruction is translated with a fixed template, which stores the pc and calls
+    the handler for the instruction's current opcode, so that quickened instructions keep
+    being rewritten. What the native code saves is the dispatch: jumps go directly to the
+    code of their target, and after each instruction only the pc limit is checked, unless
+    the instruction may change the pc or the read level. Whenever the pc is not one that
+    the code was compiled to continue at, the resume function finds the code for the new
+    pc, which may be in another function, so calls and returns between compiled functions
+    do not leave native code.
+
+    Pushing constants, popping inline values, conditional jumps and integer arithmetic
+    are performed by the template itself while the operands are held inline, and only
+    call the handler otherwise. The pc is not stored by these, since the next handler
+    that is called stores its own.
+
+    Compiled code is shared by all calls of a function, and is kept until the program
+    has finished.
+*/
+class Jit {
+public:
+    // Handlers and changes_level are indexed by opcode
+    Jit(VMInstance *vm, VMState *state, const JitHandler_t *handlers,
+        const bool *changes_level, JitResume_t resume);
+    Jit(const Jit &other) = delete;
+    ~Jit();
+
+    // Counts an execution of the instruction, which is either the start of a function
+    // or a backward jump. Returns true once, when it has been executed often enough
+    // for its function to be compiled
+    inline bool Count(size_t index) { return ++counters[index] == AVM_JIT_THRESHOLD; }
+    // Native code that performs the instruction, or null if it is not compiled
+    inline const uint8_t *EntryAt(size_t index) const { return entries[index]; }
+    // Whether native code is being executed
+    inline bool IsRunning() const { return running; }
+
+    // Compiles the function whose body starts at the given index, or the global code
+    // if it is AVM_NO_FUNCTION. The bodies of functions declared within it are left
+    // to be compiled on their own.
+    void Compile(size_t function);
+    // Continues at the pc in native code until it returns to the interpreter, then
+    // rethrows any C++ exception that was raised by a handler. Instructions are
+    // skipped first if the read level is below the frame level
+    void Run();
+    // Called by handlers, as a C++ exception may not unwind through native code.
+    // The native code returns after the current instruction.
+    void Abort(std::exception_ptr ex);
+
+private:
+    // Index of the instruction after the return instruction of the function
+    size_t FunctionEnd(size_t begin) const;
+    // Whether the instruction is part of the function being compiled
+    bool InUnit(size_t index) const;
+    // Emits the template of an instruction
+    void EmitInstruction(CodeBuffer &buffer, size_t index);
+    // Emits the code that performs an instruction while its operands are held inline.
+    // Returns the jumps to be patched to the handler call, or nothing if there is no such code
+    std::vector<size_t> EmitFastPath(CodeBuffer &buffer, size_t index);
+    // Stores the pc past the instruction, calls its handler, and moves to the instruction
+    // that the handler left the pc at
+    void EmitHandlerCall(CodeBuffer &buffer, size_t index);
+    // Continues at the instruction, from code that has not stored the pc
+    void EmitContinue(CodeBuffer &buffer, size_t index);
+    // Copies code to new executable pages. Returns null if they could not be mapped
+    const uint8_t *MapCode(const std::vector<uint8_t> &code);
+
+    VMInstance *vm;
+    VMState *state;
+    const JitHandler_t *handlers;
+    const bool *changes_level;
+    JitResume_t resume;
+
+    // Executions counted at each instruction
+    std::vector<uint32_t> counters;
+    // Native code of each instruction, with one more for the end of the program
+    std::vector<const uint8_t*> entries;
+    // Executable pages, unmapped when the compiler is destroyed
+    std::vector<std::pair<void*, size_t>> pages;
+    // Saves registers, then jumps to the entry. The same registers are restored by
+    // the code that returns to the interpreter
+    void (*enter)(VMInstance *, VMState *, const JitHandler_t *, const uint8_t *);
+
+    bool running;
+    std::exception_ptr pending;
+
+    // The instructions of the function being compiled
+    size_t unit_begin;
+    size_t unit_end;
+    std::vector<bool> unit_included;
+
+    // Whether the operand stack may be read by native code. It is read directly, so
+    // the layout of the values is checked when the compiler is created
+    bool use_fast_paths;
+
+    // Byte offsets of the fields that the native code reads from the VM state
+    int32_t pc_offset;
+    int32_t pc_limit_offset;
+    int32_t read_level_offset;
+    int32_t frame_level_offset;
+    int32_t stack_end_offset;
+    int32_t stack_capacity_offset;
+};
+} // namespace avm
+
+#endif
+
+#endif
@@ -24,7 +24,8 @@ public:
         Object **args = new Object*[callargs];
 
         for (int i = callargs - 1; i >= 0; i--) {
-            Reference ref = state->stack.back(); state->stack.pop_back();
+            // natives receive objects, so inline values are boxed
+            Reference ref = state->stack.back().Box(state->heap); state->stack.pop_back();
             args[i] = ref.Ref();
         }
 
@@ -37,6 +38,18 @@ public:
         return Reference(*state->heap.AllocObject<NativeFunc>(ptr));
     }
 
+    Object *Relocate(void *memory)
+    {
+        NativeFunc *moved = new (memory) NativeFunc(ptr);
+        MoveTo(moved);
+        return moved;
+    }
+
+    size_t Size() const
+    {
+        return sizeof(NativeFunc) + FieldsSize();
+    }
+
     std::string ToString() const
     {
         return "<" + TypeString() + ">";
@@ -2,6 +2,8 @@
 #define OBJECT_H
 
 #include <detail/reference.h>
+#include <detail/slab_allocator.h>
+#include <detail/shape.h>
 #include <common/types.h>
 
 #include <memory>
@@ -13,37 +15,87 @@ namespace avm {
 class Heap;
 class Reference;
 class VMState;
+class Value;
 
 class Object {
 public:
     enum : int {
         FLAG_TEMPORARY = 0x01,
-        FLAG_CONST = 0x02,
-        FLAG_MARKED = 0x04
+        FLAG_CONST = 0x02
     };
 
     virtual ~Object() = default;
 
+    // Objects are allocated from slabs by size, rather than one at a time
+    static void *operator new(size_t size) { return SlabAllocator::Allocate(size); }
+    static void operator delete(void *ptr, size_t size) { SlabAllocator::Free(ptr, size); }
+    // Constructs an object in memory that is already allocated, when it is relocated
+    static void *operator new(size_t, void *memory) { return memory; }
+    static void operator delete(void *, void *) {}
+
     virtual void invoke(VMState *state, uint32_t nargs) = 0;
     virtual Reference Clone(VMState *state) = 0;
+    /** Moves the object into the memory, which is a block of the same size class,
+        and returns the moved object. This object is left empty, to be destroyed by
+        the caller without freeing its memory (see Heap::Compact).
+    */
+    virtual Object *Relocate(void *memory) = 0;
+    /** No. bytes of memory held by the object, including what it allocates, such
+        as its fields. The heap measures objects to decide when to collect them
+    */
+    virtual size_t Size() const = 0;
 
     bool AddFieldReference(VMState *state, const AVMString_t &name, Reference ref);
     bool GetFieldReference(VMState *state, const AVMString_t &name, Reference &out);
     bool GetFieldReference(VMState *state, size_t index, Reference &out);
+    /** Gets the field at the index, only if it has the given name. The name must be
+        the shape's own copy (see FieldName), so that only its address is compared.
+    */
+    inline bool GetFieldReference(size_t index, const AVMString_t *name, Reference &out)
+    {
+        if (shape != nullptr && shape->HasName(index, name)) {
+            out = slots[index];
+            return true;
+        }
+        return false;
+    }
+    // Returns the index of the field with the given name, or -1 if there is none
+    int FieldIndex(const AVMString_t &name) const;
+    // Name of the field at the index, which must be less than the no. fields
+    inline const AVMString_t &FieldName(size_t index) const { return shape->Name(index); }
 
-    void Mark();
+    // Adds the handles of its fields to the heap's grey list (see Heap::Grey)
+    void GreyFields(Heap &heap);
+    // Removes the references that its fields count, before it is deleted (see Heap::RemoveRef)
+    void ReleaseFields(Heap &heap);
+    // Address of the list of fields, so that it may be prefetched before GreyFields
+    inline const void *FieldData() const { return slots.data(); }
 
     virtual std::string ToString() const = 0;
     virtual std::string TypeString() const = 0;
 
+    /** If the object holds a value that may be held inline on the stack,
+        it is copied to 'out' and true is returned.
+    */
+    virtual bool ToInline(Value &out) const { return false; }
+
+    // The count of a handle whose object was deleted is lost, so the next object is not counted
+    static const int REFCOUNT_UNKNOWN = -1;
+
     int flags = 0;
-    int refcount = 1;
+    // No. references to the object's handle from frames, fields and natives (see Heap::AddRef)
+    int refcount = 0;
 
 protected:
-    std::vector<std::pair<AVMString_t, Reference>> fields;
+    // Moves the flags and fields to an object that is being relocated
+    void MoveTo(Object *moved);
+    // No. bytes allocated for the fields. Their names are held by the shape
+    inline size_t FieldsSize() const { return slots.capacity() * sizeof(slots[0]); }
 
-private:
-    void MarkFields();
+    // Names and order of the fields, shared with objects built the same way. Null until a field is added
+    Shape *shape = nullptr;
+    // The fields, in the order of the shape's members
+    std::vector<Reference> slots;
 };
 typedef Object* ObjectPtr;
 } // namespace avm
@@ -0,0 +1,117 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include <detail/byte_stream.h>
+#include <detail/vm_config.h>
+#include <common/instructions.h>
+#include <common/types.h>
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+namespace avm {
+/** An instruction with its operands already decoded. Every instruction has
+    the same size, so that the interpreter can index the program directly.
+    The interpreter may rewrite the opcode of an instruction in place, to a form
+    that is specialized for the types it has seen (see AVM_QUICKENING).
+*/
+struct DecodedInstruction {
+    struct FunctionInfo {
+        uint32_t address;
+        uint32_t num_args;
+    };
+
+    struct FieldInfo {
+        int32_t frame_index_difference;
+        int32_t field_index;
+    };
+
+    Opcode_t opcode;
+    // Is variadic (newf)
+    uint8_t is_variadic;
+    // No. times in a row the same operand types were seen (quickening)
+    uint8_t feedback_count;
+    // No. times the instruction was changed back to its generic form (quickening)
+    uint8_t deopt_count;
+    // The typed opcode that the operand types seen so far call for (operations),
+    // or the index of the field that was found last (mbr)
+    uint32_t feedback;
+
+    union {
+        // Index of the instruction to jump to (jmpb, jmpbt, jmpbf)
+        uint32_t target;
+        // Index of the function body, and no. arguments (newf)
+        FunctionInfo function;
+        // Location of the field (load_field, global)
+        FieldInfo field;
+        // No. levels (drl, break, cont), or no. arguments (ivk, echo)
+        int32_t count;
+        // Value (intn)
+        AVMInteger_t integer;
+        // Value (float)
+        AVMFloat_t number;
+        // Name or string from the constant pool (store, newn, newm, mbr, local, str).
+        // Once mbr is cached, its name is the one interned by the shapes instead
+        const AVMString_t *string;
+    };
+};
+
+// Function of an exception handler that protects global code
+static const uint32_t AVM_NO_FUNCTION = (uint32_t)-1;
+
+/** An entry of the exception table, with positions resolved to instruction indices.
+    The instructions from begin up to end are protected by the handler, but only
+    while the function whose body starts at the given index is being executed.
+*/
+struct ExceptionHandler {
+    uint32_t begin;
+    uint32_t end;
+    // Index of the first instruction of the catch block
+    uint32_t handler;
+    // Index of the first instruction of the function, or AVM_NO_FUNCTION
+    uint32_t function;
+    // No. frames open within the function at the try block
+    uint32_t frame_depth;
+};
+
+/** The instructions of a bytecode file, decoded once when the file is loaded.
+    Names and strings point into the constant pool, and jump offsets are resolved
+    to the index of the instruction they land on.
+*/
+class Program {
+public:
+    Program();
+    Program(const Program &other) = delete;
+
+    // Decodes all instructions from the stream. Returns false if the stream is invalid.
+    bool Load(ByteStream *stream);
+    // Returns the innermost handler protecting the instruction while the given function
+    // is executed, or null if there is none
+    const ExceptionHandler *FindHandler(size_t index, size_t function) const;
+
+    // The string constants that string operands point into
+    inline const std::vector<AVMString_t> &GetStrings() const { return strings; }
+    // Replaces the string constants, for programs that are built without any bytecode.
+    // Must be called before instructions are given string operands
+    void SetStrings(const std::vector<AVMString_t> &value);
+
+    std::vector<DecodedInstruction> code;
+    // Innermost try blocks first
+    std::vector<ExceptionHandler> handlers;
+
+private:
+    // Reads the string and float constants that follow the signature
+    bool LoadConstants(ByteStream *stream);
+    // Reads the exception table that follows the constants. Positions are not yet resolved.
+    bool LoadExceptionTable(ByteStream *stream);
+    // Rewrites the first instruction of common sequences into a superinstruction
+    void FuseInstructions();
+
+    // Not resized after loading, so instructions may point to the strings
+    std::vector<AVMString_t> strings;
+    std::vector<AVMFloat_t> floats;
+};
+} // namespace avm
+
+#endif
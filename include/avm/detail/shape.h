@@ -0,0 +1,64 @@
+#ifndef SHAPE_H
+#define SHAPE_H
+
+#include <common/types.h>
+
+#include <memory>
+#include <vector>
+#include <utility>
+
+namespace avm {
+/** The layout of an object's fields: the names of its members, in the order they
+    were added, which is the order of the object's slots. Objects whose members are
+    added in the same order share a shape, so each of them only holds its slots.
+
+    Shapes form a tree from the empty shape. Adding a member moves an object to the
+    child shape for that name (a transition), which is created the first time it is
+    taken. Shapes hold interned copies of the names, so that a name that was found in
+    a shape may be checked again by its address alone (see Object::GetFieldReference).
+    A child shares the list of names of its parent, if it is the first to extend it.
+
+    Shapes are never freed, as there are only as many as there are layouts. Like
+    objects, they are only created by the thread that runs the VM, so each thread
+    has a tree of its own, which is not locked.
+*/
+class Shape {
+public:
+    Shape(const Shape &other) = delete;
+
+    // The shape of an object without members
+    static Shape *Empty();
+
+    /** The shape that has the members of this one, followed by the given name.
+        Returns null if this shape already has a member of that name.
+    */
+    Shape *AddMember(const AVMString_t &name);
+    // Returns the index of the slot of the member with the given name, or -1 if there is none
+    int Find(const AVMString_t &name) const;
+
+    inline size_t NumMembers() const { return num_members; }
+    // The interned name of the member in the slot, which must be less than NumMembers
+    inline const AVMString_t &Name(size_t index) const { return *(*names)[index]; }
+    // Whether the member in the slot has the name, given the address of its interned copy
+    inline bool HasName(size_t index, const AVMString_t *name) const
+    {
+        return index < num_members && (*names)[index] == name;
+    }
+
+private:
+    typedef std::vector<const AVMString_t*> Names;
+
+    Shape(const std::shared_ptr<Names> &names, size_t num_members);
+
+    // The one copy of the name that shapes hold
+    static const AVMString_t *Intern(const AVMString_t &name);
+
+    // Names of the members by slot. Only the first num_members are of this shape
+    std::shared_ptr<Names> names;
+    size_t num_members;
+    // Child shapes by the name of the member that they add
+    std::vector<std::pair<const AVMString_t*, std::unique_ptr<Shape>>> transitions;
+};
+} // namespace avm
+
+#endif
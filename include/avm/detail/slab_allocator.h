@@ -0,0 +1,146 @@
+#ifndef SLAB_ALLOCATOR_H
+#define SLAB_ALLOCATOR_H
+
+#include <detail/vm_config.h>
+
+#include <cstddef>
+#include <vector>
+
+// The library is loaded with the program, so its thread-local variables may be read directly
+#if defined(__GNUC__) || defined(__clang__)
+#define AVM_INITIAL_EXEC_TLS __attribute__((tls_model("initial-exec")))
+#else
+#define AVM_INITIAL_EXEC_TLS
+#endif
+
+namespace avm {
+/** Allocates objects from slabs, which are divided into blocks of a single size.
+    Sizes are rounded up to a multiple of the alignment, and each size class keeps a
+    free list of its blocks, so allocating or freeing only pushes or pops a list.
+    Slabs are mapped from the OS, and are only released by compaction, once the
+    objects of sparse slabs have been moved to other slabs (see Heap::Compact).
+    Each thread has free lists and slabs of its own, so VMs may run on different
+    threads without locking. A VM's objects are allocated and freed by the thread
+    that runs it; memory freed on another thread joins that thread's free lists.
+
+    While the heap is swept by several threads, each of them frees into a batch of
+    its own instead, and the thread that runs the VM adds the batches to its free
+    lists once they have finished, one list at a time.
+*/
+class SlabAllocator {
+public:
+    static const size_t ALIGNMENT = 16;
+    static const size_t NUM_CLASSES = AVM_SLAB_MAX_OBJECT_SIZE / ALIGNMENT;
+
+    static inline void *Allocate(size_t size)
+    {
+        if (size == 0 || size > AVM_SLAB_MAX_OBJECT_SIZE) {
+            return ::operator new(size);
+        }
+
+        size_t size_class = (size - 1) / ALIGNMENT;
+        FreeLists &lists = free_lists;
+        FreeBlock *block = lists.heads[size_class];
+        if (block == nullptr) {
+            block = Refill(size_class);
+        }
+        lists.heads[size_class] = block->next;
+        return block;
+    }
+
+    // The size must be the one the memory was allocated with
+    static inline void Free(void *ptr, size_t size)
+    {
+        if (ptr == nullptr) {
+            return;
+        }
+        if (size == 0 || size > AVM_SLAB_MAX_OBJECT_SIZE) {
+            ::operator delete(ptr);
+            return;
+        }
+
+        size_t size_class = (size - 1) / ALIGNMENT;
+        FreeBlock *block = static_cast<FreeBlock*>(ptr);
+        FreeLists &lists = free_lists;
+        if (lists.batch != nullptr) {
+            FreeToBatch(lists.batch, block, size_class);
+            return;
+        }
+        block->next = lists.heads[size_class];
+        lists.heads[size_class] = block;
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+public:
+    // Blocks freed by a single thread, listed by size class
+    class FreeBatch {
+    public:
+        FreeBatch();
+
+    private:
+        friend class SlabAllocator;
+        FreeBlock *heads[NUM_CLASSES];
+        FreeBlock *tails[NUM_CLASSES];
+    };
+
+    // Frees on this thread go to the batch, until EndBatch is called
+    static void BeginBatch(FreeBatch *batch);
+    static void EndBatch();
+    // Adds the blocks of a batch to the free lists of this thread, and empties it
+    static void ReleaseBatch(FreeBatch &batch);
+
+    /** Compaction. Every object that is in use is counted, and a slab whose objects
+        are all counted, and that is no more than 'threshold' percent full, may be
+        evacuated. Its blocks are taken out of the free lists, its objects are moved
+        to blocks allocated with AllocateLike, and it is released by EndCompaction.
+        A slab with objects that were not counted, such as those of another heap, is
+        left as it is.
+    */
+    static void BeginCompaction();
+    static void CountObject(const void *ptr);
+    // Chooses the slabs to evacuate. Returns false if there are none
+    static bool SelectSparseSlabs(size_t threshold);
+    static bool IsEvacuated(const void *ptr);
+    // Allocates a block of the same size class as the object, outside of the evacuated slabs
+    static void *AllocateLike(const void *ptr);
+    // Releases the evacuated slabs. Returns the no. bytes released
+    static size_t EndCompaction();
+
+private:
+    struct Slab {
+        char *memory;
+        size_t size_class;
+        // No. objects counted during compaction
+        size_t num_counted;
+        // No. free blocks, found during compaction
+        size_t num_free;
+        bool evacuate;
+
+        inline bool operator<(const Slab &other) const { return memory < other.memory; }
+    };
+
+    // The free lists of a thread, by size class
+    struct FreeLists {
+        FreeBlock *heads[NUM_CLASSES];
+        // The batch that frees go to instead, or null
+        FreeBatch *batch;
+    };
+
+    static void FreeToBatch(FreeBatch *batch, FreeBlock *block, size_t size_class);
+    // Finds the slab that holds the pointer. The slabs must be sorted
+    static Slab *FindSlab(const void *ptr);
+
+    // Divides a new slab into blocks of the size class. Returns the first block
+    static FreeBlock *Refill(size_t size_class);
+
+    static thread_local FreeLists free_lists AVM_INITIAL_EXEC_TLS;
+    // The slabs mapped by this thread
+    static thread_local std::vector<Slab> slabs;
+};
+} // namespace avm
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef VALUE_H
+#define VALUE_H
+
+#include <detail/reference.h>
+#include <detail/heap.h>
+#include <common/types.h>
+
+#include <string>
+#include <cstdint>
+
+namespace avm {
+class Variable;
+
+/** A value held on the operand stack. Integers, floats and null are stored
+    inline, so that pushing a literal or the result of an arithmetic operation
+    does not allocate anything. Booleans are integers in the AVM, so they are
+    held inline as well. Strings, structures and functions live on the heap,
+    and are held as a reference.
+*/
+class Value {
+public:
+    enum Type : uint8_t {
+        Type_null,
+        Type_int,
+        Type_float,
+        Type_reference,
+    };
+
+    Value()
+        : type(Type_null),
+          ptr(nullptr)
+    {
+    }
+
+    // Not explicit, so that references may be pushed to the stack directly
+    Value(const Reference &ref)
+        : type(Type_reference),
+          ptr(ref.Ptr())
+    {
+    }
+
+    explicit Value(AVMInteger_t int_value)
+        : type(Type_int),
+          int_value(int_value)
+    {
+    }
+
+    explicit Value(AVMFloat_t float_value)
+        : type(Type_float),
+          float_value(float_value)
+    {
+    }
+
+    inline bool IsReference() const { return type == Type_reference; }
+    // Only valid for references
+    inline Reference Ref() const { return Reference(*ptr); }
+    // The object that is referenced, or null for inline values
+    inline Object *GetObject() const { return (type == Type_reference) ? *ptr : nullptr; }
+
+    /** Reads a number or null, whether it is held inline or by a variable on
+        the heap. Returns false for any other object.
+    */
+    inline bool ToInline(Value &out) const
+    {
+        if (type != Type_reference) {
+            out = *this;
+            return true;
+        }
+        return (*ptr != nullptr) && (*ptr)->ToInline(out);
+    }
+
+    /** Returns the reference, or allocates a variable on the heap to hold
+        an inline value. The new variable is marked temporary.
+    */
+    Reference Box(Heap &heap) const;
+
+    std::string ToString() const;
+    std::string TypeString() const;
+
+    Type type;
+    union {
+        AVMInteger_t int_value;
+        AVMFloat_t float_value;
+        Object **ptr;
+    };
+};
+} // namespace avm
+
+#endif
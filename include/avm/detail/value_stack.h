@@ -0,0 +1,72 @@
+#ifndef VALUE_STACK_H
+#define VALUE_STACK_H
+
+#include <detail/value.h>
+
+#include <cstddef>
+#include <algorithm>
+
+namespace avm {
+/** The operand stack. Values are held in a single array, which is reallocated
+    with twice the room once it is full. The bounds are plain pointers, so that
+    compiled code may push and pop values in place (see Jit).
+*/
+class ValueStack {
+public:
+    ValueStack()
+        : first(nullptr),
+          last(nullptr),
+          limit(nullptr)
+    {
+    }
+
+    ValueStack(const ValueStack &other) = delete;
+    ValueStack &operator=(const ValueStack &other) = delete;
+
+    ~ValueStack();
+
+    inline void push_back(const Value &value)
+    {
+        if (last == limit) {
+            Grow();
+        }
+        *last++ = value;
+    }
+
+    inline void pop_back() { --last; }
+
+    inline Value &back() { return last[-1]; }
+    inline const Value &back() const { return last[-1]; }
+    inline Value &operator[](size_t index) { return first[index]; }
+    inline const Value &operator[](size_t index) const { return first[index]; }
+
+    inline Value *begin() { return first; }
+    inline Value *end() { return last; }
+    inline const Value *begin() const { return first; }
+    inline const Value *end() const { return last; }
+    inline Value *data() { return first; }
+
+    inline size_t size() const { return last - first; }
+    inline size_t capacity() const { return limit - first; }
+    inline bool empty() const { return last == first; }
+
+    void reserve(size_t size);
+
+    // Removes the values from 'from' up to 'to', moving those after them down
+    inline void erase(Value *from, Value *to)
+    {
+        last = std::copy(to, last, from);
+    }
+
+    // The first value, the end of the values, and the end of the room for them
+    Value *first;
+    Value *last;
+    Value *limit;
+
+private:
+    // Doubles the room, out of line, so that each push only inlines the check
+    void Grow();
+};
+} // namespace avm
+
+#endif
@@ -14,6 +14,7 @@
 
 namespace avm {
 class VMState;
+class Value;
 
 class Variable : public Object {
 public:
@@ -47,8 +48,15 @@ public:
         SetValue<Decayed>(value);
     }
 
+    /** Assign a number or null that was held inline on the stack */
+    void AssignInline(const Value &v);
+    /** If this holds a number or null, and has no fields, it may be held inline on the stack */
+    bool ToInline(Value &out) const override;
+
     virtual void invoke(VMState *, uint32_t);
     virtual Reference Clone(VMState *state);
+    virtual Object *Relocate(void *memory);
+    virtual size_t Size() const;
 
     /** Arithmetic operations */
     Variable &Add(VMState *state, Variable *other);
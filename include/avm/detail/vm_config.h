@@ -0,0 +1,153 @@
+#ifndef VM_CONFIG_H
+#define VM_CONFIG_H
+
+// Build-time options of the VM. Each may be overridden on the command line, e.g. -DAVM_JIT=0
+
+// Use the computed goto interpreter loop instead of the switch. Needs GCC or Clang
+#ifndef AVM_THREADED_DISPATCH
+#if defined(__GNUC__) || defined(__clang__)
+#define AVM_THREADED_DISPATCH 1
+#else
+#define AVM_THREADED_DISPATCH 0
+#endif
+#endif
+
+// Rewrite generic instructions into typed forms once they keep seeing the same operand types
+#ifndef AVM_QUICKENING
+#define AVM_QUICKENING 1
+#endif
+
+// No. times in a row an instruction must see the same operand types before it is rewritten
+#ifndef AVM_QUICKEN_THRESHOLD
+#define AVM_QUICKEN_THRESHOLD 4
+#endif
+
+// No. times an instruction may be changed back to its generic form before it stays generic
+#ifndef AVM_QUICKEN_MAX_DEOPT
+#define AVM_QUICKEN_MAX_DEOPT 4
+#endif
+
+// Fuse common instruction sequences into superinstructions when a program is loaded
+#ifndef AVM_SUPERINSTRUCTIONS
+#define AVM_SUPERINSTRUCTIONS 1
+#endif
+
+// Compile hot functions to native code (see detail/jit.h). x86-64 Linux only
+#ifndef AVM_JIT
+#if defined(__x86_64__) && defined(__linux__)
+#define AVM_JIT 1
+#else
+#define AVM_JIT 0
+#endif
+#endif
+
+// No. calls of a function, or backward jumps taken within it, before it is compiled
+#ifndef AVM_JIT_THRESHOLD
+#define AVM_JIT_THRESHOLD 100
+#endif
+
+// No. handles in each block of the heap
+#ifndef AVM_HEAP_BLOCK_SIZE
+#define AVM_HEAP_BLOCK_SIZE 1024
+#endif
+
+// Size in bytes of each slab that objects are allocated from (see detail/slab_allocator.h)
+#ifndef AVM_SLAB_SIZE
+#define AVM_SLAB_SIZE (64 * 1024)
+#endif
+
+// Objects larger than this many bytes are allocated with the global operator new
+#ifndef AVM_SLAB_MAX_OBJECT_SIZE
+#define AVM_SLAB_MAX_OBJECT_SIZE 256
+#endif
+
+// Collect the young generation on its own in minor collections
+#ifndef AVM_GC_GENERATIONAL
+#define AVM_GC_GENERATIONAL 1
+#endif
+
+// No. objects that may be allocated before the young generation is collected
+#ifndef AVM_GC_NURSERY_SIZE
+#define AVM_GC_NURSERY_SIZE 512
+#endif
+
+// Default for HeapPolicy::nursery_bytes
+#ifndef AVM_GC_NURSERY_BYTES
+#define AVM_GC_NURSERY_BYTES (1024 * 1024)
+#endif
+
+// Default for HeapPolicy::min_trigger_bytes
+#ifndef AVM_GC_MIN_TRIGGER_BYTES
+#define AVM_GC_MIN_TRIGGER_BYTES (4 * 1024 * 1024)
+#endif
+
+// Defaults for HeapPolicy::min_growth_factor and max_growth_factor
+#ifndef AVM_GC_MIN_GROWTH_FACTOR
+#define AVM_GC_MIN_GROWTH_FACTOR 0.5
+#endif
+
+#ifndef AVM_GC_MAX_GROWTH_FACTOR
+#define AVM_GC_MAX_GROWTH_FACTOR 2.0
+#endif
+
+// Default for HeapPolicy::max_heap_size. 0 for no limit
+#ifndef AVM_GC_MAX_HEAP_SIZE
+#define AVM_GC_MAX_HEAP_SIZE 0
+#endif
+
+// Collect the old generation a step at a time, so no single pause depends on the heap size
+#ifndef AVM_GC_INCREMENTAL
+#define AVM_GC_INCREMENTAL 1
+#endif
+
+// Default no. handles marked or swept by each step (see VMState::gc_step_work)
+#ifndef AVM_GC_STEP_WORK
+#define AVM_GC_STEP_WORK 1024
+#endif
+
+// Allow the old generation to be marked on a thread of its own (see VMInstance::concurrent_marking)
+#ifndef AVM_GC_CONCURRENT
+#define AVM_GC_CONCURRENT AVM_GC_INCREMENTAL
+#endif
+
+// No. grey handles the marking thread marks before it lets the main thread take the lock
+#ifndef AVM_GC_MARKER_BATCH
+#define AVM_GC_MARKER_BATCH 64
+#endif
+
+// Max no. handles in the grey list, after which the heap is rescanned (see Heap::RescanMarked)
+#ifndef AVM_GC_MARK_STACK_SIZE
+#define AVM_GC_MARK_STACK_SIZE (256 * 1024)
+#endif
+
+// No. grey handles prefetched ahead of marking, once that many are grey. 0 disables prefetching
+#ifndef AVM_GC_PREFETCH_DISTANCE
+#define AVM_GC_PREFETCH_DISTANCE 8
+#endif
+
+// Free objects once nothing but the stack refers to them, rather than at the next collection
+#ifndef AVM_GC_REFCOUNT
+#define AVM_GC_REFCOUNT 1
+#endif
+
+// Allow sparse slabs to be evacuated and released (see VMInstance::compact_heap)
+#ifndef AVM_GC_COMPACT
+#define AVM_GC_COMPACT 1
+#endif
+
+// A slab that is no more than this percent full is evacuated by compaction
+#ifndef AVM_GC_COMPACT_THRESHOLD
+#define AVM_GC_COMPACT_THRESHOLD 50
+#endif
+
+// No. major collections between compactions
+#ifndef AVM_GC_COMPACT_INTERVAL
+#define AVM_GC_COMPACT_INTERVAL 16
+#endif
+
+// Allow the heap to be swept by several threads at once (see VMInstance::sweep_threads)
+#ifndef AVM_GC_PARALLEL_SWEEP
+#define AVM_GC_PARALLEL_SWEEP 1
+#endif
+
+#endif
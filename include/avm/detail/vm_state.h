@@ -3,11 +3,13 @@
 
 #include <detail/frame.h>
 #include <detail/heap.h>
-#include <detail/byte_stream.h>
+#include <detail/program.h>
 #include <detail/object.h>
 #include <detail/exception.h>
 #include <detail/reference.h>
 #include <detail/variable.h>
+#include <detail/value.h>
+#include <detail/value_stack.h>
 
 #include <string>
 #include <stack>
@@ -16,12 +18,34 @@
 #include <utility>
 #include <memory>
 
-#define GC_THRESHOLD_MIN 200 // start # of objects before GC.
-#define GC_THRESHOLD_MAX 2000 // max out at this number, do not increase threshold
-#define GC_THRESHOLD_STEP 50 // how much to increase each time GC runs.
-
 namespace avm {
 class VMInstance;
+
+/** Decides when the heap is collected, and how large it may grow. It may be changed
+    at any time, and is followed from the next point at which the GC may run.
+*/
+struct HeapPolicy {
+    HeapPolicy();
+
+    // No. bytes the young generation may hold before it is collected
+    size_t nursery_bytes;
+    // No. bytes that may be allocated between collections of the whole heap, at the least
+    size_t min_trigger_bytes;
+    /** Once the whole heap has been collected, the next collection begins after the
+        live bytes times the growth factor have been allocated. The factor moves from
+        the minimum to the maximum as more of the heap survives, so that a heap that
+        is mostly live is not collected over and over for little gain.
+    */
+    double min_growth_factor;
+    double max_growth_factor;
+    /** No. bytes the heap may hold, or 0 for no limit. Before an operation or assignment
+        would pass it, and at each safepoint, the whole heap is collected, and if that is
+        not enough, OutOfMemoryException is raised. Other allocations, such as new objects
+        and arrays, are only checked at the next safepoint.
+    */
+    size_t max_heap_size;
+};
+
 class VMState {
 public:
     VMState(VMInstance *vm);
@@ -33,28 +57,38 @@ public:
     int frame_level;
     // The current read level
     int read_level;
-    // Saved positions from jumping
-    std::stack<uint64_t> jump_positions;
-    // Saved block locations, mapped by block ID
-    std::map<uint32_t, uint64_t> block_positions;
-    // The stream that instructions are being read from
-    ByteStream *stream;
-    // Current number of objects
-    size_t num_objects;
-    // Maximum number of objects before resize
-    size_t max_objects;
-    // Frame pointers
+    // Calls that have not yet returned, innermost last
+    std::vector<CallFrame> calls;
+    // The decoded program that instructions are being read from
+    Program *program;
+    // Index of the next instruction to be read
+    size_t pc;
+    // Instructions are read while the pc is below this. It is set to zero when an
+    // exception is raised, so that the dispatch loop stops after the instruction
+    // that raised it, and moves to the handler
+    size_t pc_limit;
+    // Handler of the exception that was raised, and the no. calls that remain at it
+    const ExceptionHandler *raised_handler;
+    size_t raised_call_depth;
+    // Frame pointers. Frames above the frame level are not in use, and are
+    // kept so that opening a frame does not allocate
     std::vector<Frame*> frames;
-    // Are we currently able to handle exceptions, or just crash?
-    bool can_handle_exceptions;
+    // Bound native functions, kept apart from the frames so that
+    // slots in the global frame match those assigned by the compiler
+    std::map<AVMString_t, Reference> natives;
     // Holds the heap memory
     Heap heap;
-    // Maximum heap memory before the GC is called
-    size_t max_heap_size;
+    // Decides when the heap is collected, and how large it may grow
+    HeapPolicy heap_policy;
+    // No. bytes the heap may hold before the whole heap is collected. Set after each collection
+    size_t gc_trigger_bytes;
+    // No. handles marked or swept by each step of an incremental collection
+    size_t gc_step_work;
     // Pointer to the VM instance
     VMInstance *vm;
 
-    std::vector<Reference> stack;
+    // The operand stack. Numbers and null are held inline
+    ValueStack stack;
 };
 } // namespace avm
 
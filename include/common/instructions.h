@@ -6,9 +6,27 @@
 
 #define ARES_MAGIC "AR"
 #define ARES_MAGIC_LEN 2
-#define ARES_VERSION "13" // 1.3
+#define ARES_VERSION "19" // 1.9
 #define ARES_VERSION_LEN 2
 
+/** Layout of a bytecode file:
+      Magic (ARES_MAGIC), Version (ARES_VERSION)
+      No. strings (u32), then each string as Length (i32), Chars (including null terminator)
+      No. floats (u32), then each float (double)
+      No. try blocks (u32), then each as Begin (u32), End (u32), Handler (u32), Function (u32),
+        Frame depth (u32)
+      Instructions, until the end of the file
+
+    Instructions refer to strings and floats by their (u32) index in the constant pool.
+
+    The exception table lists the instructions protected by each try block, innermost
+    first, as byte positions relative to the first instruction. When an exception is
+    raised within [Begin, End) of the function whose body starts at Function (or of the
+    global code, if it is 0xFFFFFFFF), the frames above the given depth are closed,
+    and the stream is moved to Handler. Exceptions raised within a call continue to
+    the instruction that made the call.
+*/
+
 namespace avm {
 enum Opcodes : Opcode_t {
     /**
@@ -65,33 +83,31 @@ enum Opcodes : Opcode_t {
     Opcode_irl_if_false,
     /**
     addr
-      Arguments: ID (u32), Address (u64)
-      RL <=> FL: Yes
-      Effects: Stores the address for later use, with ID as the key.
+      Not used in this implementation. Jumps store relative offsets instead.
     */
     Opcode_store_address,
     /**
     jmpb
-      Arguments: ID (u32)
+      Arguments: Offset (i32)
       RL <=> FL: Yes
-      Effects: If read level <=> frame level, the stream jumps to the address
-               stored by the key ID.
+      Effects: The stream is moved by the given number of bytes, relative to
+               the end of this instruction. The offset may be negative.
     */
     Opcode_jump,
     /**
     jmpbt
-      Arguments: ID (u32)
+      Arguments: Offset (i32)
       RL <=> FL: Yes
-      Effects: Same as jmpb, but is only executed if the last condition is
-               stored as 1.
+      Effects: The top value is popped from the stack. If it evaluates to true,
+               the stream is moved the same way as jmpb.
     */
     Opcode_jump_if_true,
     /**
     jmpbf
-      Arguments: ID (u32)
+      Arguments: Offset (i32)
       RL <=> FL: Yes
-      Effects: Same as jmpb, but is only executed if the last condition is
-               stored as 0.
+      Effects: The top value is popped from the stack. If it evaluates to false,
+               the stream is moved the same way as jmpb.
     */
     Opcode_jump_if_false,
     /**
@@ -106,15 +122,12 @@ enum Opcodes : Opcode_t {
     Opcode_delete_local,
     /**
     try
-      Arguments: Catch ID (u32)
-      RL <=> FL: Yes
-      Effects: Tells the VM that it is now in an exception handling state, and upon error,
-               to jump to the code address of the catch id.
+      Not used in this implementation. Try blocks are listed in the exception table instead.
     */
     Opcode_try_catch_block,
     /**
     store
-      Arguments: Length (i32), Name (String)
+      Arguments: Name (u32 string index)
       RL <=> FL: Yes
       Effects: Stores the top value from the stack as a local object, denoted
                by the given name. If the top value is a temporary object such as
@@ -137,7 +150,7 @@ enum Opcodes : Opcode_t {
     Opcode_new_variable,
     /**
     newn
-      Arguments: Length (i32), Type (String)
+      Arguments: Type (u32 string index)
       RL <=> FL: Yes
       \todo Implement this
     */
@@ -152,7 +165,7 @@ enum Opcodes : Opcode_t {
     Opcode_array_index,
     /**
     newm
-      Arguments: Length (i32), Name (String)
+      Arguments: Name (u32 string index)
       RL <=> FL: Yes
       Effects: Adds a new sub-value to the top item on the stack. It is not
                popped from the stack.
@@ -160,7 +173,7 @@ enum Opcodes : Opcode_t {
     Opcode_new_member,
     /**
     mbr
-      Arguments: Length (i32), Name (String)
+      Arguments: Name (u32 string index)
       RL <=> FL: Yes
       Effects: Loads a member with the given name from the top value on the stack.
     */
@@ -174,11 +187,10 @@ enum Opcodes : Opcode_t {
     Opcode_new_structure,
     /**
     newf
-      Arguments: No. Arguments (u32), Is Variadic (u8), Label ID (u32)
-      RL <=> FL: Yesl
-      Effects: Creates a new function and pushes it onto the stack. If the function is
-               global, the stored address will be read from the bytecode. If it is not,
-               the address will be stored by the run-time position in the bytecode stream.
+      Arguments: No. Arguments (u32), Is Variadic (u8), Offset (i32)
+      RL <=> FL: Yes
+      Effects: Creates a new function and pushes it onto the stack. The body of the
+               function begins at the given number of bytes after the end of this instruction.
     */
     Opcode_new_function,
     /**
@@ -201,8 +213,9 @@ enum Opcodes : Opcode_t {
     leave
       Arguments: none
       RL <=> FL: Yes
-      Effects: Frame level, as well as read level will be decremented.
-               \todo Look into this, decreasing frame level automatically decreases read level.
+      Effects: Frame level, as well as read level will be decremented. Emitted by
+               "return" once for every block it leaves before jumping to the end of the
+               function body.
     */
     Opcode_leave,
     /**
@@ -231,9 +244,11 @@ enum Opcodes : Opcode_t {
     Opcode_print,
     /**
     local
-      Arguments: Length (i32), Name (String)
+      Arguments: Name (u32 string index)
       RL <=> FL: Yes
-      Effects: The object is loaded onto the stack from the local variables.
+      Effects: The object is loaded onto the stack from the local variables, searching
+               each frame by name, then the native functions. Only emitted for names that
+               the compiler cannot resolve to a slot.
     */
     Opcode_load_local,
     /**
@@ -247,21 +262,21 @@ enum Opcodes : Opcode_t {
     Opcode_load_field,
     /**
     intn
-      Arguments: Value (i64)
+      Arguments: Value (i32)
       RL <=> FL: Yes
       Effects: The value is loaded onto the stack as a temporary variable.
     */
     Opcode_load_integer,
     /**
     float
-      Arguments: Value (double)
+      Arguments: Value (u32 float index)
       RL <=> FL: Yes
       Effects: The value is loaded onto the stack as a temporary variable.
     */
     Opcode_load_float,
     /**
     str
-      Arguments: Length (i32), Name (String)
+      Arguments: Value (u32 string index)
       RL <=> FL: Yes
       Effects: The value is loaded onto the stack as a temporary variable.
     */
@@ -509,8 +524,350 @@ enum Opcodes : Opcode_t {
                of the stack. They are both popped from the stack, with the result being
                pushed onto it.
     */
-    Opcode_div_assign
+    Opcode_div_assign,
+    /**
+    global
+      Arguments: Field index (i32)
+      RL <=> FL: Yes
+      Effects: The object at the field index within the global frame is pushed onto the stack.
+    */
+    Opcode_load_global,
+    /**
+    add_ii
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: The 'a+b' operation, emitted when both operands are known to be integers.
+               If either operand is not, the generic operation is performed instead.
+    */
+    Opcode_add_ii,
+    /**
+    sub_ii
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: The 'a-b' operation, emitted when both operands are known to be integers.
+               If either operand is not, the generic operation is performed instead.
+    */
+    Opcode_sub_ii,
+    /**
+    mul_ii
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: The 'a*b' operation, emitted when both operands are known to be integers.
+               If either operand is not, the generic operation is performed instead.
+    */
+    Opcode_mul_ii,
+    /**
+    mod_ii
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: The 'a%b' operation, emitted when both operands are known to be integers.
+               If either operand is not, the generic operation is performed instead.
+    */
+    Opcode_mod_ii,
+    /**
+    lt_ii
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: The 'a<b' operation, emitted when both operands are known to be integers.
+               If either operand is not, the generic operation is performed instead.
+    */
+    Opcode_less_ii,
+    /**
+    lte_ii
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: The 'a<=b' operation, emitted when both operands are known to be integers.
+               If either operand is not, the generic operation is performed instead.
+    */
+    Opcode_less_eql_ii,
+    /**
+    eql_ii
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: The 'a==b' operation, emitted when both operands are known to be integers.
+               If either operand is not, the generic operation is performed instead.
+    */
+    Opcode_eql_ii,
+    /**
+    neql_ii
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: The 'a!=b' operation, emitted when both operands are known to be integers.
+               If either operand is not, the generic operation is performed instead.
+    */
+    Opcode_neql_ii,
+    /**
+    add_ff
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: The 'a+b' operation, emitted when both operands are known to be floats.
+               If either operand is not, the generic operation is performed instead.
+    */
+    Opcode_add_ff,
+    /**
+    sub_ff
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: The 'a-b' operation, emitted when both operands are known to be floats.
+               If either operand is not, the generic operation is performed instead.
+    */
+    Opcode_sub_ff,
+    /**
+    mul_ff
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: The 'a*b' operation, emitted when both operands are known to be floats.
+               If either operand is not, the generic operation is performed instead.
+    */
+    Opcode_mul_ff,
+    /**
+    div_ff
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: The 'a/b' operation, emitted when both operands are known to be floats.
+               If either operand is not, the generic operation is performed instead.
+    */
+    Opcode_div_ff,
+    /**
+    lt_ff
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: The 'a<b' operation, emitted when both operands are known to be floats.
+               If either operand is not, the generic operation is performed instead.
+    */
+    Opcode_less_ff,
+    /**
+    lte_ff
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: The 'a<=b' operation, emitted when both operands are known to be floats.
+               If either operand is not, the generic operation is performed instead.
+    */
+    Opcode_less_eql_ff,
+    /**
+    concat_ss
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: The 'a+b' operation, emitted when both operands are known to be strings.
+               If either operand is not, the generic operation is performed instead.
+    */
+    Opcode_concat_ss,
+    /**
+    tivk
+      Arguments: No. Arguments (u32)
+      RL <=> FL: No
+      Effects: Emitted for a call in tail position. If the top value from the stack is a
+               function of the script, the frames of the current call are closed and the
+               function's body is read in its place, returning to the current call's caller.
+               Otherwise, the same as 'ivk'.
+    */
+    Opcode_tail_invoke,
+    /**
+    mbr_cached
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: Not written to bytecode files. The interpreter rewrites 'mbr' to this form
+               once the member has been found, keeping the index of the field. If the
+               field at that index does not have the same name, it is changed back to 'mbr'.
+    */
+    Opcode_load_member_cached,
+    /**
+    incf
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: Not written to bytecode files. Superinstruction for the sequence
+               'load_field, intn, add_assign, pop', which the loader rewrites the first
+               instruction of. Operands are read from the instructions that follow, which
+               are skipped. If the field is not an integer, only 'load_field' is performed.
+    */
+    Opcode_inc_field,
+    /**
+    incg
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: Same as 'incf', for the sequence 'global, intn, add_assign, pop'.
+    */
+    Opcode_inc_global,
+    /**
+    jnlf
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: Not written to bytecode files. Superinstruction for the sequence
+               'load_field, intn, lt, jmpbf', which the loader rewrites the first
+               instruction of. Operands are read from the instructions that follow, which
+               are skipped. If the field is not an integer, only 'load_field' is performed.
+    */
+    Opcode_jump_if_not_less_field,
+    /**
+    jnlg
+      Arguments: none
+      RL <=> FL: Yes
+      Effects: Same as 'jnlf', for the sequence 'global, intn, lt, jmpbf'.
+    */
+    Opcode_jump_if_not_less_global
 };
+
+/** Every opcode that the VM implements, and whether or not its handler may change
+    the read level or the frame level. Both interpreters, the handlers of compiled
+    code and the C++ emitter are generated from this list, so that they always
+    treat the levels the same way.
+*/
+#define AVM_OPCODES(X) \
+    X(Opcode_ifl, true) \
+    X(Opcode_dfl, true) \
+    X(Opcode_irl, true) \
+    X(Opcode_drl, true) \
+    X(Opcode_irl_if_true, true) \
+    X(Opcode_irl_if_false, true) \
+    X(Opcode_jump, false) \
+    X(Opcode_jump_if_true, false) \
+    X(Opcode_jump_if_false, false) \
+    X(Opcode_store_as_local, false) \
+    X(Opcode_new_native_object, false) \
+    X(Opcode_array_index, false) \
+    X(Opcode_new_member, false) \
+    X(Opcode_load_member, false) \
+    X(Opcode_new_structure, false) \
+    X(Opcode_new_function, false) \
+    X(Opcode_invoke_object, true) \
+    X(Opcode_tail_invoke, true) \
+    X(Opcode_leave, true) \
+    X(Opcode_return, true) \
+    X(Opcode_break, true) \
+    X(Opcode_continue, true) \
+    X(Opcode_print, false) \
+    X(Opcode_load_local, false) \
+    X(Opcode_load_field, false) \
+    X(Opcode_load_global, false) \
+    X(Opcode_load_integer, false) \
+    X(Opcode_load_float, false) \
+    X(Opcode_load_string, false) \
+    X(Opcode_load_null, false) \
+    X(Opcode_pop, false) \
+    X(Opcode_unary_minus, false) \
+    X(Opcode_unary_not, false) \
+    X(Opcode_add, false) \
+    X(Opcode_sub, false) \
+    X(Opcode_mul, false) \
+    X(Opcode_div, false) \
+    X(Opcode_mod, false) \
+    X(Opcode_pow, false) \
+    X(Opcode_and, false) \
+    X(Opcode_or, false) \
+    X(Opcode_eql, false) \
+    X(Opcode_neql, false) \
+    X(Opcode_less, false) \
+    X(Opcode_greater, false) \
+    X(Opcode_less_eql, false) \
+    X(Opcode_greater_eql, false) \
+    X(Opcode_bit_and, false) \
+    X(Opcode_bit_or, false) \
+    X(Opcode_bit_xor, false) \
+    X(Opcode_left_shift, false) \
+    X(Opcode_right_shift, false) \
+    X(Opcode_assign, false) \
+    X(Opcode_add_assign, false) \
+    X(Opcode_sub_assign, false) \
+    X(Opcode_mul_assign, false) \
+    X(Opcode_div_assign, false) \
+    X(Opcode_add_ii, false) \
+    X(Opcode_sub_ii, false) \
+    X(Opcode_mul_ii, false) \
+    X(Opcode_mod_ii, false) \
+    X(Opcode_less_ii, false) \
+    X(Opcode_less_eql_ii, false) \
+    X(Opcode_eql_ii, false) \
+    X(Opcode_neql_ii, false) \
+    X(Opcode_add_ff, false) \
+    X(Opcode_sub_ff, false) \
+    X(Opcode_mul_ff, false) \
+    X(Opcode_div_ff, false) \
+    X(Opcode_less_ff, false) \
+    X(Opcode_less_eql_ff, false) \
+    X(Opcode_concat_ss, false) \
+    X(Opcode_load_member_cached, false) \
+    X(Opcode_inc_field, false) \
+    X(Opcode_inc_global, false) \
+    X(Opcode_jump_if_not_less_field, false) \
+    X(Opcode_jump_if_not_less_global, false)
+
+#define AVM_OPCODE_CHANGES_LEVEL(opcode, changes_level) (op == opcode && changes_level) ||
+#define AVM_OPCODE_IS_LISTED(opcode, changes_level) op == opcode ||
+
+// Whether the handler of the instruction may change the read level or the frame level
+constexpr bool ChangesLevel(Opcode_t op)
+{
+    return AVM_OPCODES(AVM_OPCODE_CHANGES_LEVEL) false;
+}
+
+// Whether the opcode is listed in AVM_OPCODES
+constexpr bool IsListedOpcode(Opcode_t op)
+{
+    return AVM_OPCODES(AVM_OPCODE_IS_LISTED) false;
+}
+
+#undef AVM_OPCODE_CHANGES_LEVEL
+#undef AVM_OPCODE_IS_LISTED
+
+/** Returns the form of a generic operation that is specialized for two integers,
+    or the generic opcode if there is no such form.
+*/
+inline Opcode_t IntegerOpcode(Opcode_t generic)
+{
+    switch (generic) {
+    case Opcode_add: return Opcode_add_ii;
+    case Opcode_sub: return Opcode_sub_ii;
+    case Opcode_mul: return Opcode_mul_ii;
+    case Opcode_mod: return Opcode_mod_ii;
+    case Opcode_less: return Opcode_less_ii;
+    case Opcode_less_eql: return Opcode_less_eql_ii;
+    case Opcode_eql: return Opcode_eql_ii;
+    case Opcode_neql: return Opcode_neql_ii;
+    default: return generic;
+    }
+}
+
+/** Returns the form of a generic operation that is specialized for two floats,
+    or the generic opcode if there is no such form.
+*/
+inline Opcode_t FloatOpcode(Opcode_t generic)
+{
+    switch (generic) {
+    case Opcode_add: return Opcode_add_ff;
+    case Opcode_sub: return Opcode_sub_ff;
+    case Opcode_mul: return Opcode_mul_ff;
+    case Opcode_div: return Opcode_div_ff;
+    case Opcode_less: return Opcode_less_ff;
+    case Opcode_less_eql: return Opcode_less_eql_ff;
+    default: return generic;
+    }
+}
+
+/** Returns the form of a generic operation that is specialized for two strings,
+    or the generic opcode if there is no such form.
+*/
+inline Opcode_t StringOpcode(Opcode_t generic)
+{
+    return (generic == Opcode_add) ? (Opcode_t)Opcode_concat_ss : generic;
+}
+
+/** Returns the generic form of a typed operation */
+inline Opcode_t GenericOpcode(Opcode_t typed)
+{
+    switch (typed) {
+    case Opcode_add_ii: case Opcode_add_ff: case Opcode_concat_ss: return Opcode_add;
+    case Opcode_sub_ii: case Opcode_sub_ff: return Opcode_sub;
+    case Opcode_mul_ii: case Opcode_mul_ff: return Opcode_mul;
+    case Opcode_div_ff: return Opcode_div;
+    case Opcode_mod_ii: return Opcode_mod;
+    case Opcode_less_ii: case Opcode_less_ff: return Opcode_less;
+    case Opcode_less_eql_ii: case Opcode_less_eql_ff: return Opcode_less_eql;
+    case Opcode_eql_ii: return Opcode_eql;
+    case Opcode_neql_ii: return Opcode_neql;
+    case Opcode_load_member_cached: return Opcode_load_member;
+    default: return typed;
+    }
+}
 } // namespace avm
 
 #endif
\ No newline at end of file
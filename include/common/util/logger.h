@@ -7,7 +7,7 @@
 
 namespace avm {
 #if DEBUG_PRINT_ENABLED
-#define DEBUG_LOG(str, ...) printf("0x%08x: " str "\n", (int)state->stream->Position(), __VA_ARGS__)
+#define DEBUG_LOG(str, ...) printf("#%06d: " str "\n", (int)state->pc, __VA_ARGS__)
 #else
 #define DEBUG_LOG (void)0;
 #endif
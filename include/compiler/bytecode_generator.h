@@ -6,6 +6,7 @@
 #include <string>
 #include <fstream>
 #include <cstdint>
+#include <map>
 
 #include <detail/state.h>
 #include <common/bytecodes.h>
@@ -13,13 +14,24 @@
 namespace avm {
 class BytecodeGenerator {
 public:
-    BytecodeGenerator(const InstructionStream &bstream, const std::vector<Label> &labels);
+    BytecodeGenerator(const InstructionStream &bstream, const std::vector<Label> &labels,
+        const ConstantPool &constants, const std::vector<CompilerState::ExceptionTableEntry> &exception_table);
 
     bool Emit(std::ostream &stream);
 
 private:
+    // Writes the constant pool, which follows the signature.
+    void EmitConstants(std::ostream &filestream);
+    // Writes the exception table, which follows the constant pool. Returns false if a label is missing.
+    bool EmitExceptionTable(std::ostream &filestream, const std::map<unsigned int, unsigned int> &label_locations);
+    // Replaces the label id operand of a jump with a relative offset to the label.
+    bool ResolveLabel(Instruction<> &ins, uint64_t end_position,
+        const std::map<unsigned int, unsigned int> &label_locations);
+
     InstructionStream bstream;
     std::vector<Label> labels;
+    ConstantPool constants;
+    std::vector<CompilerState::ExceptionTableEntry> exception_table;
 };
 } // namespace avm
 
@@ -15,6 +15,7 @@ typedef CompilerState::LevelInfo LevelInfo;
 typedef CompilerState::LevelType LevelType;
 typedef CompilerState::ModuleDefine ModuleDefine;
 typedef CompilerState::ExternalFunction ExternalFunction;
+typedef CompilerState::ExceptionTableEntry ExceptionTableEntry;
 
 class Compiler : public AstHandler {
 public:
@@ -74,6 +75,26 @@ private:
     void IncreaseBlock(LevelType);
     void DecreaseBlock();
 
+    // Stores the top of the stack as a new local in the current block.
+    void StoreLocal(const std::string &var_name);
+    // Loads a variable by its frame and slot, or by name if it cannot be resolved.
+    void LoadVariable(const std::string &var_name);
+
+    // Types that an expression can be known to have at compile time
+    enum StaticType {
+        Static_unknown,
+        Static_int,
+        Static_float,
+        Static_string,
+    };
+    // Finds the type of an expression made of literals, and of variables currently set to a literal.
+    StaticType GetStaticType(AstNode *node);
+    // Returns the typed form of an operation, if both operands are known to have the same type.
+    Opcode_t SelectOpcode(Opcode_t generic, AstNode *left, AstNode *right);
+    // Returns the call if the returned value is one that may reuse the activation of the
+    // function at the given level, or null if it must be a regular call.
+    AstFunctionCall *GetTailCall(AstNode *value, int function_level);
+
     InstructionStream bstream;
 
     static void OptimizeAstNode(std::unique_ptr<AstNode> &node);
@@ -6,6 +6,8 @@ namespace config {
 static const bool optimize_constant_folding = true;
 static const bool optimize_remove_unused = true;
 static const bool optimize_remove_dead_code = true;
+static const bool optimize_typed_operations = true;
+static const bool optimize_tail_calls = true;
 } // namespace config
 } // namespace avm
 
@@ -11,6 +11,10 @@
 #include <detail/token.h>
 #include <detail/error.h>
 #include <detail/ast.h>
+#include <common/types.h>
+
+#include <map>
+#include <cstdint>
 
 namespace avm {
 static const int compiler_global_level = 0;
@@ -52,12 +56,30 @@ struct Label {
     unsigned int location = 0;
 };
 
+// Deduplicated constants, written to the header of the bytecode file.
+// Instructions refer to them by index.
+struct ConstantPool {
+    std::vector<std::string> strings;
+    std::vector<AVMFloat_t> floats;
+
+    // Returns the index of the string, adding it if it is not in the pool yet
+    uint32_t AddString(const std::string &str);
+    // Returns the index of the float, adding it if it is not in the pool yet
+    uint32_t AddFloat(AVMFloat_t value);
+
+private:
+    std::map<std::string, uint32_t> string_indices;
+    // keyed by bit pattern, so that 0.0 and -0.0 are kept apart
+    std::map<uint64_t, uint32_t> float_indices;
+};
+
 struct CompilerState {
     enum LevelType {
         Level_default,
         Level_function,
         Level_loop,
-        Level_condition
+        Level_condition,
+        Level_try
     };
 
     struct ExternalFunction {
@@ -80,6 +102,24 @@ struct CompilerState {
     struct LevelInfo {
         LevelType type;
         std::vector<std::pair<std::string, Symbol>> locals;
+        // for function levels, the label at the end of the body that "return" jumps to
+        unsigned int end_label_id = 0;
+        // for function levels, true if the body is expanded in place rather than called
+        bool is_inline = false;
+        // for function levels, the label at the start of the body
+        unsigned int body_label_id = 0;
+    };
+
+    // A range of instructions protected by a try block, written to the exception table
+    struct ExceptionTableEntry {
+        // labels at the start and end of the try block, and at the start of the catch block
+        unsigned int begin_label_id = 0;
+        unsigned int end_label_id = 0;
+        unsigned int handler_label_id = 0;
+        // label at the start of the function the try block is in, or 0 if it is not in one
+        unsigned int function_label_id = 0;
+        // no. frames open within the function (or the global block) at the try block
+        uint32_t frame_depth = 0;
     };
 
     std::vector<BuildMessage> errors;
@@ -92,6 +132,10 @@ struct CompilerState {
     std::map<int, LevelInfo> levels;
     int level, function_level;
     std::vector<Label> labels;
+    // innermost try blocks first
+    std::vector<ExceptionTableEntry> exception_table;
+    // names and literals referenced by instructions
+    ConstantPool constants;
     // the counter for levels
     unsigned int block_id_counter = 0;
 
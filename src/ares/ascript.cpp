@@ -1,5 +1,6 @@
 #include <ascript.h>
 #include <rtlib.h>
+#include <cpp_emitter.h>
 
 #include <compiler/parser.h>
 #include <compiler/lexer.h>
@@ -17,6 +18,11 @@ namespace ares {
 static Timer global_timer = Timer();
 
 Script::Script()
+    : jit_enabled(true),
+      concurrent_marking(false),
+      sweep_threads(1),
+      compact_heap(false),
+      max_heap_size(0)
 {
 }
 
@@ -74,7 +80,8 @@ bool Script::CompileAndRun(const std::string &code,
         compiler.Module("Runtime")
             .Define("loadlib", 1)
             .Define("loadfunc", 2)
-            .Define("invoke", 1);
+            .Define("invoke", 1)
+            .Define("allocations", 0);
         compiler.Module("Reflection")
             .Define("typeof", 1);
         compiler.Module("Convert")
@@ -88,7 +95,8 @@ bool Script::CompileAndRun(const std::string &code,
             .Define("readln", 0);
 
         if (compiler.Compile(unit.get())) {
-            BytecodeGenerator gen(compiler.GetInstructions(), compiler.GetState().labels);
+            BytecodeGenerator gen(compiler.GetInstructions(), compiler.GetState().labels,
+                compiler.GetState().constants, compiler.GetState().exception_table);
             
             char *buffer = nullptr;
             size_t max_pos = 0;
@@ -136,8 +144,46 @@ bool Script::CompileAndRun(const std::string &code,
 }
 
 void Script::RunFromBytecode(avm::ByteStream *stream)
+{
+    VMInstance *vm = CreateVM();
+    vm->Execute(stream);
+    delete vm;
+}
+
+void Script::RunCompiled(const avm::CompiledProgram &compiled)
+{
+    VMInstance *vm = CreateVM();
+    vm->Execute(compiled);
+    delete vm;
+}
+
+bool Script::EmitCpp(avm::ByteStream *stream, const std::string &source_path, const std::string &output_file)
+{
+    Program program;
+    if (!program.Load(stream)) {
+        std::cout << "Failed to load bytecode\n";
+        return false;
+    }
+
+    std::ofstream file(output_file);
+    if (!file.is_open()) {
+        std::cout << "Could not open output file: " << output_file << "\n";
+        return false;
+    }
+
+    CppEmitter emitter(program, CppEmitter::SymbolName(output_file));
+    emitter.Emit(file, source_path);
+    return true;
+}
+
+VMInstance *Script::CreateVM()
 {
     VMInstance *vm = new VMInstance();
+    vm->jit_enabled = jit_enabled;
+    vm->concurrent_marking = concurrent_marking;
+    vm->sweep_threads = sweep_threads;
+    vm->compact_heap = compact_heap;
+    vm->state->heap_policy.max_heap_size = max_heap_size;
 
     vm->BindFunction("Clock_start", Tic);
     vm->BindFunction("Clock_stop", Toc);
@@ -150,6 +196,7 @@ void Script::RunFromBytecode(avm::ByteStream *stream)
     vm->BindFunction("Runtime_loadlib", RuntimeLib::Runtime_loadlib);
     vm->BindFunction("Runtime_loadfunc", RuntimeLib::Runtime_loadfunc);
     vm->BindFunction("Runtime_invoke", RuntimeLib::Runtime_invoke);
+    vm->BindFunction("Runtime_allocations", RuntimeLib::Runtime_allocations);
 
     vm->BindFunction("Reflection_typeof", RuntimeLib::Reflection_typeof);
 
@@ -162,8 +209,6 @@ void Script::RunFromBytecode(avm::ByteStream *stream)
     vm->BindFunction("Console_println", RuntimeLib::Console_println);
     vm->BindFunction("Console_readln", RuntimeLib::Console_readln);
 
-    vm->Execute(stream);
-
-    delete vm;
+    return vm;
 }
 } // namespace avm
@@ -0,0 +1,465 @@
+#include <cpp_emitter.h>
+
+#include <common/instructions.h>
+
+#include <sstream>
+#include <vector>
+#include <cmath>
+#include <cstdio>
+
+using namespace avm;
+
+namespace ares {
+/** The Variable operation performed by an operation instruction, and the C++
+    operator that gives the same result for two inline integers or floats.
+*/
+struct OperationInfo {
+    Opcode_t opcode;
+    const char *method;
+    const char *op;
+    bool integers;
+    bool floats;
+    bool comparison;
+    // The integer form is only done inline when the right operand is not zero
+    bool divides;
+};
+
+static const OperationInfo operations[] = {
+    { Opcode_add, "Add", "+", true, true, false, false },
+    { Opcode_sub, "Subtract", "-", true, true, false, false },
+    { Opcode_mul, "Multiply", "*", true, true, false, false },
+    { Opcode_div, "Divide", "/", true, true, false, true },
+    { Opcode_mod, "Modulus", "%", true, false, false, true },
+    { Opcode_pow, "Power", nullptr, false, false, false, false },
+    { Opcode_and, "LogicalAnd", nullptr, false, false, false, false },
+    { Opcode_or, "LogicalOr", nullptr, false, false, false, false },
+    { Opcode_eql, "Equals", "==", true, false, true, false },
+    { Opcode_neql, "NotEqual", "!=", true, false, true, false },
+    { Opcode_less, "Less", "<", true, true, true, false },
+    { Opcode_greater, "Greater", ">", true, true, true, false },
+    { Opcode_less_eql, "LessOrEqual", "<=", true, true, true, false },
+    { Opcode_greater_eql, "GreaterOrEqual", ">=", true, true, true, false },
+    { Opcode_bit_and, "BitwiseAnd", nullptr, false, false, false, false },
+    { Opcode_bit_or, "BitwiseOr", nullptr, false, false, false, false },
+    { Opcode_bit_xor, "BitwiseXor", nullptr, false, false, false, false },
+    { Opcode_left_shift, "LeftShift", nullptr, false, false, false, false },
+    { Opcode_right_shift, "RightShift", nullptr, false, false, false, false },
+};
+
+static const OperationInfo *FindOperation(Opcode_t opcode)
+{
+    for (const OperationInfo &info : operations) {
+        if (info.opcode == GenericOpcode(opcode)) {
+            return &info;
+        }
+    }
+    return nullptr;
+}
+
+static std::string StringLiteral(const AVMString_t &str)
+{
+    std::string result = "\"";
+    for (char c : str) {
+        unsigned char ch = (unsigned char)c;
+        if (c == '"' || c == '\\' || c == '?') {
+            // '?' is escaped so that no trigraphs are formed
+            result += '\\';
+            result += c;
+        } else if (ch >= 0x20 && ch < 0x7F) {
+            result += c;
+        } else {
+            char buffer[8];
+            std::snprintf(buffer, sizeof(buffer), "\\%03o", (unsigned)ch);
+            result += buffer;
+        }
+    }
+    return result + "\"";
+}
+
+static std::string FloatLiteral(AVMFloat_t value)
+{
+    if (std::isnan(value)) {
+        return "std::numeric_limits<AVMFloat_t>::quiet_NaN()";
+    } else if (std::isinf(value)) {
+        return value < 0 ? "-std::numeric_limits<AVMFloat_t>::infinity()" :
+            "std::numeric_limits<AVMFloat_t>::infinity()";
+    }
+
+    // 17 significant digits are enough for the value to be read back exactly
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.17g", value);
+    std::string result = buffer;
+    if (result.find_first_of(".e") == std::string::npos) {
+        result += ".0";
+    }
+    return result;
+}
+
+CppEmitter::CppEmitter(const Program &program, const std::string &symbol)
+    : program(program),
+      symbol(symbol)
+{
+}
+
+std::string CppEmitter::SymbolName(const std::string &path)
+{
+    size_t begin = path.find_last_of("/\\");
+    begin = (begin == std::string::npos) ? 0 : begin + 1;
+    size_t end = path.find_last_of(".");
+    if (end == std::string::npos || end < begin) {
+        end = path.size();
+    }
+
+    std::string name;
+    for (size_t i = begin; i < end; i++) {
+        char c = path[i];
+        bool is_alnum = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+        name += is_alnum ? c : '_';
+    }
+    if (name.empty() || (name[0] >= '0' && name[0] <= '9')) {
+        name = "_" + name;
+    }
+    return name + "_program";
+}
+
+void CppEmitter::Emit(std::ostream &os, const std::string &source_path)
+{
+    labels.clear();
+
+    os << "// Translated from " << source_path << " by ares -emit-cpp. Do not edit;\n";
+    os << "// translate the bytecode again instead.\n";
+    os << "#include <avm/avm.h>\n\n";
+    os << "#include <vector>\n";
+    os << "#include <limits>\n\n";
+    os << "using namespace avm;\n\n";
+    os << "namespace {\n";
+    os << "// Takes a value off the stack, deleting its object if it is temporary\n";
+    os << "inline void Pop(VMInstance *vm, ValueStack &stack)\n";
+    os << "{\n";
+    os << "    if (stack.back().IsReference()) {\n";
+    os << "        vm->PopStack();\n";
+    os << "    } else {\n";
+    os << "        stack.pop_back();\n";
+    os << "    }\n";
+    os << "}\n\n";
+    EmitLoad(os);
+    os << "\n";
+    EmitRun(os);
+    os << "} // namespace\n\n";
+    os << "extern const avm::CompiledProgram " << symbol << " = { &Load, &Run };\n";
+}
+
+void CppEmitter::EmitLoad(std::ostream &os)
+{
+    const std::vector<AVMString_t> &strings = program.GetStrings();
+    const std::vector<DecodedInstruction> &code = program.code;
+
+    os << "void Load(Program &program)\n";
+    os << "{\n";
+    if (!strings.empty()) {
+        os << "    static const char *const string_constants[] = {\n";
+        for (const AVMString_t &str : strings) {
+            os << "        " << StringLiteral(str) << ",\n";
+        }
+        os << "    };\n";
+        os << "    program.SetStrings(std::vector<AVMString_t>(string_constants, string_constants + "
+           << strings.size() << "));\n";
+        os << "    const AVMString_t *strings = program.GetStrings().data();\n\n";
+    }
+
+    os << "    std::vector<DecodedInstruction> &code = program.code;\n";
+    os << "    code.resize(" << code.size() << ");\n";
+    for (size_t i = 0; i < code.size(); i++) {
+        const DecodedInstruction &ins = code[i];
+        std::string field = "code[" + std::to_string(i) + "].";
+
+        os << "    " << field << "opcode = " << (unsigned)ins.opcode << ";";
+        switch (ins.opcode) {
+        case Opcode_jump:
+        case Opcode_jump_if_true:
+        case Opcode_jump_if_false:
+            os << " " << field << "target = " << ins.target << ";";
+            break;
+        case Opcode_new_function:
+            os << " " << field << "is_variadic = " << (unsigned)ins.is_variadic << ";";
+            os << " " << field << "function.address = " << ins.function.address << ";";
+            os << " " << field << "function.num_args = " << ins.function.num_args << ";";
+            break;
+        case Opcode_drl:
+        case Opcode_invoke_object:
+        case Opcode_tail_invoke:
+        case Opcode_print:
+        case Opcode_break:
+        case Opcode_continue:
+            os << " " << field << "count = " << ins.count << ";";
+            break;
+        case Opcode_load_field:
+        case Opcode_load_global:
+        case Opcode_inc_field:
+        case Opcode_inc_global:
+        case Opcode_jump_if_not_less_field:
+        case Opcode_jump_if_not_less_global:
+            os << " " << field << "field.frame_index_difference = " << ins.field.frame_index_difference << ";";
+            os << " " << field << "field.field_index = " << ins.field.field_index << ";";
+            break;
+        case Opcode_load_integer:
+            os << " " << field << "integer = " << ins.integer << ";";
+            break;
+        case Opcode_load_float:
+            os << " " << field << "number = " << FloatLiteral(ins.number) << ";";
+            break;
+        case Opcode_store_as_local:
+        case Opcode_new_native_object:
+        case Opcode_new_member:
+        case Opcode_load_member:
+        case Opcode_load_local:
+        case Opcode_load_string:
+            os << " " << field << "string = &strings[" << (ins.string - strings.data()) << "];";
+            break;
+        default:
+            break;
+        }
+        os << "\n";
+    }
+
+    for (const ExceptionHandler &handler : program.handlers) {
+        os << "    program.handlers.push_back({ " << handler.begin << "u, " << handler.end << "u, "
+           << handler.handler << "u, " << handler.function << "u, " << handler.frame_depth << "u });\n";
+    }
+    os << "}\n";
+}
+
+/** The instructions are placed in a switch on the pc, which is only used where the
+    interpreter would have to find the next instruction anyway: after calls, returns,
+    changes of level, and exceptions. Instructions are skipped through the VM while
+    the read level is not equal to the frame level, as they would be by the interpreter.
+*/
+void CppEmitter::EmitRun(std::ostream &os)
+{
+    const std::vector<DecodedInstruction> &code = program.code;
+
+    std::vector<std::string> blocks;
+    for (size_t i = 0; i < code.size(); i++) {
+        blocks.push_back(Translate(i));
+    }
+
+    os << "void Run(VMInstance *vm)\n";
+    os << "{\n";
+    os << "    VMState *state = vm->state;\n";
+    os << "    ValueStack &stack = state->stack;\n";
+    os << "    DecodedInstruction *code = state->program->code.data();\n\n";
+    os << "    while (state->pc < state->pc_limit) {\n";
+    os << "        if (state->read_level != state->frame_level) {\n";
+    os << "            vm->SkipInstruction(&code[state->pc++]);\n";
+    os << "            continue;\n";
+    os << "        }\n\n";
+    os << "        switch (state->pc) {\n";
+    for (size_t i = 0; i < code.size(); i++) {
+        os << "        case " << i << ":\n";
+        if (labels.count(i) != 0) {
+            os << "        i" << i << ":\n";
+        }
+        os << "        {\n" << blocks[i] << "        }\n";
+    }
+    os << "        }\n";
+    // only reached by falling through the last instruction
+    os << "        state->pc = " << code.size() << ";\n";
+    os << "    }\n";
+    os << "}\n";
+}
+
+std::string CppEmitter::Translate(size_t index)
+{
+    const std::vector<DecodedInstruction> &code = program.code;
+    const DecodedInstruction &ins = code[index];
+    const std::string indent = "            ";
+
+    std::stringstream ss;
+    switch (ins.opcode) {
+    case Opcode_jump:
+        ss << indent << Goto(ins.target) << "\n";
+        break;
+    case Opcode_irl:
+        if (index + 1 < code.size() && code[index + 1].opcode == Opcode_ifl) {
+            // the levels are equal again once the block has been opened
+            ss << indent << "++state->read_level;\n";
+            ss << indent << "vm->OpenFrame();\n";
+            ss << indent << Goto(index + 2) << "\n";
+        } else {
+            ss << TranslateHandlerCall(index);
+        }
+        break;
+    case Opcode_jump_if_true:
+    case Opcode_jump_if_false:
+        ss << indent << "Value condition;\n";
+        ss << indent << "if (stack.back().ToInline(condition) && condition.type == Value::Type_int) {\n";
+        ss << indent << "    bool result = (condition.int_value != 0);\n";
+        ss << indent << "    Pop(vm, stack);\n";
+        ss << indent << "    if (" << (ins.opcode == Opcode_jump_if_true ? "result" : "!result") << ") {\n";
+        ss << indent << "        " << Goto(ins.target) << "\n";
+        ss << indent << "    }\n";
+        ss << indent << "} else {\n";
+        ss << indent << "    state->pc = " << (index + 1) << ";\n";
+        ss << indent << "    vm->HandleInstruction(&code[" << index << "]);\n";
+        ss << indent << "    continue;\n";
+        ss << indent << "}\n";
+        break;
+    case Opcode_load_integer:
+        ss << indent << "stack.push_back(Value(AVMInteger_t(" << ins.integer << ")));\n";
+        break;
+    case Opcode_load_float:
+        ss << indent << "stack.push_back(Value(AVMFloat_t(" << FloatLiteral(ins.number) << ")));\n";
+        break;
+    case Opcode_load_null:
+        ss << indent << "stack.push_back(Value());\n";
+        break;
+    case Opcode_load_string:
+        ss << indent << "state->pc = " << (index + 1) << ";\n";
+        ss << indent << "vm->PushString(*code[" << index << "].string);\n";
+        ss << indent << "if (state->pc_limit <= " << (index + 1) << ") {\n";
+        ss << indent << "    continue;\n";
+        ss << indent << "}\n";
+        break;
+    case Opcode_pop:
+        ss << indent << "Pop(vm, stack);\n";
+        break;
+    case Opcode_unary_minus:
+    case Opcode_unary_not:
+    case Opcode_assign:
+    case Opcode_add_assign:
+    case Opcode_sub_assign:
+    case Opcode_mul_assign:
+    case Opcode_div_assign:
+    case Opcode_print:
+    {
+        std::string call;
+        switch (ins.opcode) {
+        case Opcode_unary_minus: call = "vm->Operation(&Variable::Negate);"; break;
+        case Opcode_unary_not: call = "vm->Operation(&Variable::LogicalNot);"; break;
+        case Opcode_assign: call = "vm->Assignment();"; break;
+        case Opcode_add_assign: call = "vm->Assignment(&Variable::Add);"; break;
+        case Opcode_sub_assign: call = "vm->Assignment(&Variable::Subtract);"; break;
+        case Opcode_mul_assign: call = "vm->Assignment(&Variable::Multiply);"; break;
+        case Opcode_div_assign: call = "vm->Assignment(&Variable::Divide);"; break;
+        default: call = "vm->PrintObjects(" + std::to_string(ins.count) + ");"; break;
+        }
+        ss << indent << "state->pc = " << (index + 1) << ";\n";
+        ss << indent << call << "\n";
+        ss << indent << "if (state->pc_limit <= " << (index + 1) << ") {\n";
+        ss << indent << "    continue;\n";
+        ss << indent << "}\n";
+        break;
+    }
+    default:
+        if (FindOperation(ins.opcode) != nullptr) {
+            ss << TranslateOperation(index);
+        } else {
+            ss << TranslateHandlerCall(index);
+        }
+        break;
+    }
+
+    if (index + 1 == code.size()) {
+        // the end of the program is not a label
+        ss << indent << Goto(index + 1) << "\n";
+    }
+    return ss.str();
+}
+
+std::string CppEmitter::TranslateHandlerCall(size_t index)
+{
+    const std::vector<DecodedInstruction> &code = program.code;
+    const DecodedInstruction &ins = code[index];
+    const std::string indent = "            ";
+
+    std::stringstream ss;
+    ss << indent << "state->pc = " << (index + 1) << ";\n";
+    ss << indent << "vm->HandleInstruction(&code[" << index << "]);\n";
+
+    if (ChangesLevel(ins.opcode)) {
+        ss << indent << "continue;\n";
+        return ss.str();
+    }
+
+    ss << indent << "if (state->pc_limit <= " << (index + 1) << ") {\n";
+    ss << indent << "    continue;\n";
+    ss << indent << "}\n";
+
+    // superinstructions skip the instructions that hold their operands
+    std::vector<size_t> targets;
+    switch (ins.opcode) {
+    case Opcode_inc_field:
+    case Opcode_inc_global:
+        targets = { index + 4 };
+        break;
+    case Opcode_jump_if_not_less_field:
+    case Opcode_jump_if_not_less_global:
+        targets = { index + 4, code[index + 3].target };
+        break;
+    default:
+        break;
+    }
+    for (size_t target : targets) {
+        ss << indent << "if (state->pc == " << target << ") {\n";
+        ss << indent << "    " << Goto(target) << "\n";
+        ss << indent << "}\n";
+    }
+    return ss.str();
+}
+
+std::string CppEmitter::TranslateOperation(size_t index)
+{
+    const DecodedInstruction &ins = program.code[index];
+    const OperationInfo &info = *FindOperation(ins.opcode);
+    const std::string indent = "            ";
+
+    std::stringstream ss;
+    ss << indent << "Value left, right;\n";
+    ss << indent << "bool is_inline = stack[stack.size() - 2].ToInline(left) && stack.back().ToInline(right);\n";
+
+    const char *else_prefix = "";
+    if (info.integers) {
+        ss << indent << "if (is_inline && left.type == Value::Type_int && right.type == Value::Type_int" <<
+            (info.divides ? " && right.int_value != 0" : "") << ") {\n";
+        ss << indent << "    Pop(vm, stack);\n";
+        ss << indent << "    Pop(vm, stack);\n";
+        ss << indent << "    stack.push_back(Value(AVMInteger_t(left.int_value " << info.op << " right.int_value)));\n";
+        else_prefix = "} else ";
+    }
+    if (info.floats) {
+        ss << indent << else_prefix << "if (is_inline && left.type == Value::Type_float && right.type == Value::Type_float) {\n";
+        ss << indent << "    Pop(vm, stack);\n";
+        ss << indent << "    Pop(vm, stack);\n";
+        if (info.comparison) {
+            ss << indent << "    stack.push_back(Value(AVMInteger_t(left.float_value " << info.op << " right.float_value)));\n";
+        } else {
+            ss << indent << "    stack.push_back(Value(AVMFloat_t(left.float_value " << info.op << " right.float_value)));\n";
+        }
+        else_prefix = "} else ";
+    }
+
+    std::string body_indent = indent;
+    if (*else_prefix != '\0') {
+        ss << indent << "} else {\n";
+        body_indent += "    ";
+    }
+    ss << body_indent << "state->pc = " << (index + 1) << ";\n";
+    ss << body_indent << "vm->Operation(&Variable::" << info.method << ");\n";
+    ss << body_indent << "if (state->pc_limit <= " << (index + 1) << ") {\n";
+    ss << body_indent << "    continue;\n";
+    ss << body_indent << "}\n";
+    if (*else_prefix != '\0') {
+        ss << indent << "}\n";
+    }
+    return ss.str();
+}
+
+std::string CppEmitter::Goto(size_t index)
+{
+    if (index >= program.code.size()) {
+        return "state->pc = " + std::to_string(index) + "; continue;";
+    }
+    labels.insert(index);
+    return "goto i" + std::to_string(index) + ";";
+}
+} // namespace ares
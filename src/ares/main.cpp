@@ -67,7 +67,13 @@ int main(int argc, char *argv[])
     std::string code = "";
     std::string output_file = "";
     std::string input_file = "";
+    std::string cpp_file = "";
     bool code_loaded = false;
+    bool jit_enabled = true;
+    bool concurrent_marking = false;
+    size_t sweep_threads = 1;
+    bool compact_heap = false;
+    size_t max_heap_size = 0;
 
     if (argc >= 2) {
         for (int i = 1; i < argc; i++) {
@@ -78,8 +84,23 @@ int main(int argc, char *argv[])
                 } else if (std::strcmp(argv[i], "-code") == 0) {
                     code = argv[i + 1];
                     code_loaded = true;
+                } else if (std::strcmp(argv[i], "-emit-cpp") == 0) {
+                    // next should be the path of the C++ file
+                    cpp_file = argv[i + 1];
+                } else if (std::strcmp(argv[i], "-gc-sweep-threads") == 0) {
+                    sweep_threads = std::strtoul(argv[i + 1], nullptr, 10);
+                } else if (std::strcmp(argv[i], "-gc-max-heap") == 0) {
+                    max_heap_size = std::strtoul(argv[i + 1], nullptr, 10) * 1024 * 1024;
                 }
             }
+
+            if (std::strcmp(argv[i], "-nojit") == 0) {
+                jit_enabled = false;
+            } else if (std::strcmp(argv[i], "-gc-concurrent") == 0) {
+                concurrent_marking = true;
+            } else if (std::strcmp(argv[i], "-gc-compact") == 0) {
+                compact_heap = true;
+            }
         }
 
         if (!code_loaded) {
@@ -96,16 +117,40 @@ int main(int argc, char *argv[])
                 is.read(buffer, max_pos);
                 is.close();
 
-                // run compiled file
+                // the instruction format changes between versions, so old files must be recompiled
+                if (std::strncmp(buffer + ARES_MAGIC_LEN, ARES_VERSION, ARES_VERSION_LEN) != 0) {
+                    std::cout << "Bytecode file was compiled with a different version, please recompile: " << input_file << "\n";
+                    delete[] buffer;
+                    CleanUp();
+                    return 1;
+                }
+
                 ares::Script script;
+                script.jit_enabled = jit_enabled;
+                script.concurrent_marking = concurrent_marking;
+                script.sweep_threads = sweep_threads;
+                script.compact_heap = compact_heap;
+                script.max_heap_size = max_heap_size;
                 ares::ByteStream *stream = new ares::ByteStream(buffer, max_pos);
 
-                script.RunFromBytecode(stream);
+                if (!cpp_file.empty()) {
+                    // translate instead of running it
+                    if (script.EmitCpp(stream, input_file, cpp_file)) {
+                        std::cout << "Wrote " << cpp_file << "\n";
+                    }
+                } else {
+                    // run compiled file
+                    script.RunFromBytecode(stream);
+                }
                 CleanUp();
 
                 delete stream; 
                 delete[] buffer;
 
+            } else if (!cpp_file.empty()) {
+                std::cout << "-emit-cpp requires a compiled bytecode file: " << input_file << "\n";
+                CleanUp();
+                return 1;
             } else {
                 // assume it is a source code file
                 std::ifstream file(input_file);
@@ -128,6 +173,11 @@ int main(int argc, char *argv[])
                 }
 
                 ares::Script script;
+                script.jit_enabled = jit_enabled;
+                script.concurrent_marking = concurrent_marking;
+                script.sweep_threads = sweep_threads;
+                script.compact_heap = compact_heap;
+                script.max_heap_size = max_heap_size;
                 if (!script.CompileAndRun(code, input_file, output_file)) {
                     std::cin.get();
                     CleanUp();
@@ -143,6 +193,12 @@ int main(int argc, char *argv[])
         std::cout << "Usage: " << program_file << " <filepath>\n";
         std::cout << "\t-o <filepath>: Output bytecode to a specified file.\n";
         std::cout << "\t-code <code string>: Execute code from a string, rather than from a file.\n";
+        std::cout << "\t-emit-cpp <filepath>: Translate a compiled bytecode file to C++, rather than running it.\n";
+        std::cout << "\t-nojit: Interpret all code, rather than compiling hot functions to native code.\n";
+        std::cout << "\t-gc-concurrent: Mark the heap on a separate thread during garbage collection.\n";
+        std::cout << "\t-gc-compact: Move objects out of sparse memory after garbage collection, and release it.\n";
+        std::cout << "\t-gc-sweep-threads <count>: Sweep the heap on this many threads during garbage collection.\n";
+        std::cout << "\t-gc-max-heap <megabytes>: Raise an out of memory exception once the heap holds more than this.\n";
     }
 
     std::cout << "Elapsed time: " << timer.elapsed() << "\n";
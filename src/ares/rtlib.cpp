@@ -262,6 +262,21 @@ void RuntimeLib::Runtime_invoke(VMState *state, Object **args, uint32_t argc)
     }
 }
 
+void RuntimeLib::Runtime_allocations(VMState *state, Object **args, uint32_t argc)
+{
+    if (CheckArgs(state, 0, argc)) {
+        // read before the result takes a handle of its own
+        auto count = (AVMInteger_t)state->heap.NumAllocated();
+        auto ref = Reference(*state->heap.AllocNull());
+        auto result = new Variable();
+        result->Assign(count);
+        result->flags |= Object::FLAG_CONST;
+        result->flags |= Object::FLAG_TEMPORARY;
+        ref.Ref() = result;
+        state->stack.push_back(ref);
+    }
+}
+
 void RuntimeLib::Console_println(VMState *state, Object **args, uint32_t argc)
 {
     //if (CheckArgs(state, 1, argc)) {  /* No need to check args, variadic */
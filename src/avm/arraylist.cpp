@@ -17,13 +17,25 @@ Reference Array::Clone(VMState *state)
     auto ref = Reference(*state->heap.AllocObject<Array>());
 
     // copy all members
-    for (auto &&member : fields) {
-        ref.Ref()->AddFieldReference(state, member.first, member.second.Ref()->Clone(state));
+    for (size_t i = 0; i < slots.size(); i++) {
+        ref.Ref()->AddFieldReference(state, FieldName(i), slots[i].Ref()->Clone(state));
     }
 
     return ref;
 }
 
+Object *Array::Relocate(void *memory)
+{
+    Array *moved = new (memory) Array();
+    MoveTo(moved);
+    return moved;
+}
+
+size_t Array::Size() const
+{
+    return sizeof(Array) + FieldsSize();
+}
+
 std::string Array::ToString() const
 {
     return TypeString();
@@ -4,11 +4,24 @@
 #include <common/util/logger.h>
 
 #include <sstream>
+#include <functional>
+#include <type_traits>
+#include <atomic>
+#include <mutex>
 
 namespace avm {
 VMInstance::VMInstance()
+    : jit_enabled(true),
+      concurrent_marking(false),
+      sweep_threads(1),
+      compact_heap(false),
+      num_collections(0),
+      collection_bytes(0)
 {
     state = new VMState(this);
+#if AVM_JIT
+    jit = nullptr;
+#endif
 }
 
 VMInstance::~VMInstance()
@@ -28,42 +41,36 @@ bool VMInstance::NewNativeObject(const AVMString_t &name)
 void VMInstance::OpenFrame()
 {
     ++state->frame_level;
-    state->frames.push_back(new Frame());
+    if ((size_t)state->frame_level == state->frames.size()) {
+        state->frames.push_back(new Frame());
+    }
 }
 
 void VMInstance::CloseFrame()
 {
-    delete state->frames.back();
-    state->frames.pop_back();
+    // keep the frame for the next time this level is opened
+    Frame *frame = state->frames[state->frame_level];
+    for (auto &&local : frame->locals) {
+        state->heap.RemoveRef(local.second.Ptr());
+    }
+    frame->locals.clear();
+    frame->last_cond = false;
     --state->frame_level;
 }
 
 void VMInstance::PushInt(AVMInteger_t value)
 {
-    auto ref = Reference(*state->heap.AllocNull());
-
-    auto var = new Variable();
-    var->Assign(value);
-    var->flags |= Object::FLAG_CONST;
-    var->flags |= Object::FLAG_TEMPORARY;
-
-    ref.Ref() = var;
-
-    PushReference(ref);
+    state->stack.push_back(Value(value));
 }
 
 void VMInstance::PushFloat(AVMFloat_t value)
 {
-    auto ref = Reference(*state->heap.AllocNull());
-
-    auto var = new Variable();
-    var->Assign(value);
-    var->flags |= Object::FLAG_CONST;
-    var->flags |= Object::FLAG_TEMPORARY;
-
-    ref.Ref() = var;
+    state->stack.push_back(Value(value));
+}
 
-    PushReference(ref);
+void VMInstance::PushNull()
+{
+    state->stack.push_back(Value());
 }
 
 void VMInstance::PushString(const AVMString_t &value)
@@ -90,23 +97,97 @@ void VMInstance::PushReference(Reference ref)
 */
 void VMInstance::PopStack()
 {
-    if (state->stack.back().Ref()->flags & Object::FLAG_TEMPORARY) {
-        state->stack.back().DeleteObject();
-    }
+    Release(state->stack.back());
     state->stack.pop_back();
 }
 
+/** Deletes the object held by a value that has been taken off the stack,
+    if it is marked temporary. Inline values do not need to be released.
+*/
+void VMInstance::Release(const Value &value)
+{
+    Object *object = value.GetObject();
+    if (object != nullptr && (object->flags & Object::FLAG_TEMPORARY)) {
+        state->heap.DeleteObject(value.ptr);
+    }
+}
+
+/** No. bytes held by the object of a value, or 0 for inline values and null */
+static inline size_t ObjectSize(const Value &value)
+{
+    Object *object = value.GetObject();
+    return (object != nullptr) ? object->Size() : 0;
+}
+
+/** Named variables are cloned by an operation, so their size is counted along
+    with the size of the other operand, which a string result may grow by.
+*/
+static inline size_t OperationSize(const Value &left, const Value &right)
+{
+    Object *object = left.GetObject();
+    bool is_temp = (object != nullptr) && (object->flags & Object::FLAG_TEMPORARY);
+    return (is_temp ? 0 : ObjectSize(left)) + ObjectSize(right);
+}
+
 void VMInstance::Operation(BinOp_t op)
 {
-    auto right = state->stack.back(); state->stack.pop_back();
-    auto left = state->stack.back(); state->stack.pop_back();
+    auto &stack = state->stack;
+    if (!ReserveHeap(OperationSize(stack[stack.size() - 2], stack.back()))) {
+        Release(stack.back()); stack.pop_back();
+        Release(stack.back()); stack.pop_back();
+        PushNull();
+        return;
+    }
+
+    Value right = state->stack.back(); state->stack.pop_back();
+    Value left = state->stack.back(); state->stack.pop_back();
+
+    // numbers are read through a variable on the native stack
+    Value right_value;
+    Variable right_inline;
+    Variable *right_var = &right_inline;
+    if (right.ToInline(right_value)) {
+        right_inline.AssignInline(right_value);
+    } else {
+        right_var = dynamic_cast<Variable*>(right.GetObject());
+        if (!right_var) {
+            state->HandleException(TypeException(right.TypeString()));
+            Release(right);
+            Release(left);
+            PushNull();
+            return;
+        }
+    }
+
+    Value left_value;
+    if (left.ToInline(left_value)) {
+        // numbers are operated on without allocating, and the result is held inline
+        Variable result;
+        result.AssignInline(left_value);
+        try {
+            (result.*op)(state, right_var);
+        } catch (const std::exception &ex) {
+            state->HandleException(Exception(ex.what()));
+        }
 
-    auto result = left.Ref()->Clone(state);
+        Release(right);
+        Release(left);
 
-    Variable *right_var = dynamic_cast<Variable*>(right.Ref());
-    if (!right_var) {
-        state->HandleException(TypeException(right.Ref()->TypeString()));
+        Value result_value;
+        if (result.ToInline(result_value)) {
+            state->stack.push_back(result_value);
+        } else {
+            auto ref = result.Clone(state);
+            ref.Ref()->flags |= Object::FLAG_TEMPORARY;
+            PushReference(ref);
+        }
+        return;
     }
+
+    // a temporary is not referenced from anywhere else, so it is modified in place.
+    // named variables are cloned, so that they are left unchanged
+    bool is_temp = (left.GetObject()->flags & Object::FLAG_TEMPORARY);
+    Reference result = is_temp ? left.Ref() : left.Ref().Ref()->Clone(state);
     try {
         // todo dynamic_cast to make sure it is Variable type
         ((*static_cast<Variable*>(result.Ref())).*op)(state, right_var);
@@ -114,22 +195,49 @@ void VMInstance::Operation(BinOp_t op)
         state->HandleException(Exception(ex.what()));
     }
 
-    if (right.Ref()->flags & Object::FLAG_TEMPORARY) {
-        right.DeleteObject();
-    }
-    if (left.Ref()->flags & Object::FLAG_TEMPORARY) {
-        left.DeleteObject();
-    }
+    Release(right);
 
     result.Ref()->flags |= Object::FLAG_TEMPORARY;
-    PushReference(Reference(result));
+    PushReference(result);
 }
 
 void VMInstance::Operation(UnOp_t op)
 {
-    auto top = state->stack.back(); state->stack.pop_back();
+    if (!ReserveHeap(OperationSize(state->stack.back(), Value()))) {
+        Release(state->stack.back()); state->stack.pop_back();
+        PushNull();
+        return;
+    }
+
+    Value top = state->stack.back(); state->stack.pop_back();
+
+    Value top_value;
+    if (top.ToInline(top_value)) {
+        // numbers are operated on without allocating, and the result is held inline
+        Variable result;
+        result.AssignInline(top_value);
+        try {
+            (result.*op)(state);
+        } catch (const std::exception &ex) {
+            state->HandleException(Exception(ex.what()));
+        }
 
-    auto result = top.Ref()->Clone(state);
+        Release(top);
+
+        Value result_value;
+        if (result.ToInline(result_value)) {
+            state->stack.push_back(result_value);
+        } else {
+            auto ref = result.Clone(state);
+            ref.Ref()->flags |= Object::FLAG_TEMPORARY;
+            PushReference(ref);
+        }
+        return;
+    }
+
+    // as with binary operations, only named variables are cloned
+    bool is_temp = (top.GetObject()->flags & Object::FLAG_TEMPORARY);
+    Reference result = is_temp ? top.Ref() : top.Ref().Ref()->Clone(state);
     try {
         // todo dynamic_cast to amke sure it is Variable type
         ((*static_cast<Variable*>(result.Ref())).*op)(state);
@@ -137,22 +245,179 @@ void VMInstance::Operation(UnOp_t op)
         state->HandleException(Exception(ex.what()));
     }
 
-    if (top.Ref()->flags & Object::FLAG_TEMPORARY) {
-        top.DeleteObject();
-    }
-
     result.Ref()->flags |= Object::FLAG_TEMPORARY;
     PushReference(result);
 }
 
+/** Returns the typed form of a generic operation that suits the operands
+    on top of the stack, or the generic opcode if there is none.
+*/
+Opcode_t VMInstance::ObserveOperands(Opcode_t generic)
+{
+    auto &stack = state->stack;
+    const Value &left = stack[stack.size() - 2];
+    const Value &right = stack.back();
+
+    Value left_value, right_value;
+    if (left.ToInline(left_value) && right.ToInline(right_value)) {
+        if (left_value.type == Value::Type_int && right_value.type == Value::Type_int) {
+            return IntegerOpcode(generic);
+        } else if (left_value.type == Value::Type_float && right_value.type == Value::Type_float) {
+            return FloatOpcode(generic);
+        }
+    } else if (StringOpcode(generic) != generic) {
+        Variable *left_var = dynamic_cast<Variable*>(left.GetObject());
+        Variable *right_var = dynamic_cast<Variable*>(right.GetObject());
+        if (left_var != nullptr && right_var != nullptr &&
+            left_var->type == Variable::Type_string && right_var->type == Variable::Type_string) {
+            return StringOpcode(generic);
+        }
+    }
+    return generic;
+}
+
+/** The operand types are checked each time a generic operation is performed.
+    Once the same types have been seen AVM_QUICKEN_THRESHOLD times in a row,
+    the instruction is rewritten to the typed form, so that the next time it
+    is read, the typed handler is used instead.
+*/
+void VMInstance::QuickenOperation(DecodedInstruction &ins, BinOp_t op)
+{
+#if AVM_QUICKENING
+    if (ins.deopt_count < AVM_QUICKEN_MAX_DEOPT) {
+        Opcode_t typed = ObserveOperands(ins.opcode);
+        if (typed != ins.feedback) {
+            // different types than last time
+            ins.feedback = typed;
+            ins.feedback_count = 0;
+        }
+
+        if (typed != ins.opcode && ++ins.feedback_count >= AVM_QUICKEN_THRESHOLD) {
+            DEBUG_LOG("Quicken instruction #%u", (unsigned)(&ins - &state->program->code[0]));
+            ins.opcode = typed;
+            ins.feedback_count = 0;
+        }
+    }
+#endif
+    Operation(op);
+}
+
+/** Called when a typed instruction sees operands it was not specialized for.
+    After AVM_QUICKEN_MAX_DEOPT times, the instruction is left generic, so that
+    an instruction which sees many types does not keep getting rewritten.
+*/
+void VMInstance::Deoptimize(DecodedInstruction &ins)
+{
+#if AVM_QUICKENING
+    DEBUG_LOG("Deoptimize instruction #%u", (unsigned)(&ins - &state->program->code[0]));
+    ins.opcode = GenericOpcode(ins.opcode);
+    ins.feedback = Opcode_nop;
+    ins.feedback_count = 0;
+    if (ins.deopt_count < AVM_QUICKEN_MAX_DEOPT) {
+        ++ins.deopt_count;
+    }
+#endif
+}
+
+/** Converts the result of a typed operation to a value. Comparisons give integers */
+static inline Value MakeValue(AVMInteger_t i) { return Value(i); }
+static inline Value MakeValue(AVMFloat_t f) { return Value(f); }
+static inline Value MakeValue(bool b) { return Value(AVMInteger_t(b)); }
+
+template <typename Op>
+void VMInstance::IntegerOperation(DecodedInstruction &ins, BinOp_t generic)
+{
+    auto &stack = state->stack;
+
+    Value left, right;
+    if (stack[stack.size() - 2].ToInline(left) && left.type == Value::Type_int &&
+        stack.back().ToInline(right) && right.type == Value::Type_int) {
+        PopStack();
+        Release(stack.back());
+        stack.back() = MakeValue(Op()(left.int_value, right.int_value));
+    } else {
+        Deoptimize(ins);
+        Operation(generic);
+    }
+}
+
+template <typename Op>
+void VMInstance::FloatOperation(DecodedInstruction &ins, BinOp_t generic)
+{
+    auto &stack = state->stack;
+
+    Value left, right;
+    if (stack[stack.size() - 2].ToInline(left) && left.type == Value::Type_float &&
+        stack.back().ToInline(right) && right.type == Value::Type_float) {
+        PopStack();
+        Release(stack.back());
+        stack.back() = MakeValue(Op()(left.float_value, right.float_value));
+    } else {
+        Deoptimize(ins);
+        Operation(generic);
+    }
+}
+
+void VMInstance::Concatenate(DecodedInstruction &ins)
+{
+    auto &stack = state->stack;
+
+    Variable *left = dynamic_cast<Variable*>(stack[stack.size() - 2].GetObject());
+    Variable *right = dynamic_cast<Variable*>(stack.back().GetObject());
+    if (left == nullptr || right == nullptr ||
+        left->type != Variable::Type_string || right->type != Variable::Type_string) {
+        Deoptimize(ins);
+        Operation(&Variable::Add);
+        return;
+    }
+
+    if (!ReserveHeap(OperationSize(stack[stack.size() - 2], stack.back()))) {
+        Release(stack.back()); stack.pop_back();
+        Release(stack.back()); stack.pop_back();
+        PushNull();
+        return;
+    }
+    // the collection may have moved the strings
+    left = static_cast<Variable*>(stack[stack.size() - 2].GetObject());
+    right = static_cast<Variable*>(stack.back().GetObject());
+
+    // as with Operation(), only named variables are cloned
+    Reference result = stack[stack.size() - 2].Ref();
+    if (!(left->flags & Object::FLAG_TEMPORARY)) {
+        result = left->Clone(state);
+        result.Ref()->flags |= Object::FLAG_TEMPORARY;
+    }
+
+    static_cast<Variable*>(result.Ref())->Cast<AVMString_t&>() += right->Cast<AVMString_t&>();
+
+    PopStack();
+    stack.back() = result;
+}
+
 void VMInstance::Assignment()
 {
-    auto right = state->stack.back(); state->stack.pop_back();
-    auto left = state->stack.back();
+    // the right side is cloned before the old value is released
+    size_t size = state->stack.back().IsReference() ? ObjectSize(state->stack.back()) : sizeof(Variable);
+    if (!ReserveHeap(size)) {
+        Release(state->stack.back()); state->stack.pop_back();
+        return;
+    }
+
+    Value right = state->stack.back(); state->stack.pop_back();
+    Value left_value = state->stack.back();
+
+    if (!left_value.IsReference()) {
+        // inline values are literals or the results of operations
+        state->HandleException(ConstException());
+        Release(right);
+        return;
+    }
+
+    Reference left = left_value.Ref();
 
     bool is_temp = (left.Ref() != nullptr) && (left.Ref()->flags & Object::FLAG_TEMPORARY);
 
-    if (right.Ref() == nullptr) {
+    if (right.IsReference() && right.GetObject() == nullptr) {
         state->HandleException(NullRefException());
     }
 
@@ -160,88 +425,283 @@ void VMInstance::Assignment()
         state->HandleException(ConstException());
     }
 
-    left.DeleteObject(); // deallocate memory and set to null
-    std::swap(left.Ref(), right.Ref()->Clone(state).Ref()); // change left ref to cloned value
+    if (!right.IsReference()) {
+        Value old_value;
+        if (left.Ref() != nullptr && left.Ref()->ToInline(old_value)) {
+            // a number is replaced by another number, so the variable is reused
+            static_cast<Variable*>(left.Ref())->AssignInline(right);
+        } else {
+            auto var = new Variable();
+            var->AssignInline(right);
+            state->heap.ReplaceObject(left.Ptr(), var); // deallocate memory and set to the new variable
+        }
+    } else {
+        // change left ref to cloned value, deallocating the old one
+        Reference clone = right.Ref().Ref()->Clone(state);
+        state->heap.ReplaceObject(left.Ptr(), clone.Ref());
+        clone.Ref() = nullptr;
+        // the clone's fields are young
+        state->heap.WriteBarrier(left.Ptr());
+    }
 
     if (is_temp) {
         left.Ref()->flags |= Object::FLAG_TEMPORARY;
     }
 
-    if (right.Ref()->flags & Object::FLAG_TEMPORARY) {
-        right.DeleteObject();
-    }
+    Release(right);
 }
 
 void VMInstance::Assignment(BinOp_t op)
 {
-    auto right = state->stack.back(); state->stack.pop_back();
-    auto left = state->stack.back();
+    // the left side may grow by the size of the right
+    if (!ReserveHeap(ObjectSize(state->stack.back()))) {
+        Release(state->stack.back()); state->stack.pop_back();
+        return;
+    }
+
+    Value right = state->stack.back(); state->stack.pop_back();
+    Value left = state->stack.back();
+
+    if (!left.IsReference()) {
+        // inline values are literals or the results of operations
+        state->HandleException(ConstException());
+        Release(right);
+        return;
+    }
 
-    if (left.Ref()->flags & Object::FLAG_CONST) {
+    if (left.GetObject() != nullptr && (left.GetObject()->flags & Object::FLAG_CONST)) {
         state->HandleException(ConstException());
     }
 
-    Variable *left_var = dynamic_cast<Variable*>(left.Ref());
+    Variable *left_var = dynamic_cast<Variable*>(left.GetObject());
     if (!left_var) {
         state->HandleException(NullRefException());
     }
 
-    Variable *right_var = dynamic_cast<Variable*>(right.Ref());
-    if (!right_var) {
-        state->HandleException(TypeException(right.Ref()->TypeString()));
+    Variable right_inline;
+    Variable *right_var = &right_inline;
+    if (right.IsReference()) {
+        right_var = dynamic_cast<Variable*>(right.GetObject());
+        if (!right_var) {
+            state->HandleException(TypeException(right.TypeString()));
+        }
+    } else {
+        right_inline.AssignInline(right);
     }
 
     ((*left_var).*op)(state, right_var);
 
-    if (right.Ref()->flags & Object::FLAG_TEMPORARY) {
-        right.DeleteObject();
-    }
+    Release(right);
 }
 
 void VMInstance::PrintObjects(size_t nargs)
 {
     for (size_t i = 0; i < nargs; i++) {
-        auto top = state->stack.back(); state->stack.pop_back();
+        Value top = state->stack.back(); state->stack.pop_back();
 
-        if (top.Ref() == nullptr) {
+        if (top.IsReference() && top.GetObject() == nullptr) {
             state->HandleException(NullRefException());
         }
 
-        std::string s(top.Ref()->ToString());
+        std::string s(top.ToString());
         /*std::wstring ws(s.size(), L' ');
         ws.resize(std::mbstowcs(&ws[0], s.c_str(), s.size()));
         output << ws;*/
         std::cout << s;
 
-        if (top.Ref()->flags & Object::FLAG_TEMPORARY) {
-            top.DeleteObject();
-        }
+        Release(top);
+    }
+}
+
+/** Converts the value used by a conditional statement to a boolean */
+bool VMInstance::IsTrue(const Value &value)
+{
+    switch (value.type) {
+    case Value::Type_int:
+        return value.int_value != 0;
+    case Value::Type_float:
+        return value.float_value != 0.0;
+    case Value::Type_null:
+        state->HandleException(NullRefException());
+        return false;
+    default:
+        break;
+    }
+
+    Variable *var = dynamic_cast<Variable*>(value.GetObject());
+    if (!var) {
+        state->HandleException(NullRefException());
+        return false;
+    }
+
+    bool result = false;
+    try {
+        result = var->Cast<bool>();
+    } catch (const std::exception &ex) {
+        state->HandleException(Exception(ex.what()));
     }
+    return result;
 }
 
 void VMInstance::GC()
 {
     DEBUG_LOG("run gc");
-    MarkObjects();
-    state->heap.Sweep();
+    Heap &heap = state->heap;
+    if (heap.GetPhase() == Heap::Phase_idle) {
+        BeginCollection();
+    }
+#if AVM_GC_CONCURRENT
+    if (heap.IsMarkingConcurrently()) {
+        // the rest is marked on this thread
+        heap.StopConcurrentMark();
+    }
+#endif
+    while (!CollectStep(SIZE_MAX)) {
+    }
+}
+
+/** Roots are only followed into the young generation, along with the young
+    handles that the write barrier recorded old handles referring to.
+*/
+void VMInstance::MinorGC()
+{
+    DEBUG_LOG("run minor gc");
+    Heap &heap = state->heap;
+    GreyRoots();
+    heap.MarkRemembered();
+    heap.MarkStep(SIZE_MAX);
+    heap.SweepYoung();
 }
 
+/** With AVM_GC_GENERATIONAL, the young generation is collected once it is full,
+    and the old generation only once the heap holds more bytes than the trigger.
+    With AVM_GC_INCREMENTAL, the old generation is collected a step at a time, each
+    time this is called, so that no single call marks or sweeps the whole heap.
+*/
 void VMInstance::SuggestGC()
 {
     DEBUG_LOG("suggest gc");
-    if (state->heap.NumObjects() >= state->max_objects) {
+    Heap &heap = state->heap;
+#if AVM_GC_REFCOUNT
+    if (heap.HasZeroCount()) {
+        ReclaimUnreferenced();
+    }
+#endif
+    heap.MeasureYoung();
+
+    size_t max_heap_size = state->heap_policy.max_heap_size;
+    if (max_heap_size != 0 && heap.NumBytes() > max_heap_size) {
+        GC();
+        if (heap.NumBytes() > max_heap_size) {
+            state->HandleException(OutOfMemoryException(heap.NumBytes(), max_heap_size));
+        }
+        return;
+    }
+
+#if AVM_GC_INCREMENTAL
+    if (heap.GetPhase() != Heap::Phase_idle) {
+        CollectStep(state->gc_step_work);
+        return;
+    }
+#endif
+#if AVM_GC_GENERATIONAL
+    if (heap.NumYoung() < AVM_GC_NURSERY_SIZE && heap.YoungBytes() < state->heap_policy.nursery_bytes) {
+        return;
+    }
+    MinorGC();
+#endif
+    if (heap.NumBytes() >= state->gc_trigger_bytes) {
+#if AVM_GC_INCREMENTAL
+        BeginCollection();
+        CollectStep(state->gc_step_work);
+#else
         GC();
+#endif
+    }
+}
+
+/** Objects are measured once they have been allocated, so the limit is checked
+    here as well, before an operation allocates, so that a value which would pass
+    the limit is never assigned to a variable that outlives the exception.
+*/
+bool VMInstance::ReserveHeap(size_t size)
+{
+    size_t max_heap_size = state->heap_policy.max_heap_size;
+    if (max_heap_size == 0) {
+        return true;
+    }
+
+    Heap &heap = state->heap;
+    heap.MeasureYoung();
+    if (heap.NumBytes() + size <= max_heap_size) {
+        return true;
+    }
+
+    // the operands are still on the stack, so they are kept
+    GC();
+    if (heap.NumBytes() + size <= max_heap_size) {
+        return true;
+    }
+
+    state->HandleException(OutOfMemoryException(heap.NumBytes() + size, max_heap_size));
+    return false;
+}
+
+/** The share of the heap that survived is taken from the bytes it held when the
+    collection began, so objects allocated during an incremental collection count
+    as survivors.
+*/
+void VMInstance::SetTrigger()
+{
+    const HeapPolicy &policy = state->heap_policy;
+    size_t live_bytes = state->heap.NumBytes();
+    double survived = 1.0;
+    if (live_bytes < collection_bytes) {
+        survived = (double)live_bytes / collection_bytes;
+    }
+
+    double growth = policy.min_growth_factor + (policy.max_growth_factor - policy.min_growth_factor) * survived;
+    size_t allowed = (size_t)(live_bytes * growth);
+    if (allowed < policy.min_trigger_bytes) {
+        allowed = policy.min_trigger_bytes;
+    }
+    state->gc_trigger_bytes = live_bytes + allowed;
+    if (policy.max_heap_size != 0 && state->gc_trigger_bytes > policy.max_heap_size) {
+        // collect before the limit is reached, rather than once it has been passed
+        state->gc_trigger_bytes = policy.max_heap_size;
+    }
+}
 
-        if (state->max_objects < GC_THRESHOLD_MAX) {
-            state->max_objects += GC_THRESHOLD_STEP;
+#if AVM_GC_REFCOUNT
+void VMInstance::ReclaimUnreferenced()
+{
+    Heap &heap = state->heap;
+    for (const Value &value : state->stack) {
+        if (value.IsReference()) {
+            heap.Pin(value.ptr);
+        }
+    }
+    heap.ReclaimZeroCount();
+    for (const Value &value : state->stack) {
+        if (value.IsReference()) {
+            heap.Unpin(value.ptr);
         }
     }
 }
+#endif
 
-void VMInstance::MarkObjects()
+void VMInstance::GreyRoots()
 {
-    for (Reference &ref : state->stack) {
-        ref.Ref()->Mark();
+    Heap &heap = state->heap;
+
+    for (const Value &value : state->stack) {
+        if (value.IsReference()) {
+            heap.Grey(value.ptr);
+        }
+    }
+
+    for (auto &&it : state->natives) {
+        heap.Grey(it.second.Ptr());
     }
 
     // start at current level
@@ -249,943 +709,1015 @@ void VMInstance::MarkObjects()
     while (start >= AVM_LEVEL_GLOBAL) {
         if (state->frames[start] != nullptr) {
             for (auto &&it : state->frames[start]->locals) {
-                it.second.Ref()->Mark();
+                heap.Grey(it.second.Ptr());
             }
         }
         --start;
     }
 }
 
-/** In the AVM, code is executed on the condition that the "read level" is
-    equal to the "frame level". The frame level is typically incremented where
-    the original source code would contain an open curly brace. That way, when an
-    "if" statement is encountered, the code inside the body is not executed unless
-    the read level is equal to the frame level. Thus, in this case, the read level
-    should only be incremented only if the conditions within the "if" statement
-    evaluate to true.
+/** The young generation is collected first, so that every young handle has
+    been allocated during the collection, and so is known to be live.
 */
-void VMInstance::HandleInstruction(Opcode_t opcode)
+void VMInstance::BeginCollection()
 {
-    switch (opcode) {
-    case Opcode_ifl:
-    {
-        OpenFrame();
-        DEBUG_LOG("Increase frame level to: %d. Read level is: %d", state->frame_level, state->read_level);
-        break;
-    }
-    case Opcode_dfl:
-    {
-        bool should_suggest_gc = false;
-        if (state->read_level == state->frame_level) {
-            should_suggest_gc = true;
-            --state->read_level;
-            DEBUG_LOG("Decrease read level to: %d", state->read_level);
-        }
-
-        CloseFrame();
-        DEBUG_LOG("Decrease frame level to: %d", state->frame_level);
+    Heap &heap = state->heap;
+    if (heap.NumYoung() != 0) {
+        MinorGC();
+    }
+    collection_bytes = heap.NumBytes();
+#if AVM_GC_PARALLEL_SWEEP
+    heap.SetSweepThreads(sweep_threads);
+#endif
+    heap.BeginMark();
+    GreyRoots();
+#if AVM_GC_CONCURRENT
+    if (concurrent_marking) {
+        heap.BeginConcurrentMark();
+    }
+#endif
+}
 
-        if (should_suggest_gc) {
-            // collect garbage to free variables from previous frame
-            SuggestGC();
+/** Marking is finished once no handle is grey after the roots are marked again,
+    since the stack and frames are not covered by the write barrier.
+*/
+bool VMInstance::CollectStep(size_t work)
+{
+    Heap &heap = state->heap;
+    if (heap.GetPhase() == Heap::Phase_mark) {
+#if AVM_GC_CONCURRENT
+        if (heap.IsMarkingConcurrently()) {
+            // the final remark. With snapshot-at-the-beginning marking, the roots
+            // are not marked again, so this only waits for the marking thread
+            if (heap.FinishConcurrentMark()) {
+                heap.BeginSweep();
+            } else if (heap.NumYoung() >= AVM_GC_NURSERY_SIZE) {
+                // there are no minor collections until marking has finished, so once
+                // the nursery is full, this thread helps to finish it
+                heap.AssistConcurrentMark(work);
+            }
+            return false;
         }
+#endif
+        if (heap.MarkStep(work)) {
+            GreyRoots();
+            // no work, only checks whether any handle is grey
+            if (heap.MarkStep(0)) {
+                heap.BeginSweep();
+            }
+        }
+        return false;
+    }
 
-        break;
+    if (!heap.SweepStep(work)) {
+        return false;
     }
-    case Opcode_irl:
-    {
-        if (state->read_level == state->frame_level) {
-            ++state->read_level;
-            DEBUG_LOG("Increase read level to: %d", state->read_level);
-        }
+    ++num_collections;
+    SetTrigger();
+#if AVM_GC_COMPACT
+    if (compact_heap && num_collections % AVM_GC_COMPACT_INTERVAL == 0) {
+        // only handles refer to objects at a safepoint, so they may be moved
+        heap.Compact();
+    }
+#endif
+    return true;
+}
 
-        break;
+/** The statement that handles each opcode of AVM_OPCODES. Both the switch interpreter
+    and the threaded interpreter are generated from this list, so that they always
+    behave the same way. Whether a handler may change the levels is looked up in
+    AVM_OPCODES (see ChangesLevel), which the C++ emitter shares.
+*/
+#define AVM_OPCODE_HANDLERS(X) \
+    X(Opcode_ifl, Handle_ifl()) \
+    X(Opcode_dfl, Handle_dfl()) \
+    X(Opcode_irl, Handle_irl()) \
+    X(Opcode_drl, Handle_drl(*ins)) \
+    X(Opcode_irl_if_true, Handle_irl_if_true()) \
+    X(Opcode_irl_if_false, Handle_irl_if_false()) \
+    X(Opcode_jump, Handle_jump(*ins)) \
+    X(Opcode_jump_if_true, Handle_jump_if_true(*ins)) \
+    X(Opcode_jump_if_false, Handle_jump_if_false(*ins)) \
+    X(Opcode_store_as_local, Handle_store_as_local(*ins)) \
+    X(Opcode_new_native_object, Handle_new_native_object(*ins)) \
+    X(Opcode_array_index, Handle_array_index()) \
+    X(Opcode_new_member, Handle_new_member(*ins)) \
+    X(Opcode_load_member, Handle_load_member(*ins)) \
+    X(Opcode_new_structure, Handle_new_structure()) \
+    X(Opcode_new_function, Handle_new_function(*ins)) \
+    X(Opcode_invoke_object, Handle_invoke_object(*ins)) \
+    X(Opcode_tail_invoke, Handle_tail_invoke(*ins)) \
+    X(Opcode_leave, Handle_leave()) \
+    X(Opcode_return, Handle_return()) \
+    X(Opcode_break, Handle_break(*ins)) \
+    X(Opcode_continue, Handle_continue(*ins)) \
+    X(Opcode_print, Handle_print(*ins)) \
+    X(Opcode_load_local, Handle_load_local(*ins)) \
+    X(Opcode_load_field, Handle_load_field(*ins)) \
+    X(Opcode_load_global, Handle_load_global(*ins)) \
+    X(Opcode_load_integer, Handle_load_integer(*ins)) \
+    X(Opcode_load_float, Handle_load_float(*ins)) \
+    X(Opcode_load_string, Handle_load_string(*ins)) \
+    X(Opcode_load_null, Handle_load_null()) \
+    X(Opcode_pop, PopStack()) \
+    X(Opcode_unary_minus, Operation(&Variable::Negate)) \
+    X(Opcode_unary_not, Operation(&Variable::LogicalNot)) \
+    X(Opcode_add, QuickenOperation(*ins, &Variable::Add)) \
+    X(Opcode_sub, QuickenOperation(*ins, &Variable::Subtract)) \
+    X(Opcode_mul, QuickenOperation(*ins, &Variable::Multiply)) \
+    X(Opcode_div, QuickenOperation(*ins, &Variable::Divide)) \
+    X(Opcode_mod, QuickenOperation(*ins, &Variable::Modulus)) \
+    X(Opcode_pow, Operation(&Variable::Power)) \
+    X(Opcode_and, Operation(&Variable::LogicalAnd)) \
+    X(Opcode_or, Operation(&Variable::LogicalOr)) \
+    X(Opcode_eql, QuickenOperation(*ins, &Variable::Equals)) \
+    X(Opcode_neql, QuickenOperation(*ins, &Variable::NotEqual)) \
+    X(Opcode_less, QuickenOperation(*ins, &Variable::Less)) \
+    X(Opcode_greater, Operation(&Variable::Greater)) \
+    X(Opcode_less_eql, QuickenOperation(*ins, &Variable::LessOrEqual)) \
+    X(Opcode_greater_eql, Operation(&Variable::GreaterOrEqual)) \
+    X(Opcode_bit_and, Operation(&Variable::BitwiseAnd)) \
+    X(Opcode_bit_or, Operation(&Variable::BitwiseOr)) \
+    X(Opcode_bit_xor, Operation(&Variable::BitwiseXor)) \
+    X(Opcode_left_shift, Operation(&Variable::LeftShift)) \
+    X(Opcode_right_shift, Operation(&Variable::RightShift)) \
+    X(Opcode_assign, Assignment()) \
+    X(Opcode_add_assign, Assignment(&Variable::Add)) \
+    X(Opcode_sub_assign, Assignment(&Variable::Subtract)) \
+    X(Opcode_mul_assign, Assignment(&Variable::Multiply)) \
+    X(Opcode_div_assign, Assignment(&Variable::Divide)) \
+    X(Opcode_add_ii, IntegerOperation<std::plus<AVMInteger_t>>(*ins, &Variable::Add)) \
+    X(Opcode_sub_ii, IntegerOperation<std::minus<AVMInteger_t>>(*ins, &Variable::Subtract)) \
+    X(Opcode_mul_ii, IntegerOperation<std::multiplies<AVMInteger_t>>(*ins, &Variable::Multiply)) \
+    X(Opcode_mod_ii, IntegerOperation<std::modulus<AVMInteger_t>>(*ins, &Variable::Modulus)) \
+    X(Opcode_less_ii, IntegerOperation<std::less<AVMInteger_t>>(*ins, &Variable::Less)) \
+    X(Opcode_less_eql_ii, IntegerOperation<std::less_equal<AVMInteger_t>>(*ins, &Variable::LessOrEqual)) \
+    X(Opcode_eql_ii, IntegerOperation<std::equal_to<AVMInteger_t>>(*ins, &Variable::Equals)) \
+    X(Opcode_neql_ii, IntegerOperation<std::not_equal_to<AVMInteger_t>>(*ins, &Variable::NotEqual)) \
+    X(Opcode_add_ff, FloatOperation<std::plus<AVMFloat_t>>(*ins, &Variable::Add)) \
+    X(Opcode_sub_ff, FloatOperation<std::minus<AVMFloat_t>>(*ins, &Variable::Subtract)) \
+    X(Opcode_mul_ff, FloatOperation<std::multiplies<AVMFloat_t>>(*ins, &Variable::Multiply)) \
+    X(Opcode_div_ff, FloatOperation<std::divides<AVMFloat_t>>(*ins, &Variable::Divide)) \
+    X(Opcode_less_ff, FloatOperation<std::less<AVMFloat_t>>(*ins, &Variable::Less)) \
+    X(Opcode_less_eql_ff, FloatOperation<std::less_equal<AVMFloat_t>>(*ins, &Variable::LessOrEqual)) \
+    X(Opcode_concat_ss, Concatenate(*ins)) \
+    X(Opcode_load_member_cached, Handle_load_member_cached(*ins)) \
+    X(Opcode_inc_field, IncrementField(*ins, state->frames[state->frame_level - ins->field.frame_index_difference])) \
+    X(Opcode_inc_global, IncrementField(*ins, state->frames[AVM_LEVEL_GLOBAL])) \
+    X(Opcode_jump_if_not_less_field, JumpIfNotLessField(*ins, state->frames[state->frame_level - ins->field.frame_index_difference])) \
+    X(Opcode_jump_if_not_less_global, JumpIfNotLessField(*ins, state->frames[AVM_LEVEL_GLOBAL]))
+
+// The handlers must be the opcodes of AVM_OPCODES, no more and no fewer
+#define AVM_CHECK_LISTED(opcode, handler) \
+    static_assert(IsListedOpcode(opcode), #opcode " has a handler but is not in AVM_OPCODES");
+#define AVM_COUNT_OPCODE(opcode, ...) + 1
+
+AVM_OPCODE_HANDLERS(AVM_CHECK_LISTED)
+static_assert(0 AVM_OPCODE_HANDLERS(AVM_COUNT_OPCODE) == 0 AVM_OPCODES(AVM_COUNT_OPCODE),
+    "an opcode in AVM_OPCODES has no handler");
+
+#undef AVM_CHECK_LISTED
+#undef AVM_COUNT_OPCODE
+
+void VMInstance::Handle_ifl()
+{
+    OpenFrame();
+    DEBUG_LOG("Increase frame level to: %d. Read level is: %d", state->frame_level, state->read_level);
+}
+
+void VMInstance::Handle_dfl()
+{
+    bool should_suggest_gc = false;
+    if (state->read_level == state->frame_level) {
+        should_suggest_gc = true;
+        --state->read_level;
+        DEBUG_LOG("Decrease read level to: %d", state->read_level);
     }
-    case Opcode_drl:
-    {
-        if (state->read_level == state->frame_level) {
-            uint8_t count;
-            state->stream->Read(&count);
 
-            state->read_level -= count;
-            DEBUG_LOG("Decrease read level to: %d", state->read_level);
-        } else {
-            state->stream->Skip(sizeof(uint8_t));
-        }
+    CloseFrame();
+    DEBUG_LOG("Decrease frame level to: %d", state->frame_level);
 
-        break;
+    if (should_suggest_gc) {
+        // collect garbage to free variables from previous frame
+        SuggestGC();
     }
-    case Opcode_irl_if_true:
-    {
-        if (state->read_level == state->frame_level) {
-            Frame *frame = state->frames[state->frame_level];
+}
 
-            Variable *top = dynamic_cast<Variable*>(state->stack.back().Ref());
-            if (!top) {
-                state->HandleException(NullRefException());
-            }
+void VMInstance::Handle_irl()
+{
+    ++state->read_level;
+    DEBUG_LOG("Increase read level to: %d", state->read_level);
+}
 
-            bool result = false;
-            try {
-                result = (top ? top->Cast<bool>() : false);
-            } catch (const std::exception &ex) {
-                state->HandleException(Exception(ex.what()));
-            }
+void VMInstance::Handle_drl(const DecodedInstruction &ins)
+{
+    state->read_level -= ins.count;
+    DEBUG_LOG("Decrease read level to: %d", state->read_level);
+}
 
-            DEBUG_LOG("If result: %s", (result ? "true" : "false"));
+void VMInstance::Handle_irl_if_true()
+{
+    Frame *frame = state->frames[state->frame_level];
 
-            frame->last_cond = result;
+    bool result = IsTrue(state->stack.back());
 
-            if (result) {
-                ++state->read_level;
-                DEBUG_LOG("Increase read level to: %d", state->read_level);
-            }
-        }
+    DEBUG_LOG("If result: %s", (result ? "true" : "false"));
 
-        break;
-    }
-    case Opcode_irl_if_false:
-    {
-        if (state->read_level == state->frame_level) {
-            Frame *frame = state->frames[state->frame_level];
+    frame->last_cond = result;
 
-            Variable *top = dynamic_cast<Variable*>(state->stack.back().Ref());
-            if (!top) {
-                state->HandleException(NullRefException());
-            }
+    if (result) {
+        ++state->read_level;
+        DEBUG_LOG("Increase read level to: %d", state->read_level);
+    }
+}
 
-            bool result = false;
-            try {
-                result = (top ? top->Cast<bool>() : false);
-            } catch (const std::exception &ex) {
-                state->HandleException(Exception(ex.what()));
-            }
+void VMInstance::Handle_irl_if_false()
+{
+    Frame *frame = state->frames[state->frame_level];
 
-            DEBUG_LOG("If result: %s", (result ? "true" : "false"));
+    bool result = IsTrue(state->stack.back());
 
-            frame->last_cond = result;
+    DEBUG_LOG("If result: %s", (result ? "true" : "false"));
 
-            if (!result) {
-                ++state->read_level;
-                DEBUG_LOG("Increase read level to: %d", state->read_level);
-            }
-        }
+    frame->last_cond = result;
 
-        break;
+    if (!result) {
+        ++state->read_level;
+        DEBUG_LOG("Increase read level to: %d", state->read_level);
     }
-    case Opcode_try_catch_block:
-    {
-        if (state->read_level == state->frame_level) {
-            int old_frame_level = state->frame_level;
-            int old_read_level = state->read_level;
-
-            bool exception_occured = false;
-
-            ++state->read_level;
-            state->can_handle_exceptions = true;
-
-            do {
-                Opcode_t next_ins;
-                state->stream->Read(&next_ins);
-                state->vm->HandleInstruction(next_ins);
-
-                if (state->frames[state->frame_level]->exception_occured) {
-                    exception_occured = true;
-                    // exception will now be handled, so reset the flag
-                    state->frames[state->frame_level]->exception_occured = false;
-                    state->read_level = old_read_level;
-                }
-            } while (state->frame_level != old_frame_level);
-
-            state->can_handle_exceptions = false;
-
-            // next segment is the catch block, so if an error occured, we now handle it
-            if (exception_occured) {
-                ++state->read_level;
-                do {
-                    Opcode_t next_ins;
-                    state->stream->Read(&next_ins);
-                    state->vm->HandleInstruction(next_ins);
-                } while (state->frame_level != old_frame_level);
-            }
-        }
+}
 
-        break;
-    }
-    case Opcode_store_address:
-    {
-        struct {
-            uint32_t id;
-            uint64_t address;
-        } data;
-
-        state->stream->Read(&data.id);
-        state->stream->Read(&data.address);
-
-        state->block_positions[data.id] = data.address;
-
-        DEBUG_LOG("Create block: %d at position: %d", data.id, data.address);
-
-        break;
-    }
-    case Opcode_jump:
-    {
-        if (state->read_level == state->frame_level) {
-            uint32_t id;
-            state->stream->Read(&id);
-
-            auto position = state->block_positions[id];
-            DEBUG_LOG("Go to block: %u at position: %d", id, position);
+/** Called by the dispatch loop once the instruction that raised an exception has
+    finished. Calls made from within the try block are abandoned, along with the
+    values they left on the stack, and the frames of the try block are closed.
+    The catch block is read at the frame level that the try block began at.
+*/
+void VMInstance::UnwindException()
+{
+    const ExceptionHandler *handler = state->raised_handler;
+    size_t depth = state->raised_call_depth;
 
-            state->stream->Seek(position);
-        } else {
-            state->stream->Skip(sizeof(uint32_t));
+    if (state->calls.size() > depth) {
+        size_t stack_base = state->calls[depth].stack_base;
+        while (state->stack.size() > stack_base) {
+            PopStack();
         }
-
-        break;
+        state->calls.resize(depth);
     }
-    case Opcode_jump_if_true:
-    {
-        /*if (state->read_level == state->frame_level &&
-            state->frames[state->frame_level]->last_cond) {
-            uint32_t id;
-            state->stream->Read(&id);
 
-            auto position = state->block_positions[id];
-            DEBUG_LOG("Go to block: %u at position: %d", id, position);
-
-            state->stream->Seek(position);
-        } else {
-            state->stream->Skip(sizeof(uint32_t));
-        }*/
+    int base_level = state->calls.empty() ? AVM_LEVEL_GLOBAL : state->calls.back().read_level;
+    int frame_level = base_level + (int)handler->frame_depth;
+    while (state->frame_level > frame_level) {
+        CloseFrame();
+    }
 
-        if (state->read_level == state->frame_level) {
-            auto *frame = state->frames[state->frame_level];
+    DEBUG_LOG("Exception handled at instruction: %u", handler->handler);
 
-            Variable *top = dynamic_cast<Variable*>(state->stack.back().Ref());
-            if (!top) {
-                state->HandleException(NullRefException());
-            }
+    state->read_level = frame_level;
+    state->pc = handler->handler;
+    state->raised_handler = nullptr;
+    state->pc_limit = state->program->code.size();
+}
 
-            bool result = false;
-            try {
-                result = (top ? top->Cast<bool>() : false);
-            } catch (const std::exception &ex) {
-                state->HandleException(Exception(ex.what()));
-            }
+void VMInstance::Handle_jump(const DecodedInstruction &ins)
+{
+    DEBUG_LOG("Jump to instruction: %u", ins.target);
+#if AVM_JIT
+    bool is_backward = (ins.target < state->pc);
+#endif
+    state->pc = ins.target;
+#if AVM_JIT
+    if (is_backward) {
+        // loops are counted at the jump back to their condition
+        CountExecution(&ins - &state->program->code[0],
+            state->calls.empty() ? AVM_NO_FUNCTION : state->calls.back().function);
+    }
+#endif
+}
 
-            DEBUG_LOG("If result: %s", (result ? "true" : "false"));
+void VMInstance::Handle_jump_if_true(const DecodedInstruction &ins)
+{
+    auto *frame = state->frames[state->frame_level];
 
-            frame->last_cond = result;
+    bool result = IsTrue(state->stack.back());
 
-            if (result) {
-                uint32_t id;
-                state->stream->Read(&id);
+    DEBUG_LOG("If result: %s", (result ? "true" : "false"));
 
-                auto position = state->block_positions[id];
-                DEBUG_LOG("Go to block: %u at position: %d", id, position);
-                state->stream->Seek(position);
-            } else {
-                state->stream->Skip(sizeof(uint32_t));
-            }
-        } else {
-            state->stream->Skip(sizeof(uint32_t));
-        }
+    frame->last_cond = result;
+    PopStack();
 
-        break;
+    if (result) {
+        Handle_jump(ins);
     }
-    case Opcode_jump_if_false:
-    {
-        /*if (state->read_level == state->frame_level &&
-            !state->frames[state->frame_level]->last_cond) {
-            uint32_t id;
-            state->stream->Read(&id);
-
-            auto position = state->block_positions[id];
-            DEBUG_LOG("Go to block: %u at position: %d", id, position);
+}
 
-            state->stream->Seek(position);
-        } else {
-            state->stream->Skip(sizeof(uint32_t));
-        }*/
+void VMInstance::Handle_jump_if_false(const DecodedInstruction &ins)
+{
+    auto *frame = state->frames[state->frame_level];
 
-        if (state->read_level == state->frame_level) {
-            auto *frame = state->frames[state->frame_level];
+    bool result = IsTrue(state->stack.back());
 
-            Variable *top = dynamic_cast<Variable*>(state->stack.back().Ref());
-            if (!top) {
-                state->HandleException(NullRefException());
-            }
+    DEBUG_LOG("If result: %s", (result ? "true" : "false"));
 
-            bool result = false;
-            try {
-                result = (top ? top->Cast<bool>() : false);
-            } catch (const std::exception &ex) {
-                state->HandleException(Exception(ex.what()));
-            }
+    frame->last_cond = result;
+    PopStack();
 
-            DEBUG_LOG("If result: %s", (result ? "true" : "false"));
+    if (!result) {
+        Handle_jump(ins);
+    }
+}
 
-            frame->last_cond = result;
+void VMInstance::Handle_store_as_local(const DecodedInstruction &ins)
+{
+    const AVMString_t &str = *ins.string;
+    DEBUG_LOG("Storing top in local: %s", str.c_str());
+
+    auto frame = state->frames[state->frame_level];
+    Value top = state->stack.back(); state->stack.pop_back();
+
+    Reference ref;
+    if (!top.IsReference()) {
+        // inline values are given a variable of their own
+        ref = Reference(*state->heap.AllocObject<Variable>());
+        static_cast<Variable*>(ref.Ref())->AssignInline(top);
+    } else if (top.GetObject()->flags & Object::FLAG_TEMPORARY) {
+        ref = top.Ref().Ref()->Clone(state); // temp values like strings are copied
+        // after cloning the object, delete the old one
+        state->heap.DeleteObject(top.ptr);
+    } else {
+        ref = top.Ref(); // objects are copied as a reference
+    }
+
+    Heap::AddRef(ref.Ptr());
+    frame->locals.push_back({ str, ref });
+}
 
-            if (!result) {
-                uint32_t id;
-                state->stream->Read(&id);
+void VMInstance::Handle_new_native_object(const DecodedInstruction &ins)
+{
+    DEBUG_LOG("Create native class instance: %s", ins.string->c_str());
+    NewNativeObject(*ins.string);
+}
 
-                auto position = state->block_positions[id];
-                DEBUG_LOG("Go to block: %u at position: %d", id, position);
-                state->stream->Seek(position);
-            } else {
-                state->stream->Skip(sizeof(uint32_t));
-            }
-        } else {
-            state->stream->Skip(sizeof(uint32_t));
-        }
+void VMInstance::Handle_array_index()
+{
+    // indexing is rare for inline values, so they are boxed
+    auto right = state->stack.back().Box(state->heap); state->stack.pop_back();
+    auto left = state->stack.back().Box(state->heap); state->stack.pop_back();
 
-        break;
+    Variable *right_var = dynamic_cast<Variable*>(right.Ref());
+    if (!right_var) {
+        state->HandleException(TypeException(right.Ref()->TypeString()));
     }
-    case Opcode_store_as_local:
-    {
-        int32_t len;
-        state->stream->Read(&len);
-
-        if (state->read_level == state->frame_level) {
-            achar *str = new achar[len];
-            state->stream->Read(str, len * sizeof(achar));
-
-            DEBUG_LOG("Storing top in local: %s", str);
-
-            auto frame = state->frames[state->frame_level];
-            auto top = state->stack.back(); state->stack.pop_back();
-
-            Reference ref;
-            if (top.Ref()->flags & Object::FLAG_TEMPORARY) {
-                ref = top.Ref()->Clone(state); // temp values like ints or strings are copied
-                // after cloning the object, delete the old one
-                top.DeleteObject();
-            } else {
-                ref = top; // objects are copied as a reference
-                // inc ref count?
-            }
-
-            frame->locals.push_back({ str, ref });
 
-            delete[] str;
+    try {
+        Reference ref;
+        if (right_var->type == Variable::Type_int) {
+            left.Ref()->GetFieldReference(state, right_var->Cast<AVMInteger_t>(), ref);
+        } else if (right_var->type == Variable::Type_string) {
+            left.Ref()->GetFieldReference(state, right_var->Cast<AVMString_t>(), ref);
         } else {
-            state->stream->Skip(len);
+            throw "invalid index";
         }
+        PushReference(ref);
+    } catch (const std::exception &ex) {
+        state->HandleException(Exception(ex.what()));
+    }
 
-        break;
+    if (right.Ref()->flags & Object::FLAG_TEMPORARY) {
+        state->heap.DeleteObject(right.Ptr());
     }
-    case Opcode_new_native_object:
-    {
-        int32_t len;
-        state->stream->Read(&len);
 
-        if (state->read_level == state->frame_level) {
-            achar *str = new achar[len];
-            state->stream->Read(str, len * sizeof(achar));
+    if (left.Ref()->flags & Object::FLAG_TEMPORARY) {
+        state->heap.DeleteObject(left.Ptr());
+    }
+}
 
-            DEBUG_LOG("Create native class instance: %s", str);
-            NewNativeObject(str);
+void VMInstance::Handle_new_member(const DecodedInstruction &ins)
+{
+    DEBUG_LOG("Add member: %s", ins.string->c_str());
 
-            delete[] str;
-        } else {
-            state->stream->Skip(len);
-        }
+    // members are added to an object on the heap
+    state->stack.back() = state->stack.back().Box(state->heap);
 
-        break;
-    }
-    case Opcode_array_index:
+    auto object = state->stack.back().Ref();
+    auto ref = Reference(*state->heap.AllocObject<Variable>());
+    bool added;
     {
-        auto right = state->stack.back(); state->stack.pop_back();
-        auto left = state->stack.back(); state->stack.pop_back();
-
-        Variable *right_var = dynamic_cast<Variable*>(right.Ref());
-        if (!right_var) {
-            state->HandleException(TypeException(right.Ref()->TypeString()));
-        }
-
-        try {
-            Reference ref;
-            if (right_var->type == Variable::Type_int) {
-                left.Ref()->GetFieldReference(state, right_var->Cast<AVMInteger_t>(), ref);
-            } else if (right_var->type == Variable::Type_string) {
-                left.Ref()->GetFieldReference(state, right_var->Cast<AVMString_t>(), ref);
-            } else {
-                throw "invalid index";
-            }
-            PushReference(ref);
-        } catch (const std::exception &ex) {
-            state->HandleException(Exception(ex.what()));
-        }
+        Heap::MutationScope scope(state->heap);
+        added = object.Ref()->AddFieldReference(state, *ins.string, ref);
+    }
+    if (added) {
+        state->heap.WriteBarrier(object.Ptr());
+        PushReference(ref);
+    }
+}
 
-        if (right.Ref()->flags & Object::FLAG_TEMPORARY) {
-            right.DeleteObject();
+void VMInstance::Handle_load_member(DecodedInstruction &ins)
+{
+    DEBUG_LOG("Load member: %s", ins.string->c_str());
+
+    auto ref = state->stack.back().Box(state->heap); state->stack.pop_back();
+
+    Reference member;
+    if (ref.Ref()->GetFieldReference(state, *ins.string, member)) {
+#if AVM_QUICKENING
+        if (ins.deopt_count < AVM_QUICKEN_MAX_DEOPT) {
+            // objects built the same way share a shape, so the next object read here
+            // is likely to have it at the same index. The name is replaced by the
+            // shape's copy, which is checked by its address from then on
+            ins.feedback = ref.Ref()->FieldIndex(*ins.string);
+            ins.string = &ref.Ref()->FieldName(ins.feedback);
+            ins.opcode = Opcode_load_member_cached;
         }
+#endif
+        PushReference(member);
+    }
+}
 
-        if (left.Ref()->flags & Object::FLAG_TEMPORARY) {
-            left.DeleteObject();
-        }
+void VMInstance::Handle_load_member_cached(DecodedInstruction &ins)
+{
+    Object *object = state->stack.back().GetObject();
 
-        break;
+    Reference member;
+    if (object != nullptr && object->GetFieldReference(ins.feedback, ins.string, member)) {
+        state->stack.pop_back();
+        PushReference(member);
+    } else {
+        Deoptimize(ins);
+        Handle_load_member(ins);
     }
-    case Opcode_new_member:
-    {
-        int32_t len;
-        state->stream->Read(&len);
-
-        if (state->read_level == state->frame_level) {
-            achar *str = new achar[len];
-            state->stream->Read(str, len * sizeof(achar));
+}
 
-            DEBUG_LOG("Add member: %s", str);
+void VMInstance::Handle_new_structure()
+{
+    DEBUG_LOG("New structure");
 
-            auto object = state->stack.back();
-            auto ref = Reference(*state->heap.AllocObject<Variable>());
-            if (object.Ref()->AddFieldReference(state, str, ref)) {
-                PushReference(ref);
-            }
+    auto ref = Reference(*state->heap.AllocNull());
+    auto var = new Variable(); /// \todo: Make a unique structure class
+    var->type = Variable::Type_struct;
+    var->flags |= Object::FLAG_CONST;
+    var->flags |= Object::FLAG_TEMPORARY;
 
-            delete[] str;
-        } else {
-            state->stream->Skip(len);
-        }
+    ref.Ref() = var;
 
-        break;
-    }
-    case Opcode_load_member:
-    {
-        int32_t len;
-        state->stream->Read(&len);
+    PushReference(ref);
+}
 
-        if (state->read_level == state->frame_level) {
-            achar *str = new achar[len];
-            state->stream->Read(str, len * sizeof(achar));
+void VMInstance::Handle_new_function(const DecodedInstruction &ins)
+{
+    DEBUG_LOG("Pushing function to stack");
 
-            DEBUG_LOG("Load member: %s", str);
+    auto ref = Reference(*state->heap.AllocObject<Func>(ins.function.address,
+        ins.function.num_args, (bool)ins.is_variadic));
 
-            auto ref = state->stack.back(); state->stack.pop_back();
+    ref.Ref()->flags |= Object::FLAG_TEMPORARY;
+    PushReference(ref);
+}
 
-            Reference member;
-            if (ref.Ref()->GetFieldReference(state, str, member)) {
-                PushReference(member);
-            }
+void VMInstance::Handle_invoke_object(const DecodedInstruction &ins)
+{
+    DEBUG_LOG("Invoking");
 
-            delete[] str;
-        } else {
-            state->stream->Skip(len);
-        }
+    Reference reference = state->stack.back().Box(state->heap); state->stack.pop_back();
+    reference.Ref()->invoke(state, ins.count);
+    if (reference.Ref()->flags & Object::FLAG_TEMPORARY) {
+        state->heap.DeleteObject(reference.Ptr());
+    }
+}
 
-        break;
+/** The callee's body is read at the read level of the current call's body, so the
+    return instruction at its end returns to the current call's caller. Closing the
+    frames first means that a tail-recursive function runs in constant memory.
+*/
+void VMInstance::Handle_tail_invoke(const DecodedInstruction &ins)
+{
+    auto *func = dynamic_cast<Func*>(state->stack.back().GetObject());
+    if (func == nullptr || func->NumArgs() != (size_t)ins.count || state->calls.empty()) {
+        Handle_invoke_object(ins);
+        return;
     }
-    case Opcode_new_structure:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("New structure");
 
-            auto ref = Reference(*state->heap.AllocNull());
-            auto var = new Variable(); /// \todo: Make a unique structure class
-            var->type = Variable::Type_struct;
-            var->flags |= Object::FLAG_CONST;
-            var->flags |= Object::FLAG_TEMPORARY;
+    DEBUG_LOG("Tail invoking");
 
-            ref.Ref() = var;
+    CallFrame &call = state->calls.back();
+    size_t address = func->Address();
+    PopStack();
 
-            PushReference(ref);
+    // move the arguments down to where the current call's arguments began
+    size_t first_arg = state->stack.size() - ins.count;
+    if (first_arg > call.stack_base) {
+        for (size_t i = call.stack_base; i < first_arg; i++) {
+            Release(state->stack[i]);
         }
-        break;
+        state->stack.erase(state->stack.begin() + call.stack_base, state->stack.begin() + first_arg);
     }
-    case Opcode_new_function:
-    {
-        if (state->read_level == state->frame_level) {
-            struct {
-                uint32_t num_args;
-                uint8_t is_variadic;
-                uint32_t id;
-            } function_info;
 
-            state->stream->Read(&function_info.num_args);
-            state->stream->Read(&function_info.is_variadic);
-            state->stream->Read(&function_info.id);
+    while (state->frame_level > call.read_level) {
+        CloseFrame();
+    }
+    state->read_level = call.read_level + 1;
+    state->pc = address;
+    call.function = address;
+#if AVM_JIT
+    CountExecution(address, address);
+#endif
 
-            DEBUG_LOG("Pushing function to stack");
+    // the arguments are on the stack, so the closed frames' locals may be collected
+    SuggestGC();
+}
 
-            uint64_t pos = state->block_positions[function_info.id];
+void VMInstance::Handle_leave()
+{
+    DEBUG_LOG("Leave block");
 
-            auto ref = Reference(*state->heap.AllocObject<Func>(pos, 
-                function_info.num_args, (bool)function_info.is_variadic));
+    CloseFrame();
+    DEBUG_LOG("Decrease frame level to: %d", state->frame_level);
 
-            ref.Ref()->flags |= Object::FLAG_TEMPORARY;
-            PushReference(ref);
-        } else {
-            state->stream->Skip(sizeof(uint8_t));
-            state->stream->Skip(sizeof(uint32_t));
-            state->stream->Skip(sizeof(uint8_t));
-            state->stream->Skip(sizeof(uint32_t));
-        }
+    --state->read_level;
+    DEBUG_LOG("Decrease read level to: %d", state->read_level);
+}
 
-        break;
+/** The body of a function ends with "dfl, return", so the return instruction
+    is read at the read level of the caller. A return read at any other level
+    belongs to an enclosing call, or to no call at all.
+*/
+void VMInstance::Handle_return()
+{
+    if (state->calls.empty() || state->read_level != state->calls.back().read_level) {
+        return;
     }
-    case Opcode_invoke_object:
-        if (state->read_level == state->frame_level) {
-            uint32_t nargs;
-            state->stream->Read(&nargs);
 
-            DEBUG_LOG("Invoking");
+    const CallFrame &call = state->calls.back();
 
-            Reference reference = state->stack.back(); state->stack.pop_back();
-            reference.Ref()->invoke(state, nargs);
-            if (reference.Ref()->flags & Object::FLAG_TEMPORARY) {
-                reference.DeleteObject();
-            }
-        } else {
-            state->stream->Skip(sizeof(uint32_t));
+    // keep only the return value
+    if (state->stack.size() > call.stack_base + 1) {
+        Value result = state->stack.back();
+        state->stack.pop_back();
+        while (state->stack.size() > call.stack_base) {
+            PopStack();
         }
-
-        break;
-    case Opcode_return:
-    {
-        // handled in function class
-        break;
+        state->stack.push_back(result);
     }
-    case Opcode_leave:
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Leave block");
 
-            CloseFrame();
-            DEBUG_LOG("Decrease frame level to: %d", state->frame_level);
+    DEBUG_LOG("Popping back to instruction: %d", call.return_pc);
+    state->pc = call.return_pc;
+    state->calls.pop_back();
 
-            --state->read_level;
-            DEBUG_LOG("Decrease read level to: %d", state->read_level);
-        }
+#if AVM_JIT
+    // the caller may have been compiled while this call was interpreted
+    EnterCompiledCode();
+#endif
+}
 
-        break;
-    case Opcode_break:
-    {
-        if (state->read_level == state->frame_level) {
-            int32_t levels_to_skip;
-            state->stream->Read(&levels_to_skip);
+void VMInstance::Handle_break(const DecodedInstruction &ins)
+{
+    DEBUG_LOG("Loop break");
+    state->frames[state->frame_level - ins.count]->last_cond = false;
+    state->read_level -= ins.count;
+}
 
-            DEBUG_LOG("Loop break");
-            state->frames[state->frame_level - levels_to_skip]->last_cond = false;
-            state->read_level -= levels_to_skip;
-        } else {
-            state->stream->Skip(sizeof(int32_t));
-        }
+void VMInstance::Handle_continue(const DecodedInstruction &ins)
+{
+    DEBUG_LOG("Loop continue");
+    state->frames[state->frame_level - ins.count]->last_cond = true;
+    state->read_level -= ins.count;
+}
 
-        break;
-    }
-    case Opcode_continue:
-    {
-        if (state->read_level == state->frame_level) {
-            int32_t levels_to_skip;
-            state->stream->Read(&levels_to_skip);
+void VMInstance::Handle_print(const DecodedInstruction &ins)
+{
+    PrintObjects(ins.count);
+}
 
-            DEBUG_LOG("Loop continue");
-            state->frames[state->frame_level - levels_to_skip]->last_cond = true;
-            state->read_level -= levels_to_skip;
-        } else {
-            state->stream->Skip(sizeof(int32_t));
-        }
+void VMInstance::Handle_load_local(const DecodedInstruction &ins)
+{
+    const AVMString_t &str = *ins.string;
+    DEBUG_LOG("Loading variable: '%s'", str.c_str());
 
-        break;
-    }
-    case Opcode_print:
-    {
-        if (state->read_level == state->frame_level) {
-            uint32_t nargs;
-            state->stream->Read(&nargs);
-            PrintObjects(nargs);
-        } else {
-            state->stream->Skip(sizeof(uint32_t));
-        }
+    int start = state->frame_level;
+    bool found = false;
 
-        break;
-    }
-    case Opcode_load_local:
-    {
-        int32_t len;
-        state->stream->Read(&len);
+    while (start >= AVM_LEVEL_GLOBAL) {
+        Frame *frame = state->frames[start];
 
-        if (state->read_level == state->frame_level) {
-            achar *str = new achar[len];
-            state->stream->Read(str, len * sizeof(achar));
+        // Use pointer to pointer so that we have can change type
+        Reference ref;
+        if (frame->GetLocal(str, ref)) {
+            PushReference(ref);
+            found = true;
+            break;
+        }
 
-            DEBUG_LOG("Loading variable: '%s'", str);
+        --start;
+    }
 
-            int start = state->frame_level;
-            bool found = false;
+    if (!found) {
+        auto it = state->natives.find(str);
+        if (it != state->natives.end()) {
+            PushReference(it->second);
+            found = true;
+        }
+    }
 
-            while (start >= AVM_LEVEL_GLOBAL) {
-                Frame *frame = state->frames[start];
+    if (!found) {
+        throw std::runtime_error("could not find object");
+    }
+}
 
-                // Use pointer to pointer so that we have can change type
-                Reference ref;
-                if (frame->GetLocal(str, ref)) {
-                    PushReference(ref);
-                    found = true;
-                    break;
-                }
+void VMInstance::Handle_load_field(const DecodedInstruction &ins)
+{
+    int32_t frame_index = state->frame_level - ins.field.frame_index_difference;
 
-                --start;
-            }
+    DEBUG_LOG("Loading field #%d from frame #%d", ins.field.field_index, frame_index);
 
-            if (!found) {
-                throw std::runtime_error("could not find object");
-            }
+    Frame *frame = state->frames[frame_index];
+    PushReference(frame->locals[ins.field.field_index].second);
+}
 
-            delete[] str;
-        } else {
-            state->stream->Skip(len);
-        }
+void VMInstance::Handle_load_global(const DecodedInstruction &ins)
+{
+    DEBUG_LOG("Loading global field #%d", ins.field.field_index);
 
-        break;
-    }
-    case Opcode_load_field:
-    {
-        if (state->read_level == state->frame_level) {
-            struct {
-                int32_t frame_index_difference;
-                int32_t field_index;
-            } field_info;
+    Frame *frame = state->frames[AVM_LEVEL_GLOBAL];
+    PushReference(frame->locals[ins.field.field_index].second);
+}
 
-            state->stream->Read(&field_info.frame_index_difference);
-            state->stream->Read(&field_info.field_index);
+void VMInstance::Handle_load_integer(const DecodedInstruction &ins)
+{
+    DEBUG_LOG("Load integer: %d", ins.integer);
+    PushInt(ins.integer);
+}
 
-            int32_t frame_index = state->frame_level - field_info.frame_index_difference;
+void VMInstance::Handle_load_float(const DecodedInstruction &ins)
+{
+    DEBUG_LOG("Load float: %f", ins.number);
+    PushFloat(ins.number);
+}
 
-            DEBUG_LOG("Loading field #%d from frame #%d", field_info.field_index, frame_index);
+void VMInstance::Handle_load_string(const DecodedInstruction &ins)
+{
+    DEBUG_LOG("Load string: %s", ins.string->c_str());
+    PushString(*ins.string);
+}
 
-            Frame *frame = state->frames[frame_index];
-            PushReference(frame->locals[field_info.field_index].second);
+void VMInstance::Handle_load_null()
+{
+    DEBUG_LOG("Load null");
+    PushNull();
+}
 
-        } else {
-            state->stream->Skip(sizeof(int32_t));
-            state->stream->Skip(sizeof(int32_t));
-        }
+/** load_field (or global), intn, add_assign, pop.
+    The next three instructions hold the operands.
+*/
+void VMInstance::IncrementField(DecodedInstruction &ins, Frame *frame)
+{
+    Object *object = frame->locals[ins.field.field_index].second.Ref();
 
-        break;
+    Value value;
+    if (object != nullptr && !(object->flags & Object::FLAG_CONST) &&
+        object->ToInline(value) && value.type == Value::Type_int) {
+        static_cast<Variable*>(object)->AssignInline(Value(AVMInteger_t(value.int_value + (&ins)[1].integer)));
+        state->pc += 3;
+    } else {
+        // perform the instructions one at a time
+        PushReference(frame->locals[ins.field.field_index].second);
     }
-    case Opcode_load_integer:
-    {
-        if (state->read_level == state->frame_level) {
-            AVMInteger_t value;
-            state->stream->Read(&value);
+}
 
-            DEBUG_LOG("Load integer: %d", value);
-            PushInt(value);
+/** load_field (or global), intn, lt, jmpbf.
+    The next three instructions hold the operands.
+*/
+void VMInstance::JumpIfNotLessField(DecodedInstruction &ins, Frame *frame)
+{
+    Object *object = frame->locals[ins.field.field_index].second.Ref();
+
+    Value value;
+    if (object != nullptr && object->ToInline(value) && value.type == Value::Type_int) {
+        bool result = value.int_value < (&ins)[1].integer;
+        state->frames[state->frame_level]->last_cond = result;
+        if (result) {
+            state->pc += 3;
         } else {
-            state->stream->Skip(sizeof(AVMInteger_t));
+            Handle_jump((&ins)[3]);
         }
-
-        break;
+    } else {
+        // perform the instructions one at a time
+        PushReference(frame->locals[ins.field.field_index].second);
     }
-    case Opcode_load_float:
-    {
-        if (state->read_level == state->frame_level) {
-            AVMFloat_t value;
-            state->stream->Read(&value);
-
-            DEBUG_LOG("Load float: %f", value);
-            PushFloat(value);
-        } else {
-            state->stream->Skip(sizeof(AVMFloat_t));
-        }
+}
 
-        break;
+/** In the AVM, code is executed on the condition that the "read level" is
+    equal to the "frame level". The frame level is typically incremented where
+    the original source code would contain an open curly brace. That way, when an
+    "if" statement is encountered, the code inside the body is not executed unless
+    the read level is equal to the frame level. Thus, in this case, the read level
+    should only be incremented only if the conditions within the "if" statement
+    evaluate to true.
+*/
+void VMInstance::HandleInstruction(DecodedInstruction *ins)
+{
+    if (state->read_level != state->frame_level) {
+        SkipInstruction(ins);
+        return;
     }
-    case Opcode_load_string:
-    {
-        int32_t len;
-        state->stream->Read(&len);
-
-        if (state->read_level == state->frame_level) {
-            achar *str = new achar[len];
-            state->stream->Read(str, len * sizeof(achar));
 
-            DEBUG_LOG("Load string: %s", str);
-            PushString(AVMString_t(str));
+    switch (ins->opcode) {
+#define AVM_HANDLER_CASE(opcode, handler) \
+    case opcode: handler; break;
 
-            delete[] str;
-        } else {
-            state->stream->Skip(len);
-        }
+    AVM_OPCODE_HANDLERS(AVM_HANDLER_CASE)
 
+#undef AVM_HANDLER_CASE
+    default:
+        std::cout << "Unrecognized instruction '" << (int)ins->opcode << "' at index: " << (state->pc - 1) << "\n";
         break;
     }
-    case Opcode_load_null:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Load null");
-
-            auto ref = Reference(*state->heap.AllocObject<Variable>());
-            ref.Ref()->flags |= Object::FLAG_TEMPORARY;
-            PushReference(ref);
-        }
+}
 
+/** Called for instructions that are read while the read level is below
+    the frame level. Operands have already been decoded by the loader, so
+    only the instructions that keep track of frames need to be handled.
+*/
+void VMInstance::SkipInstruction(DecodedInstruction *ins)
+{
+    switch (ins->opcode) {
+    case Opcode_ifl:
+        Handle_ifl();
         break;
-    }
-    case Opcode_pop:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Pop stack");
-            PopStack();
-        }
-
+    case Opcode_dfl:
+        Handle_dfl();
         break;
-    }
-    case Opcode_unary_minus:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Unary -");
-            Operation(&Variable::Negate);
-        }
-
+    case Opcode_return:
+        Handle_return();
         break;
-    }
-    case Opcode_unary_not:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Unary !");
-            Operation(&Variable::LogicalNot);
-        }
-
+    default:
         break;
     }
-    case Opcode_add:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary +");
-            Operation(&Variable::Add);
-        }
+}
 
-        break;
+#if AVM_JIT
+/** Handlers of single instructions for compiled code, generated from the same list
+    as the interpreters. The levels are not compared, as native code is only run while
+    the read level is equal to the frame level.
+*/
+#define AVM_COMPILED_HANDLER(opcode, handler) \
+    template <> \
+    void VMInstance::HandleOpcode<opcode>(DecodedInstruction *ins) \
+    { \
+        handler; \
     }
-    case Opcode_sub:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary -");
-            Operation(&Variable::Subtract);
-        }
 
-        break;
-    }
-    case Opcode_mul:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary *");
-            Operation(&Variable::Multiply);
-        }
+AVM_OPCODE_HANDLERS(AVM_COMPILED_HANDLER)
 
-        break;
-    }
-    case Opcode_div:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary /");
-            Operation(&Variable::Divide);
-        }
+#undef AVM_COMPILED_HANDLER
 
-        break;
+template <Opcode_t opcode>
+void VMInstance::CompiledHandler(VMInstance *vm, DecodedInstruction *ins)
+{
+    try {
+        vm->HandleOpcode<opcode>(ins);
+    } catch (...) {
+        // native code has no unwind information, so the exception is rethrown
+        // once it has returned to the interpreter
+        vm->jit->Abort(std::current_exception());
     }
-    case Opcode_mod:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary %");
-            Operation(&Variable::Modulus);
-        }
+}
 
-        break;
-    }
-    case Opcode_pow:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary **");
-            Operation(&Variable::Power);
-        }
+void VMInstance::CompiledUnrecognized(VMInstance *vm, DecodedInstruction *ins)
+{
+    vm->HandleInstruction(ins);
+}
 
-        break;
-    }
-    case Opcode_and:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary &&");
-            Operation(&Variable::LogicalAnd);
-        }
+/** Called by native code whenever the pc is not at an instruction the code was
+    compiled to continue at, and by Jit::Run before entering native code.
+*/
+const uint8_t *VMInstance::ResumeCompiledCode(VMInstance *vm)
+{
+    VMState *state = vm->state;
+    std::vector<DecodedInstruction> &code = state->program->code;
 
-        break;
+    while (state->pc < state->pc_limit && state->read_level != state->frame_level) {
+        vm->SkipInstruction(&code[state->pc++]);
     }
-    case Opcode_or:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary ||");
-            Operation(&Variable::LogicalOr);
-        }
 
-        break;
+    if (state->pc >= state->pc_limit) {
+        return nullptr;
     }
-    case Opcode_eql:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary ==");
-            Operation(&Variable::Equals);
-        }
+    return vm->jit->EntryAt(state->pc);
+}
 
-        break;
-    }
-    case Opcode_neql:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary !=");
-            Operation(&Variable::NotEqual);
+Jit *VMInstance::CreateJit()
+{
+    static JitHandler_t handlers[256];
+    static bool changes_level[256];
+    static bool tables_initialized = false;
+    static std::mutex tables_lock;
+
+    // VMs on other threads may be filling the tables as well
+    std::lock_guard<std::mutex> guard(tables_lock);
+    if (!tables_initialized) {
+        for (size_t i = 0; i < 256; i++) {
+            handlers[i] = &VMInstance::CompiledUnrecognized;
+            changes_level[i] = false;
         }
 
-        break;
-    }
-    case Opcode_less:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary <");
-            Operation(&Variable::Less);
-        }
+#define AVM_COMPILED_ENTRY(opcode, handler) \
+        handlers[opcode] = &VMInstance::CompiledHandler<opcode>; \
+        changes_level[opcode] = ChangesLevel(opcode);
 
-        break;
-    }
-    case Opcode_greater:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary >");
-            Operation(&Variable::Greater);
-        }
+        AVM_OPCODE_HANDLERS(AVM_COMPILED_ENTRY)
 
-        break;
-    }
-    case Opcode_less_eql:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary <=");
-            Operation(&Variable::LessOrEqual);
-        }
+#undef AVM_COMPILED_ENTRY
 
-        break;
+        tables_initialized = true;
     }
-    case Opcode_greater_eql:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary >=");
-            Operation(&Variable::GreaterOrEqual);
-        }
 
-        break;
-    }
-    case Opcode_bit_and:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary &");
-            Operation(&Variable::BitwiseAnd);
-        }
+    return new Jit(this, state, handlers, changes_level, &VMInstance::ResumeCompiledCode);
+}
 
-        break;
+void VMInstance::CountExecution(size_t index, size_t function)
+{
+    if (jit == nullptr) {
+        return;
     }
-    case Opcode_bit_or:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary |");
-            Operation(&Variable::BitwiseOr);
-        }
 
-        break;
+    if (jit->Count(index)) {
+        DEBUG_LOG("Compile function at instruction #%u", (unsigned)function);
+        jit->Compile(function);
     }
-    case Opcode_bit_xor:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary &");
-            Operation(&Variable::BitwiseXor);
-        }
+    EnterCompiledCode();
+}
 
-        break;
+/** Compiled code calls the same handlers, but finds the code to continue at
+    by itself, so this only has an effect in the interpreter.
+*/
+void VMInstance::EnterCompiledCode()
+{
+    if (jit != nullptr && !jit->IsRunning() && jit->EntryAt(state->pc) != nullptr) {
+        // as with an exception, the dispatch loop stops after this instruction
+        state->pc_limit = 0;
     }
-    case Opcode_left_shift:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary <<");
-            Operation(&Variable::LeftShift);
-        }
+}
 
-        break;
-    }
-    case Opcode_right_shift:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary >>");
-            Operation(&Variable::RightShift);
-        }
+void VMInstance::RunCompiledCode()
+{
+    state->pc_limit = state->program->code.size();
+    jit->Run();
+}
+#endif
+
+#if AVM_THREADED_DISPATCH
+/** Threaded interpreter, using the "labels as values" extension.
+    Each handler jumps directly to the handler of the next instruction, so there
+    is no central switch for the branch predictor to miss on. Instead of comparing
+    the read level with the frame level on every instruction, two jump tables are
+    kept: one with the handlers, and one which only skips instructions. The table in
+    use is only re-selected after an instruction that may change either level.
+*/
+void VMInstance::Dispatch()
+{
+    static void *active_table[256];
+    static void *skip_table[256];
+    static std::atomic<bool> tables_initialized(false);
+    static std::mutex tables_lock;
+
+    // VMs on other threads may be filling the tables as well
+    if (!tables_initialized.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> guard(tables_lock);
+        if (!tables_initialized.load(std::memory_order_relaxed)) {
+            for (size_t i = 0; i < 256; i++) {
+                active_table[i] = &&unrecognized_instruction;
+                skip_table[i] = &&skip_instruction;
+            }
 
-        break;
-    }
-    case Opcode_assign:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary =");
-            Assignment();
-        }
+#define AVM_HANDLER_ENTRY(opcode, handler) \
+            active_table[opcode] = &&handle_##opcode;
 
-        break;
-    }
-    case Opcode_add_assign:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary +=");
-            Assignment(&Variable::Add);
-        }
+            AVM_OPCODE_HANDLERS(AVM_HANDLER_ENTRY)
 
-        break;
-    }
-    case Opcode_sub_assign:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary -=");
-            Assignment(&Variable::Subtract);
-        }
+#undef AVM_HANDLER_ENTRY
 
-        break;
-    }
-    case Opcode_mul_assign:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary *=");
-            Assignment(&Variable::Multiply);
+            tables_initialized.store(true, std::memory_order_release);
         }
-
-        break;
     }
-    case Opcode_div_assign:
-    {
-        if (state->read_level == state->frame_level) {
-            DEBUG_LOG("Binary /=");
-            Assignment(&Variable::Divide);
+
+    std::vector<DecodedInstruction> &code = state->program->code;
+    DecodedInstruction *ins = nullptr;
+    void **table = nullptr;
+
+#define AVM_SELECT_TABLE() \
+    table = (state->read_level == state->frame_level) ? active_table : skip_table
+
+#define AVM_DISPATCH() \
+    do { \
+        if (state->pc >= state->pc_limit) { \
+            goto end_of_code; \
+        } \
+        ins = &code[state->pc++]; \
+        goto *table[ins->opcode]; \
+    } while (0)
+
+    AVM_SELECT_TABLE();
+    AVM_DISPATCH();
+
+#define AVM_HANDLER_LABEL(opcode, handler) \
+    handle_##opcode: \
+        handler; \
+        if (std::integral_constant<bool, ChangesLevel(opcode)>::value) { \
+            AVM_SELECT_TABLE(); \
+        } \
+        AVM_DISPATCH();
+
+    AVM_OPCODE_HANDLERS(AVM_HANDLER_LABEL)
+
+#undef AVM_HANDLER_LABEL
+
+skip_instruction:
+    SkipInstruction(ins);
+    AVM_SELECT_TABLE();
+    AVM_DISPATCH();
+
+end_of_code:
+    if (state->raised_handler != nullptr) {
+        UnwindException();
+#if AVM_JIT
+    } else if (state->pc < code.size()) {
+        RunCompiledCode();
+#endif
+    } else {
+        return;
+    }
+    AVM_SELECT_TABLE();
+    AVM_DISPATCH();
+
+unrecognized_instruction:
+    HandleInstruction(ins);
+    AVM_DISPATCH();
+
+#undef AVM_DISPATCH
+#undef AVM_SELECT_TABLE
+}
+#else
+void VMInstance::Dispatch()
+{
+    std::vector<DecodedInstruction> &code = state->program->code;
+
+    while (true) {
+        while (state->pc < state->pc_limit) {
+            HandleInstruction(&code[state->pc++]);
         }
 
-        break;
-    }
-    default:
-    {
-        auto last_pos = (((unsigned long)state->stream->Position()) - sizeof(Opcode_t));
-        std::cout << "Unrecognized instruction '" << (int)opcode << "' at position: " << std::hex << last_pos << "\n";
-        break;
-    }
+        if (state->raised_handler != nullptr) {
+            UnwindException();
+#if AVM_JIT
+        } else if (state->pc < code.size()) {
+            RunCompiledCode();
+#endif
+        } else {
+            return;
+        }
     }
 }
+#endif
 
 void VMInstance::Execute(ByteStream *bs)
 {
-    state->stream = bs;
+    Program program;
+    if (!program.Load(bs)) {
+        std::cout << "Failed to load bytecode\n";
+        return;
+    }
+
+    state->program = &program;
+    state->pc = 0;
+    state->pc_limit = program.code.size();
+#if AVM_JIT
+    if (jit_enabled) {
+        jit = CreateJit();
+    }
+#endif
+    Dispatch();
+#if AVM_JIT
+    delete jit;
+    jit = nullptr;
+#endif
+    state->program = nullptr;
+}
 
-    while (state->stream->Position() < state->stream->Max()) {
-        Opcode_t ins;
-        state->stream->Read(&ins);
-        HandleInstruction(ins);
+void VMInstance::Execute(const CompiledProgram &compiled)
+{
+    Program program;
+    compiled.load(program);
+
+    state->program = &program;
+    state->pc = 0;
+    state->pc_limit = program.code.size();
+    while (true) {
+        compiled.run(this);
+        if (state->raised_handler == nullptr) {
+            break;
+        }
+        UnwindException();
     }
+    state->program = nullptr;
 }
-} // namespace avm
\ No newline at end of file
+} // namespace avm
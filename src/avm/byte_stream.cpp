@@ -8,7 +8,8 @@ namespace avm {
 ByteStream::ByteStream(char *buffer, size_t max)
     : buffer(buffer),
       pos(0),
-      max(max)
+      max(max),
+      overrun(false)
 {
     // read magic bytes
     char magic[ARES_MAGIC_LEN] = { '\0' };
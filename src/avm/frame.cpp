@@ -2,8 +2,7 @@
 
 namespace avm {
 Frame::Frame()
-    : last_cond(false),
-      exception_occured(false)
+    : last_cond(false)
 {
 }
 
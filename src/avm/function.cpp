@@ -21,26 +21,15 @@ void Func::invoke(VMState *state, uint32_t callargs)
         }
         state->HandleException(InvalidArgsException(nargs, callargs));
     } else {
-        state->jump_positions.push(state->stream->Position());
+        // the body is read by the dispatch loop that is already running,
+        // until its return instruction pops this call
+        state->calls.push_back(CallFrame { state->pc, state->read_level, state->stack.size() - callargs, addr });
         ++state->read_level;
 
-        state->stream->Seek(addr);
-
-        int origin_read_level = state->read_level;
-
-        // read instructions until function is completed
-        while (state->stream->Position() < state->stream->Max()) {
-            Opcode_t ins;
-            state->stream->Read(&ins);
-            state->vm->HandleInstruction(ins);
-
-            if (ins == Opcode_return && (origin_read_level - 1 == state->read_level)) {
-                state->stream->Seek(state->jump_positions.top());
-                state->jump_positions.pop();
-                DEBUG_LOG("Popping back to position: %d", state->stream->Position());
-                break;
-            }
-        }
+        state->pc = addr;
+#if AVM_JIT
+        state->vm->CountExecution(addr, addr);
+#endif
     }
 }
 
@@ -59,15 +48,27 @@ Reference Func::Clone(VMState *state)
     Reference ref(*state->heap.AllocObject<Func>(addr, nargs, is_variadic));
 
     // copy all members
-    for (auto &&member : fields) {
-        if (member.second.Ref() != nullptr) {
-            ref.Ref()->AddFieldReference(state, member.first, member.second.Ref()->Clone(state));
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i].Ref() != nullptr) {
+            ref.Ref()->AddFieldReference(state, FieldName(i), slots[i].Ref()->Clone(state));
         }
     }
 
     return ref;
 }
 
+Object *Func::Relocate(void *memory)
+{
+    Func *moved = new (memory) Func(addr, nargs, is_variadic);
+    MoveTo(moved);
+    return moved;
+}
+
+size_t Func::Size() const
+{
+    return sizeof(Func) + FieldsSize();
+}
+
 std::string Func::ToString() const
 {
     return "<" + TypeString() + ">";
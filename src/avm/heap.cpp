@@ -1,87 +1,759 @@
 #include <detail/heap.h>
 
+#include <new>
+#include <cstdlib>
+#ifdef _MSC_VER
+#include <malloc.h>
+#include <xmmintrin.h>
+#endif
+
 namespace avm {
+static constexpr size_t PowerOfTwoAtLeast(size_t n, size_t p = 1)
+{
+    return (p >= n) ? p : PowerOfTwoAtLeast(n, p * 2);
+}
+
+const size_t Heap::BLOCK_ALIGNMENT = PowerOfTwoAtLeast(sizeof(HandleBlock));
+
+#if AVM_GC_PARALLEL_SWEEP
+// Steps are only shared when each thread gets a few blocks, as waking a thread costs more than sweeping a block
+static const size_t PARALLEL_SWEEP_MIN_BLOCKS = 4;
+#endif
+
+static void *AllocAligned(size_t size, size_t alignment)
+{
+    void *ptr = nullptr;
+#ifdef _MSC_VER
+    ptr = _aligned_malloc(size, alignment);
+#else
+    if (posix_memalign(&ptr, alignment, size) != 0) {
+        ptr = nullptr;
+    }
+#endif
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+static inline void Prefetch(const void *ptr)
+{
+#ifdef _MSC_VER
+    _mm_prefetch(static_cast<const char*>(ptr), _MM_HINT_T0);
+#else
+    __builtin_prefetch(ptr);
+#endif
+}
+
+static void FreeAligned(void *ptr)
+{
+#ifdef _MSC_VER
+    _aligned_free(ptr);
+#else
+    std::free(ptr);
+#endif
+}
+
 Heap::Heap()
-    : head(nullptr),
-      num_objects(0)
+    : alloc_index(0),
+      num_measured(0),
+      grey_overflow(false),
+      phase(Phase_idle),
+      sweep_index(0),
+      sweep_end(0),
+      kept_empty(false),
+      concurrent(false),
+#if AVM_GC_CONCURRENT
+      marker_exit(false),
+#endif
+#if AVM_GC_PARALLEL_SWEEP
+      sweep_threads(1),
+      sweep_round(0),
+      sweep_pending(0),
+      sweep_next(0),
+      sweep_stop(0),
+      sweep_freed(0),
+      sweep_freed_bytes(0),
+      sweepers_exit(false),
+#endif
+      num_objects(0),
+      num_allocated(0),
+      num_bytes(0),
+      young_bytes(0)
 {
+    young.reserve(AVM_GC_NURSERY_SIZE);
 }
 
 Heap::~Heap()
 {
-    // clean up all objects
-    HeapObject *last = head;
-    while (last != nullptr) {
-        HeapObject *tmp = last;
-        last = last->before;
-        delete tmp;
+#if AVM_GC_CONCURRENT
+    if (marker.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            marker_exit = true;
+        }
+        wake.notify_one();
+        marker.join();
+    }
+#endif
+#if AVM_GC_PARALLEL_SWEEP
+    StopSweepers();
+#endif
+
+    for (HandleBlock *block : blocks) {
+        if (block != nullptr) {
+            // objects that are still held, such as the fields of globals
+            for (size_t i = 0; i < AVM_HEAP_BLOCK_SIZE; i++) {
+                Handle &handle = block->handles[i];
+                if (handle.next_free == &handle) {
+                    delete handle.obj;
+                }
+            }
+            FreeAligned(block);
+        }
     }
 }
 
 ObjectPtr *Heap::AllocNull()
 {
-    auto *ptr = new HeapObject();
-    ptr->id = num_objects++;
-    ptr->obj = nullptr;
-    if (head != nullptr) {
-        head->after = ptr;
-    }
-    ptr->before = head;
-    head = ptr;
-    return &ptr->obj;
-}
-
-void Heap::Sweep()
-{
-    HeapObject *last = head;
-    while (last != nullptr) {
-        if (last->obj != nullptr) {
-            if (!(last->obj->flags & Object::FLAG_MARKED)) {
-                delete last->obj;
-                last->obj = nullptr;
-                goto deleteholder;
-            } else {
-                last->obj->flags &= ~Object::FLAG_MARKED;
-                last = last->before;
-                continue;
-            }
+    if (alloc_index >= blocks.size() || blocks[alloc_index] == nullptr ||
+        blocks[alloc_index]->free_list == nullptr) {
+        FindFreeBlock();
+    }
+
+    HandleBlock *block = blocks[alloc_index];
+    Handle *handle = block->free_list;
+    block->free_list = handle->next_free;
+    ++block->num_used;
+
+    handle->obj = nullptr;
+    handle->next_free = handle;
+    handle->old = false;
+    handle->remembered = false;
+    handle->marked = false;
+    handle->zero_count = false;
+    handle->size = 0;
+    young.push_back(handle);
+    ++num_objects;
+    ++num_allocated;
+    return &handle->obj;
+}
+
+void Heap::FindFreeBlock()
+{
+    for (; alloc_index < blocks.size(); alloc_index++) {
+        if (blocks[alloc_index] != nullptr && blocks[alloc_index]->free_list != nullptr) {
+            return;
+        }
+    }
+
+    HandleBlock *block = static_cast<HandleBlock*>(AllocAligned(sizeof(HandleBlock), BLOCK_ALIGNMENT));
+    for (size_t i = 0; i < AVM_HEAP_BLOCK_SIZE; i++) {
+        block->handles[i].obj = nullptr;
+        block->handles[i].next_free = (i + 1 < AVM_HEAP_BLOCK_SIZE) ? &block->handles[i + 1] : nullptr;
+    }
+    block->free_list = &block->handles[0];
+    block->num_used = 0;
+
+    alloc_index = blocks.size();
+    blocks.push_back(block);
+}
+
+void Heap::FreeHandle(Handle *handle)
+{
+    delete handle->obj;
+    handle->obj = nullptr;
+
+    HandleBlock *block = BlockOf(handle);
+    handle->next_free = block->free_list;
+    block->free_list = handle;
+    --block->num_used;
+}
+
+void Heap::ReplaceObject(ObjectPtr *handle, ObjectPtr obj)
+{
+    Handle *ptr = reinterpret_cast<Handle*>(handle);
+#if AVM_GC_CONCURRENT
+    if (concurrent && ptr->old) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (ptr->obj != nullptr) {
+            // the fields may only have been reachable through this object
+            ptr->obj->GreyFields(*this);
+            wake.notify_one();
         }
+        SetObject(ptr, obj);
+        return;
+    }
+#endif
+    SetObject(ptr, obj);
+}
+
+void Heap::SetObject(Handle *handle, ObjectPtr obj)
+{
+#if AVM_GC_REFCOUNT
+    if (handle->obj != nullptr) {
+        handle->obj->ReleaseFields(*this);
+    }
+    if (obj != nullptr) {
+        // the references are to the handle, so the new object takes over the count
+        obj->refcount = (handle->obj != nullptr) ? handle->obj->refcount : Object::REFCOUNT_UNKNOWN;
+    }
+#endif
+    delete handle->obj;
+    handle->obj = obj;
+    Measure(handle);
+}
+
+Heap::MutationScope::MutationScope(Heap &heap)
+    : heap(heap),
+      locked(heap.concurrent)
+{
+#if AVM_GC_CONCURRENT
+    if (locked) {
+        heap.lock.lock();
+    }
+#endif
+}
+
+Heap::MutationScope::~MutationScope()
+{
+#if AVM_GC_CONCURRENT
+    if (locked) {
+        heap.lock.unlock();
+    }
+#endif
+}
 
-    deleteholder:
-        HeapObject *after = last->after;
-        if (after != nullptr) {
-            HeapObject *before = last->before;
-            before->after = after;
-            after->before = before;
-            delete last;
+void Heap::MarkRemembered()
+{
+    for (Handle *handle : remembered) {
+        if (handle->obj != nullptr) {
+            handle->obj->GreyFields(*this);
+        }
+    }
+}
+
+/** Only the handles allocated since the last collection are visited, so the cost
+    depends on the no. young handles rather than the size of the heap. Young handles
+    that were marked become old, and so every young handle that an old handle
+    referred to is now old as well, which empties the remembered set.
+*/
+void Heap::SweepYoung()
+{
+#if AVM_GC_REFCOUNT
+    ClearZeroCount();
+#endif
+    for (Handle *handle : young) {
+        if (handle->marked) {
+            // measured again, as fields may have been added since
+            Measure(handle);
+            handle->marked = false;
+            handle->old = true;
+        } else {
+            num_bytes -= handle->size;
+            FreeHandle(handle);
             --num_objects;
-            last = before;
-        } else if (after == nullptr) {
-            HeapObject *before = last->before;
-            before->after = nullptr;
-            delete last;
+        }
+    }
+    young.clear();
+    num_measured = 0;
+    young_bytes = 0;
+
+    for (Handle *handle : remembered) {
+        handle->remembered = false;
+    }
+    remembered.clear();
+
+    // allocate from the first block with a free handle
+    alloc_index = 0;
+}
+
+void Heap::BeginMark()
+{
+#if AVM_GC_REFCOUNT
+    ClearZeroCount();
+#endif
+    phase = Phase_mark;
+}
+
+bool Heap::MarkStep(size_t work)
+{
+    while (work != 0) {
+        if (grey.empty()) {
+            if (!grey_overflow) {
+                break;
+            }
+            RescanMarked();
+            continue;
+        }
+        work -= MarkGrey(work);
+    }
+    return grey.empty() && !grey_overflow;
+}
+
+/** Handles pass through a small queue on their way out of the grey list, and the
+    object of each is prefetched as it enters, so that it is in the cache by the
+    time its fields are marked. The list of fields of the handle at the front of the
+    queue is prefetched as well, one handle ahead. Handles left in the queue are put back.
+
+    The queue is only used while the grey list holds enough handles to fill it. Along
+    a chain, such as a linked list, there are only one or two grey handles at a time,
+    and each is needed as soon as it is listed, so prefetching them gains nothing and
+    they are marked directly instead.
+*/
+size_t Heap::MarkGrey(size_t work)
+{
+    size_t marked = 0;
+#if AVM_GC_PREFETCH_DISTANCE
+    Handle *queue[AVM_GC_PREFETCH_DISTANCE];
+    size_t head = 0;
+    size_t count = 0;
+
+    while (marked < work) {
+        if (count == 0 && grey.size() < AVM_GC_PREFETCH_DISTANCE) {
+            if (grey.empty()) {
+                break;
+            }
+            Handle *handle = grey.back();
+            grey.pop_back();
+            if (handle->obj != nullptr) {
+                handle->obj->GreyFields(*this);
+            }
+            ++marked;
+            continue;
+        }
+
+        while (count < AVM_GC_PREFETCH_DISTANCE && !grey.empty()) {
+            Handle *handle = grey.back();
+            grey.pop_back();
+            Prefetch(handle->obj);
+
+            size_t tail = head + count;
+            if (tail >= AVM_GC_PREFETCH_DISTANCE) {
+                tail -= AVM_GC_PREFETCH_DISTANCE;
+            }
+            queue[tail] = handle;
+            ++count;
+        }
+        if (count == 0) {
+            break;
+        }
+
+        Handle *handle = queue[head];
+        if (++head == AVM_GC_PREFETCH_DISTANCE) {
+            head = 0;
+        }
+        --count;
+        if (count != 0 && queue[head]->obj != nullptr) {
+            Prefetch(queue[head]->obj->FieldData());
+        }
+
+        if (handle->obj != nullptr) {
+            handle->obj->GreyFields(*this);
+        }
+        ++marked;
+    }
+
+    for (; count != 0; --count) {
+        grey.push_back(queue[head]);
+        if (++head == AVM_GC_PREFETCH_DISTANCE) {
+            head = 0;
+        }
+    }
+#else
+    while (!grey.empty() && marked < work) {
+        Handle *handle = grey.back();
+        grey.pop_back();
+        if (handle->obj != nullptr) {
+            handle->obj->GreyFields(*this);
+        }
+        ++marked;
+    }
+#endif
+    return marked;
+}
+
+/** Greying the fields of a handle that is already black only lists the fields that
+    were not marked, so each scan lists at least the handles that did not fit before.
+*/
+void Heap::RescanMarked()
+{
+    grey_overflow = false;
+    bool old = (phase != Phase_idle);
+    for (HandleBlock *block : blocks) {
+        if (block == nullptr) {
+            continue;
+        }
+
+        for (size_t i = 0; i < AVM_HEAP_BLOCK_SIZE; i++) {
+            Handle &handle = block->handles[i];
+            if (handle.next_free == &handle && handle.marked && handle.old == old && handle.obj != nullptr) {
+                handle.obj->GreyFields(*this);
+            }
+        }
+    }
+}
+
+#if AVM_GC_CONCURRENT
+void Heap::BeginConcurrentMark()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        concurrent = true;
+    }
+    if (!marker.joinable()) {
+        marker = std::thread(&Heap::MarkerLoop, this);
+    }
+    wake.notify_one();
+}
+
+bool Heap::FinishConcurrentMark()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (grey.empty() && grey_overflow) {
+        // the marking thread does not scan the heap, as it may be given new blocks
+        RescanMarked();
+        wake.notify_one();
+    }
+    if (!grey.empty() || grey_overflow) {
+        return false;
+    }
+    concurrent = false;
+    return true;
+}
+
+void Heap::AssistConcurrentMark(size_t work)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    MarkStep(work);
+}
+
+void Heap::StopConcurrentMark()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    concurrent = false;
+}
+
+/** Marks in batches of AVM_GC_MARKER_BATCH, releasing the lock between them so
+    that the main thread is not kept waiting, and sleeps while there is nothing grey.
+*/
+void Heap::MarkerLoop()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (!marker_exit) {
+        if (!concurrent || grey.empty()) {
+            wake.wait(guard);
+            continue;
+        }
+
+        MarkGrey(AVM_GC_MARKER_BATCH);
+
+        guard.unlock();
+        std::this_thread::yield();
+        guard.lock();
+    }
+}
+#endif
+
+void Heap::BeginSweep()
+{
+    phase = Phase_sweep;
+    sweep_index = 0;
+    sweep_end = blocks.size();
+    kept_empty = false;
+}
+
+/** Old handles that were not marked are freed, and their objects deleted. Young
+    handles were allocated during the collection, so they are left to the next
+    minor collection.
+*/
+size_t Heap::SweepBlock(HandleBlock *block, size_t &freed_bytes)
+{
+    size_t freed = 0;
+    for (size_t i = 0; i < AVM_HEAP_BLOCK_SIZE; i++) {
+        Handle &handle = block->handles[i];
+        if (handle.next_free != &handle || !handle.old) {
+            continue;
+        }
+
+        if (handle.marked) {
+            handle.marked = false;
+        } else {
+            freed_bytes += handle.size;
+            FreeHandle(&handle);
+            ++freed;
+        }
+    }
+    return freed;
+}
+
+/** A block that is left with no handles in use is released, except for one, so
+    that a program which allocates in cycles does not allocate a new block after
+    every collection. Blocks allocated during the collection hold young handles
+    only, so they are not swept.
+*/
+bool Heap::SweepStep(size_t work)
+{
+    // no. blocks each thread visits
+    size_t step = work / AVM_HEAP_BLOCK_SIZE + (work % AVM_HEAP_BLOCK_SIZE != 0);
+    size_t num_threads = 1;
+#if AVM_GC_PARALLEL_SWEEP
+    if (step >= PARALLEL_SWEEP_MIN_BLOCKS) {
+        num_threads = sweep_threads;
+    }
+#endif
+
+    size_t remaining = sweep_end - sweep_index;
+    size_t end = sweep_end;
+    if (remaining != 0 && step <= (remaining - 1) / num_threads) {
+        end = sweep_index + step * num_threads;
+    }
+
+    bool swept = false;
+#if AVM_GC_PARALLEL_SWEEP
+    if (num_threads > 1 && end - sweep_index >= 2 * PARALLEL_SWEEP_MIN_BLOCKS) {
+        SweepInParallel(end);
+        swept = true;
+    }
+#endif
+
+    for (; sweep_index < end; ++sweep_index) {
+        HandleBlock *block = blocks[sweep_index];
+        if (!swept) {
+            size_t freed_bytes = 0;
+            num_objects -= (uint32_t)SweepBlock(block, freed_bytes);
+            num_bytes -= freed_bytes;
+        }
+        if (block->num_used == 0) {
+            if (kept_empty) {
+                FreeAligned(block);
+                blocks[sweep_index] = nullptr;
+            }
+            kept_empty = true;
+        }
+        if (blocks[sweep_index] != nullptr && block->free_list != nullptr && sweep_index < alloc_index) {
+            alloc_index = sweep_index;
+        }
+    }
+
+    if (sweep_index < sweep_end) {
+        return false;
+    }
+
+    // remove the blocks that were released
+    size_t num_blocks = 0;
+    for (HandleBlock *block : blocks) {
+        if (block != nullptr) {
+            blocks[num_blocks++] = block;
+        }
+    }
+    blocks.resize(num_blocks);
+    alloc_index = 0;
+    phase = Phase_idle;
+    return true;
+}
+
+#if AVM_GC_PARALLEL_SWEEP
+void Heap::SetSweepThreads(size_t num_threads)
+{
+    if (num_threads == 0) {
+        num_threads = 1;
+    }
+    if (num_threads - 1 < sweepers.size()) {
+        StopSweepers();
+    }
+    sweep_threads = num_threads;
+}
+
+/** Objects are deleted by the thread that sweeps their block, and their memory is
+    freed into a batch of the thread's own. Free lists belong to a thread, so the
+    batches are added to those of the main thread once every thread has finished.
+*/
+void Heap::SweepInParallel(size_t end)
+{
+    while (sweepers.size() + 1 < sweep_threads) {
+        sweepers.push_back(std::thread(&Heap::SweeperLoop, this, sweep_round));
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(sweep_lock);
+        sweep_next = sweep_index;
+        sweep_stop = end;
+        sweep_freed = 0;
+        sweep_freed_bytes = 0;
+        sweep_pending = sweepers.size();
+        ++sweep_round;
+    }
+    sweep_wake.notify_all();
+
+    SlabAllocator::FreeBatch batch;
+    size_t freed_bytes = 0;
+    size_t freed = SweepClaimedBlocks(batch, freed_bytes);
+
+    std::unique_lock<std::mutex> guard(sweep_lock);
+    sweep_done.wait(guard, [this] { return sweep_pending == 0; });
+    SlabAllocator::ReleaseBatch(batch);
+    for (SlabAllocator::FreeBatch &sweeper_batch : sweep_batches) {
+        SlabAllocator::ReleaseBatch(sweeper_batch);
+    }
+    sweep_batches.clear();
+    num_objects -= (uint32_t)(freed + sweep_freed);
+    num_bytes -= freed_bytes + sweep_freed_bytes;
+}
+
+size_t Heap::SweepClaimedBlocks(SlabAllocator::FreeBatch &batch, size_t &freed_bytes)
+{
+    SlabAllocator::BeginBatch(&batch);
+    size_t freed = 0;
+    for (size_t i = sweep_next++; i < sweep_stop; i = sweep_next++) {
+        freed += SweepBlock(blocks[i], freed_bytes);
+    }
+    SlabAllocator::EndBatch();
+    return freed;
+}
+
+void Heap::SweeperLoop(size_t round)
+{
+    std::unique_lock<std::mutex> guard(sweep_lock);
+    while (true) {
+        sweep_wake.wait(guard, [this, round] { return sweepers_exit || sweep_round != round; });
+        if (sweepers_exit) {
+            return;
+        }
+        round = sweep_round;
+
+        guard.unlock();
+        SlabAllocator::FreeBatch batch;
+        size_t freed_bytes = 0;
+        size_t freed = SweepClaimedBlocks(batch, freed_bytes);
+        guard.lock();
+
+        sweep_batches.push_back(batch);
+        sweep_freed += freed;
+        sweep_freed_bytes += freed_bytes;
+        if (--sweep_pending == 0) {
+            sweep_done.notify_one();
+        }
+    }
+}
+
+void Heap::StopSweepers()
+{
+    {
+        std::lock_guard<std::mutex> guard(sweep_lock);
+        sweepers_exit = true;
+    }
+    sweep_wake.notify_all();
+    for (std::thread &sweeper : sweepers) {
+        sweeper.join();
+    }
+    sweepers.clear();
+    sweepers_exit = false;
+}
+#endif
+
+#if AVM_GC_COMPACT
+size_t Heap::Compact()
+{
+    SlabAllocator::BeginCompaction();
+    for (HandleBlock *block : blocks) {
+        for (size_t i = 0; i < AVM_HEAP_BLOCK_SIZE; i++) {
+            Handle &handle = block->handles[i];
+            if (handle.next_free == &handle && handle.obj != nullptr) {
+                SlabAllocator::CountObject(handle.obj);
+            }
+        }
+    }
+
+    if (SlabAllocator::SelectSparseSlabs(AVM_GC_COMPACT_THRESHOLD)) {
+        for (HandleBlock *block : blocks) {
+            for (size_t i = 0; i < AVM_HEAP_BLOCK_SIZE; i++) {
+                Handle &handle = block->handles[i];
+                if (handle.next_free == &handle && handle.obj != nullptr &&
+                    SlabAllocator::IsEvacuated(handle.obj)) {
+                    ObjectPtr obj = handle.obj;
+                    handle.obj = obj->Relocate(SlabAllocator::AllocateLike(obj));
+                    // the memory is released along with its slab
+                    obj->~Object();
+                }
+            }
+        }
+    }
+    return SlabAllocator::EndCompaction();
+}
+#endif
+
+#if AVM_GC_REFCOUNT
+/** Only the stack is not counted, so a handle with no count that the stack does not
+    refer to is unreachable. Deleting its object may drop the counts of its fields to
+    zero in turn. The handle is freed as well, unless it is young or remembered, in
+    which case it is listed, and is left to the next collection.
+*/
+void Heap::ReclaimZeroCount()
+{
+    while (!zero_count.empty()) {
+        Handle *handle = zero_count.back();
+        zero_count.pop_back();
+        handle->zero_count = false;
+
+        Object *obj = handle->obj;
+        if (obj == nullptr || obj->refcount != 0 || handle->marked) {
+            continue;
+        }
+
+        obj->ReleaseFields(*this);
+        if (handle->old && !handle->remembered) {
+            num_bytes -= handle->size;
+            FreeHandle(handle);
             --num_objects;
-            head = before; // head is now the object before it
-            last = head;
+        } else {
+            delete obj;
+            handle->obj = nullptr;
+            Measure(handle);
         }
     }
 }
 
-void Heap::DumpHeap(std::ostream &os) const
+void Heap::ClearZeroCount()
+{
+    for (Handle *handle : zero_count) {
+        handle->zero_count = false;
+    }
+    zero_count.clear();
+}
+#endif
+
+void Heap::MeasureYoung()
 {
-    HeapObject *temp_head = head;
-    while (temp_head != nullptr) {
-        os << "#" << temp_head->id
-           << "\t" << temp_head->obj;
+    for (; num_measured < young.size(); ++num_measured) {
+        Measure(young[num_measured]);
+    }
+}
 
-        if (temp_head->obj != nullptr) {
-            os << "\t" 
-               << temp_head->obj->flags 
-               << "\t" << temp_head->obj->ToString();
+void Heap::DumpHeap(std::ostream &os) const
+{
+    size_t index = 0;
+    for (const HandleBlock *block : blocks) {
+        if (block == nullptr) {
+            continue;
         }
-        os << "\n";
 
-        temp_head = temp_head->before;
+        for (size_t i = 0; i < AVM_HEAP_BLOCK_SIZE; i++, index++) {
+            const Handle &handle = block->handles[i];
+            if (handle.next_free != &handle) {
+                continue;
+            }
+
+            os << "#" << index
+               << "\t" << handle.obj;
+
+            if (handle.obj != nullptr) {
+                os << "\t"
+                   << handle.obj->flags
+                   << "\t" << handle.obj->ToString();
+            }
+            os << "\n";
+        }
     }
 }
 
@@ -89,4 +761,9 @@ uint32_t Heap::NumObjects() const
 {
     return num_objects;
 }
-} // namespace avm
\ No newline at end of file
+
+uint32_t Heap::NumYoung() const
+{
+    return (uint32_t)young.size();
+}
+} // namespace avm
@@ -0,0 +1,581 @@
+#include <detail/jit.h>
+
+#if AVM_JIT
+
+#include <detail/vm_state.h>
+#include <common/util/logger.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <map>
+#include <algorithm>
+#include <cstring>
+
+namespace avm {
+/** Appends x86-64 machine code to a buffer. Only the instruction forms used by
+    the templates are provided. While native code runs, rbx holds the VM instance,
+    r12 the VM state, and r13 the table of handlers. Jumps to instructions, to the
+    resume code and to the exit are patched once the whole function is emitted.
+*/
+class CodeBuffer {
+public:
+    enum Condition : uint8_t {
+        Condition_always = 0,
+        Condition_equal = 0x84,
+        Condition_not_equal = 0x85,
+        Condition_above_or_equal = 0x83,
+        Condition_below_or_equal = 0x86,
+    };
+
+    // Each condition is paired with its opposite, differing in the lowest bit
+    static Condition Invert(Condition condition)
+    {
+        return (Condition)(condition ^ 1);
+    }
+
+    void Bytes(std::initializer_list<uint8_t> bytes)
+    {
+        code.insert(code.end(), bytes);
+    }
+
+    void Int32(int32_t value)
+    {
+        uint8_t bytes[sizeof(value)];
+        std::memcpy(bytes, &value, sizeof(value));
+        code.insert(code.end(), bytes, bytes + sizeof(value));
+    }
+
+    void Int64(uint64_t value)
+    {
+        uint8_t bytes[sizeof(value)];
+        std::memcpy(bytes, &value, sizeof(value));
+        code.insert(code.end(), bytes, bytes + sizeof(value));
+    }
+
+    // mov qword [r12 + offset], value
+    void StoreState(int32_t offset, int32_t value)
+    {
+        Bytes({ 0x49, 0xC7, 0x84, 0x24 });
+        Int32(offset);
+        Int32(value);
+    }
+
+    // mov [r12 + offset], rax
+    void StoreState(int32_t offset)
+    {
+        Bytes({ 0x49, 0x89, 0x84, 0x24 });
+        Int32(offset);
+    }
+
+    // add dword [r12 + offset], 1
+    void IncrementStateInt(int32_t offset)
+    {
+        Bytes({ 0x41, 0x83, 0x84, 0x24 });
+        Int32(offset);
+        Bytes({ 0x01 });
+    }
+
+    // mov rax, [r12 + offset]
+    void LoadState(int32_t offset)
+    {
+        Bytes({ 0x49, 0x8B, 0x84, 0x24 });
+        Int32(offset);
+    }
+
+    // cmp rax, [r12 + offset]
+    void CompareState(int32_t offset)
+    {
+        Bytes({ 0x49, 0x3B, 0x84, 0x24 });
+        Int32(offset);
+    }
+
+    // cmp qword [r12 + offset], value
+    void CompareState(int32_t offset, int32_t value)
+    {
+        Bytes({ 0x49, 0x81, 0xBC, 0x24 });
+        Int32(offset);
+        Int32(value);
+    }
+
+    // mov ecx, [r12 + first]; cmp ecx, [r12 + second]
+    void CompareStateInts(int32_t first, int32_t second)
+    {
+        Bytes({ 0x41, 0x8B, 0x8C, 0x24 });
+        Int32(first);
+        Bytes({ 0x41, 0x3B, 0x8C, 0x24 });
+        Int32(second);
+    }
+
+    // cmp rax, value
+    void Compare(int32_t value)
+    {
+        Bytes({ 0x48, 0x3D });
+        Int32(value);
+    }
+
+    // mov rsi, ins; movzx eax, byte [rsi]; mov rdi, rbx; call [r13 + rax * 8]
+    void CallHandler(DecodedInstruction *ins)
+    {
+        Bytes({ 0x48, 0xBE });
+        Int64((uint64_t)ins);
+        Bytes({ 0x0F, 0xB6, 0x06 });
+        Bytes({ 0x48, 0x89, 0xDF });
+        Bytes({ 0x41, 0xFF, 0x54, 0xC5, 0x00 });
+    }
+
+    // Jumps with a 32-bit offset. Returns the position of the offset, to be patched
+    size_t Jump(Condition condition)
+    {
+        if (condition == Condition_always) {
+            Bytes({ 0xE9 });
+        } else {
+            Bytes({ 0x0F, condition });
+        }
+        Int32(0);
+        return code.size() - sizeof(int32_t);
+    }
+
+    void JumpTo(Condition condition, size_t index)
+    {
+        branches.push_back({ Jump(condition), index });
+    }
+
+    void JumpToResume(Condition condition)
+    {
+        resumes.push_back(Jump(condition));
+    }
+
+    void JumpToExit(Condition condition)
+    {
+        exits.push_back(Jump(condition));
+    }
+
+    // Patches the jump to continue at the end of the code
+    void PatchHere(size_t position)
+    {
+        Patch(position, code.size());
+    }
+
+    void Patch(size_t position, size_t target)
+    {
+        int32_t offset = (int32_t)(target - (position + sizeof(int32_t)));
+        std::memcpy(&code[position], &offset, sizeof(offset));
+    }
+
+    std::vector<uint8_t> code;
+    // (position of offset, index of instruction)
+    std::vector<std::pair<size_t, size_t>> branches;
+    std::vector<size_t> resumes;
+    std::vector<size_t> exits;
+};
+
+static int32_t FieldOffset(const void *object, const void *field)
+{
+    return (int32_t)((const char*)field - (const char*)object);
+}
+
+Jit::Jit(VMInstance *vm, VMState *state, const JitHandler_t *handlers,
+    const bool *changes_level, JitResume_t resume)
+    : vm(vm),
+      state(state),
+      handlers(handlers),
+      changes_level(changes_level),
+      resume(resume),
+      counters(state->program->code.size(), 0),
+      entries(state->program->code.size() + 1, nullptr),
+      enter(nullptr),
+      running(false),
+      unit_begin(0),
+      unit_end(0)
+{
+    static_assert(offsetof(DecodedInstruction, opcode) == 0, "templates read the opcode at offset 0");
+    static_assert(sizeof(Opcode_t) == 1, "templates read the opcode as a byte");
+
+    pc_offset = FieldOffset(state, &state->pc);
+    pc_limit_offset = FieldOffset(state, &state->pc_limit);
+    read_level_offset = FieldOffset(state, &state->read_level);
+    frame_level_offset = FieldOffset(state, &state->frame_level);
+
+    // the fast paths expect values to be laid out as declared
+    Value value;
+    use_fast_paths = sizeof(Value) == 16 && sizeof(AVMInteger_t) == 4 &&
+        FieldOffset(&value, &value.type) == 0 &&
+        FieldOffset(&value, &value.int_value) == 8;
+
+    stack_end_offset = FieldOffset(state, &state->stack.last);
+    stack_capacity_offset = FieldOffset(state, &state->stack.limit);
+
+    CodeBuffer buffer;
+    // push rbx; push r12; push r13, which also aligns the stack for calls
+    buffer.Bytes({ 0x53, 0x41, 0x54, 0x41, 0x55 });
+    // mov rbx, rdi; mov r12, rsi; mov r13, rdx
+    buffer.Bytes({ 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4, 0x49, 0x89, 0xD5 });
+    // jmp rcx
+    buffer.Bytes({ 0xFF, 0xE1 });
+
+    const uint8_t *code = MapCode(buffer.code);
+    if (code != nullptr) {
+        enter = reinterpret_cast<void(*)(VMInstance *, VMState *, const JitHandler_t *, const uint8_t *)>(
+            const_cast<uint8_t*>(code));
+    }
+}
+
+Jit::~Jit()
+{
+    for (auto &page : pages) {
+        munmap(page.first, page.second);
+    }
+}
+
+/** A function body is "ifl ... dfl, return", with the blocks inside it balanced */
+size_t Jit::FunctionEnd(size_t begin) const
+{
+    const std::vector<DecodedInstruction> &code = state->program->code;
+
+    int depth = 0;
+    for (size_t i = begin; i < code.size(); i++) {
+        if (code[i].opcode == Opcode_ifl) {
+            ++depth;
+        } else if (code[i].opcode == Opcode_dfl && --depth == 0 &&
+            i + 1 < code.size() && code[i + 1].opcode == Opcode_return) {
+            return i + 2;
+        }
+    }
+    return code.size();
+}
+
+bool Jit::InUnit(size_t index) const
+{
+    return index >= unit_begin && index < unit_end && unit_included[index - unit_begin];
+}
+
+void Jit::Compile(size_t function)
+{
+    std::vector<DecodedInstruction> &code = state->program->code;
+
+    size_t begin = (function == AVM_NO_FUNCTION) ? 0 : function;
+    size_t end = (function == AVM_NO_FUNCTION) ? code.size() : FunctionEnd(function);
+    if (enter == nullptr || begin >= code.size() || entries[begin] != nullptr) {
+        return;
+    }
+
+    // leave out the bodies of functions declared within this one
+    unit_begin = begin;
+    unit_end = end;
+    unit_included.assign(end - begin, false);
+    std::map<size_t, size_t> nested;
+    for (size_t i = begin; i < end;) {
+        auto it = nested.find(i);
+        if (it != nested.end()) {
+            i = it->second;
+            continue;
+        }
+
+        unit_included[i - begin] = true;
+        size_t address = code[i].function.address;
+        if (code[i].opcode == Opcode_new_function && address > i && address < end) {
+            nested[address] = std::min(FunctionEnd(address), end);
+        }
+        i++;
+    }
+
+    CodeBuffer buffer;
+    std::vector<size_t> offsets(end - begin, 0);
+    for (size_t i = begin; i < end; i++) {
+        if (InUnit(i)) {
+            offsets[i - begin] = buffer.code.size();
+            EmitInstruction(buffer, i);
+        }
+    }
+
+    // find the code to continue at, which may be in another function
+    size_t resume_offset = buffer.code.size();
+    // mov rdi, rbx; mov rax, resume; call rax; test rax, rax
+    buffer.Bytes({ 0x48, 0x89, 0xDF, 0x48, 0xB8 });
+    buffer.Int64((uint64_t)resume);
+    buffer.Bytes({ 0xFF, 0xD0, 0x48, 0x85, 0xC0 });
+    buffer.JumpToExit(CodeBuffer::Condition_equal);
+    // jmp rax
+    buffer.Bytes({ 0xFF, 0xE0 });
+
+    // return to the interpreter: pop r13; pop r12; pop rbx; ret
+    size_t exit_offset = buffer.code.size();
+    buffer.Bytes({ 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 });
+
+    for (auto &branch : buffer.branches) {
+        buffer.Patch(branch.first, offsets[branch.second - begin]);
+    }
+    for (size_t position : buffer.resumes) {
+        buffer.Patch(position, resume_offset);
+    }
+    for (size_t position : buffer.exits) {
+        buffer.Patch(position, exit_offset);
+    }
+
+    const uint8_t *native = MapCode(buffer.code);
+    if (native == nullptr) {
+        return;
+    }
+
+    for (size_t i = begin; i < end; i++) {
+        if (InUnit(i) && entries[i] == nullptr) {
+            entries[i] = native + offsets[i - begin];
+        }
+    }
+
+    DEBUG_LOG("Compiled instructions #%u to #%u (%u bytes)", (unsigned)begin, (unsigned)end,
+        (unsigned)buffer.code.size());
+}
+
+void Jit::EmitInstruction(CodeBuffer &buffer, size_t index)
+{
+    std::vector<DecodedInstruction> &code = state->program->code;
+    DecodedInstruction &ins = code[index];
+
+    if (ins.opcode == Opcode_jump) {
+        EmitContinue(buffer, ins.target);
+        return;
+    }
+
+    if (ins.opcode == Opcode_irl && InUnit(index + 1) && code[index + 1].opcode == Opcode_ifl) {
+        // "irl, ifl" begins every block. The levels differ between the two, but ifl is
+        // performed the same way when it is skipped, so they are not compared
+        buffer.IncrementStateInt(read_level_offset);
+        return;
+    }
+
+    std::vector<size_t> slow_paths = EmitFastPath(buffer, index);
+    for (size_t position : slow_paths) {
+        buffer.PatchHere(position);
+    }
+
+    EmitHandlerCall(buffer, index);
+}
+
+/** Values on the stack are 16 bytes, with the type in the first byte and
+    the integer at offset 8. rax is loaded with the end of the stack.
+*/
+std::vector<size_t> Jit::EmitFastPath(CodeBuffer &buffer, size_t index)
+{
+    DecodedInstruction &ins = state->program->code[index];
+    std::vector<size_t> slow_paths;
+    if (!use_fast_paths) {
+        return slow_paths;
+    }
+
+    switch (GenericOpcode(ins.opcode)) {
+    case Opcode_load_integer:
+    case Opcode_load_null:
+        buffer.LoadState(stack_end_offset);
+        buffer.CompareState(stack_capacity_offset);
+        slow_paths.push_back(buffer.Jump(CodeBuffer::Condition_equal));
+        if (ins.opcode == Opcode_load_integer) {
+            // mov byte [rax], Type_int; mov dword [rax + 8], value
+            buffer.Bytes({ 0xC6, 0x00, Value::Type_int });
+            buffer.Bytes({ 0xC7, 0x40, 0x08 });
+            buffer.Int32(ins.integer);
+        } else {
+            // mov byte [rax], Type_null; mov qword [rax + 8], 0
+            buffer.Bytes({ 0xC6, 0x00, Value::Type_null });
+            buffer.Bytes({ 0x48, 0xC7, 0x40, 0x08 });
+            buffer.Int32(0);
+        }
+        // add rax, 16
+        buffer.Bytes({ 0x48, 0x83, 0xC0, 0x10 });
+        buffer.StoreState(stack_end_offset);
+        break;
+    case Opcode_pop:
+        buffer.LoadState(stack_end_offset);
+        // cmp byte [rax - 16], Type_reference
+        buffer.Bytes({ 0x80, 0x78, 0xF0, Value::Type_reference });
+        slow_paths.push_back(buffer.Jump(CodeBuffer::Condition_equal));
+        // sub rax, 16
+        buffer.Bytes({ 0x48, 0x83, 0xE8, 0x10 });
+        buffer.StoreState(stack_end_offset);
+        break;
+    case Opcode_jump_if_true:
+    case Opcode_jump_if_false:
+    {
+        buffer.LoadState(stack_end_offset);
+        // cmp byte [rax - 16], Type_int
+        buffer.Bytes({ 0x80, 0x78, 0xF0, Value::Type_int });
+        slow_paths.push_back(buffer.Jump(CodeBuffer::Condition_not_equal));
+        // mov ecx, [rax - 8]; sub rax, 16
+        buffer.Bytes({ 0x8B, 0x48, 0xF8, 0x48, 0x83, 0xE8, 0x10 });
+        buffer.StoreState(stack_end_offset);
+        // test ecx, ecx. The frame's last condition is not set, as it is never read
+        buffer.Bytes({ 0x85, 0xC9 });
+        CodeBuffer::Condition taken = (ins.opcode == Opcode_jump_if_true)
+            ? CodeBuffer::Condition_not_equal : CodeBuffer::Condition_equal;
+        if (InUnit(ins.target)) {
+            buffer.JumpTo(taken, ins.target);
+        } else {
+            size_t not_taken = buffer.Jump(CodeBuffer::Invert(taken));
+            EmitContinue(buffer, ins.target);
+            buffer.PatchHere(not_taken);
+        }
+        break;
+    }
+    case Opcode_add:
+    case Opcode_sub:
+    case Opcode_mul:
+    case Opcode_less:
+    case Opcode_less_eql:
+    case Opcode_eql:
+    case Opcode_neql:
+        buffer.LoadState(stack_end_offset);
+        // cmp byte [rax - 32], Type_int; cmp byte [rax - 16], Type_int
+        buffer.Bytes({ 0x80, 0x78, 0xE0, Value::Type_int });
+        slow_paths.push_back(buffer.Jump(CodeBuffer::Condition_not_equal));
+        buffer.Bytes({ 0x80, 0x78, 0xF0, Value::Type_int });
+        slow_paths.push_back(buffer.Jump(CodeBuffer::Condition_not_equal));
+        // mov ecx, [rax - 24]
+        buffer.Bytes({ 0x8B, 0x48, 0xE8 });
+        switch (GenericOpcode(ins.opcode)) {
+        case Opcode_add:
+            // add ecx, [rax - 8]
+            buffer.Bytes({ 0x03, 0x48, 0xF8 });
+            break;
+        case Opcode_sub:
+            // sub ecx, [rax - 8]
+            buffer.Bytes({ 0x2B, 0x48, 0xF8 });
+            break;
+        case Opcode_mul:
+            // imul ecx, [rax - 8]
+            buffer.Bytes({ 0x0F, 0xAF, 0x48, 0xF8 });
+            break;
+        default:
+        {
+            // cmp ecx, [rax - 8]; setcc cl; movzx ecx, cl
+            uint8_t setcc = 0;
+            switch (GenericOpcode(ins.opcode)) {
+            case Opcode_less: setcc = 0x9C; break;
+            case Opcode_less_eql: setcc = 0x9E; break;
+            case Opcode_eql: setcc = 0x94; break;
+            default: setcc = 0x95; break;
+            }
+            buffer.Bytes({ 0x3B, 0x48, 0xF8, 0x0F, setcc, 0xC1, 0x0F, 0xB6, 0xC9 });
+            break;
+        }
+        }
+        // mov [rax - 24], ecx; sub rax, 16
+        buffer.Bytes({ 0x89, 0x48, 0xE8, 0x48, 0x83, 0xE8, 0x10 });
+        buffer.StoreState(stack_end_offset);
+        break;
+    default:
+        return slow_paths;
+    }
+
+    EmitContinue(buffer, index + 1);
+    return slow_paths;
+}
+
+void Jit::EmitHandlerCall(CodeBuffer &buffer, size_t index)
+{
+    std::vector<DecodedInstruction> &code = state->program->code;
+    DecodedInstruction &ins = code[index];
+
+    buffer.StoreState(pc_offset, (int32_t)(index + 1));
+    buffer.CallHandler(&ins);
+
+    // instructions that the pc may be moved to, other than by an exception
+    std::vector<size_t> next;
+    switch (ins.opcode) {
+    case Opcode_jump_if_true:
+    case Opcode_jump_if_false:
+        next = { index + 1, ins.target };
+        break;
+    case Opcode_inc_field:
+    case Opcode_inc_global:
+        next = { index + 4, index + 1 };
+        break;
+    case Opcode_jump_if_not_less_field:
+    case Opcode_jump_if_not_less_global:
+        next = { index + 4, code[index + 3].target, index + 1 };
+        break;
+    default:
+        if (!changes_level[ins.opcode]) {
+            // the pc limit is only lowered by an exception
+            buffer.CompareState(pc_limit_offset, (int32_t)(index + 1));
+            buffer.JumpToExit(CodeBuffer::Condition_below_or_equal);
+            if (!InUnit(index + 1)) {
+                buffer.JumpToResume(CodeBuffer::Condition_always);
+            }
+            return;
+        }
+        next = { index + 1 };
+        break;
+    }
+
+    buffer.LoadState(pc_offset);
+    buffer.CompareState(pc_limit_offset);
+    buffer.JumpToExit(CodeBuffer::Condition_above_or_equal);
+    if (changes_level[ins.opcode]) {
+        buffer.CompareStateInts(read_level_offset, frame_level_offset);
+        buffer.JumpToResume(CodeBuffer::Condition_not_equal);
+    }
+    for (size_t target : next) {
+        if (InUnit(target)) {
+            buffer.Compare((int32_t)target);
+            buffer.JumpTo(CodeBuffer::Condition_equal, target);
+        }
+    }
+    buffer.JumpToResume(CodeBuffer::Condition_always);
+}
+
+void Jit::EmitContinue(CodeBuffer &buffer, size_t index)
+{
+    if (InUnit(index)) {
+        buffer.JumpTo(CodeBuffer::Condition_always, index);
+    } else {
+        buffer.StoreState(pc_offset, (int32_t)index);
+        buffer.JumpToResume(CodeBuffer::Condition_always);
+    }
+}
+
+void Jit::Run()
+{
+    running = true;
+    const uint8_t *entry = resume(vm);
+    if (entry != nullptr) {
+        enter(vm, state, handlers, entry);
+    }
+    running = false;
+
+    if (pending) {
+        std::exception_ptr ex = pending;
+        pending = nullptr;
+        std::rethrow_exception(ex);
+    }
+}
+
+void Jit::Abort(std::exception_ptr ex)
+{
+    pending = ex;
+    state->pc_limit = 0;
+}
+
+/** The pages are written first, then made executable, so they are never both */
+const uint8_t *Jit::MapCode(const std::vector<uint8_t> &code)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (code.size() + page_size - 1) / page_size * page_size;
+
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+
+    std::memcpy(memory, &code[0], code.size());
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return nullptr;
+    }
+
+    pages.push_back({ memory, size });
+    return (const uint8_t*)memory;
+}
+} // namespace avm
+
+#endif
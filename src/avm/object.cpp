@@ -7,28 +7,22 @@
 namespace avm {
 bool Object::AddFieldReference(VMState *state, const AVMString_t &name, Reference ref)
 {
-    auto it = std::find_if(fields.begin(), fields.end(),
-        [&](const std::pair<AVMString_t, Reference> &it)
-    {
-        return it.first == name;
-    });
-    if (it != fields.end()) {
+    Shape *added = (shape != nullptr ? shape : Shape::Empty())->AddMember(name);
+    if (added == nullptr) {
         throw std::runtime_error("Member already exists");
         return false;
     }
-    fields.push_back(std::make_pair(name, ref));
+    shape = added;
+    slots.push_back(ref);
+    Heap::AddRef(ref.Ptr());
     return true;
 }
 
 bool Object::GetFieldReference(VMState *state, const AVMString_t &name, Reference &out)
 {
-    auto it = std::find_if(fields.begin(), fields.end(),
-        [&](const std::pair<AVMString_t, Reference> &it)
-    {
-        return it.first == name;
-    });
-    if (it != fields.end()) {
-        out = it->second;
+    int index = FieldIndex(name);
+    if (index != -1) {
+        out = slots[index];
         return true;
     } else {
         state->HandleException(MemberNotFoundException(name));
@@ -38,26 +32,42 @@ bool Object::GetFieldReference(VMState *state, const AVMString_t &name, Referenc
 
 bool Object::GetFieldReference(VMState *state, size_t index, Reference &out)
 {
-    if (index < fields.size()) {
-        out = fields[index].second;
+    if (index < slots.size()) {
+        out = slots[index];
         return true;
     } else {
         return false;
     }
 }
 
-void Object::Mark()
+int Object::FieldIndex(const AVMString_t &name) const
 {
-    if (!(flags & FLAG_MARKED)) {
-        flags |= FLAG_MARKED;
-        MarkFields();
+    return shape != nullptr ? shape->Find(name) : -1;
+}
+
+void Object::MoveTo(Object *moved)
+{
+    moved->flags = flags;
+    moved->refcount = refcount;
+    moved->shape = shape;
+    moved->slots.swap(slots);
+}
+
+/** Fields are greyed last to first, so that the first is marked first. In a linked
+    structure whose link is the last field, the other fields are then marked before
+    the next node, rather than being left in the grey list until the end.
+*/
+void Object::GreyFields(Heap &heap)
+{
+    for (auto it = slots.rbegin(); it != slots.rend(); ++it) {
+        heap.Grey(it->Ptr());
     }
 }
 
-void Object::MarkFields()
+void Object::ReleaseFields(Heap &heap)
 {
-    for (auto &&member : fields) {
-        member.second.Ref()->Mark();
+    for (auto &&slot : slots) {
+        heap.RemoveRef(slot.Ptr());
     }
 }
 } // namespace avm
\ No newline at end of file
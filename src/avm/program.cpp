@@ -0,0 +1,321 @@
+#include <detail/program.h>
+
+#include <iostream>
+#include <utility>
+
+namespace avm {
+Program::Program()
+{
+}
+
+bool Program::Load(ByteStream *stream)
+{
+    static const uint32_t NO_INSTRUCTION = (uint32_t)-1;
+
+    // index of the instruction that begins at each byte position
+    std::vector<uint32_t> index_at(stream->Max() + 1, NO_INSTRUCTION);
+    // instructions whose target is a byte position, resolved once all are decoded
+    std::vector<std::pair<size_t, size_t>> branches;
+
+    if (!LoadConstants(stream) || !LoadExceptionTable(stream)) {
+        return false;
+    }
+
+    // positions in the exception table are relative to the first instruction
+    size_t code_start = stream->Position();
+
+    while (!stream->Eof()) {
+        index_at[stream->Position()] = code.size();
+
+        DecodedInstruction ins = DecodedInstruction();
+        stream->Read(&ins.opcode);
+
+        switch (ins.opcode) {
+        case Opcode_drl:
+        {
+            uint8_t count;
+            stream->Read(&count);
+            ins.count = count;
+            break;
+        }
+        case Opcode_jump:
+        case Opcode_jump_if_true:
+        case Opcode_jump_if_false:
+        {
+            int32_t offset;
+            stream->Read(&offset);
+            branches.push_back({ code.size(), stream->Position() + offset });
+            break;
+        }
+        case Opcode_new_function:
+        {
+            int32_t offset;
+            stream->Read(&ins.function.num_args);
+            stream->Read(&ins.is_variadic);
+            stream->Read(&offset);
+            branches.push_back({ code.size(), stream->Position() + offset });
+            break;
+        }
+        case Opcode_invoke_object:
+        case Opcode_tail_invoke:
+        case Opcode_print:
+        {
+            uint32_t count;
+            stream->Read(&count);
+            ins.count = count;
+            break;
+        }
+        case Opcode_break:
+        case Opcode_continue:
+            stream->Read(&ins.count);
+            break;
+        case Opcode_load_field:
+            stream->Read(&ins.field.frame_index_difference);
+            stream->Read(&ins.field.field_index);
+            break;
+        case Opcode_load_global:
+            stream->Read(&ins.field.field_index);
+            break;
+        case Opcode_load_integer:
+            stream->Read(&ins.integer);
+            break;
+        case Opcode_load_float:
+        {
+            uint32_t index;
+            stream->Read(&index);
+            if (index >= floats.size()) {
+                std::cout << "Invalid float index: " << index << "\n";
+                return false;
+            }
+            ins.number = floats[index];
+            break;
+        }
+        case Opcode_store_as_local:
+        case Opcode_new_native_object:
+        case Opcode_new_member:
+        case Opcode_load_member:
+        case Opcode_load_local:
+        case Opcode_load_string:
+        {
+            uint32_t index;
+            stream->Read(&index);
+            if (index >= strings.size()) {
+                std::cout << "Invalid string index: " << index << "\n";
+                return false;
+            }
+            ins.string = &strings[index];
+            break;
+        }
+        case Opcode_ifl:
+        case Opcode_dfl:
+        case Opcode_irl:
+        case Opcode_irl_if_true:
+        case Opcode_irl_if_false:
+        case Opcode_array_index:
+        case Opcode_new_structure:
+        case Opcode_return:
+        case Opcode_leave:
+        case Opcode_load_null:
+        case Opcode_pop:
+        case Opcode_unary_minus:
+        case Opcode_unary_not:
+        case Opcode_add:
+        case Opcode_sub:
+        case Opcode_mul:
+        case Opcode_div:
+        case Opcode_mod:
+        case Opcode_pow:
+        case Opcode_and:
+        case Opcode_or:
+        case Opcode_eql:
+        case Opcode_neql:
+        case Opcode_less:
+        case Opcode_greater:
+        case Opcode_less_eql:
+        case Opcode_greater_eql:
+        case Opcode_bit_and:
+        case Opcode_bit_or:
+        case Opcode_bit_xor:
+        case Opcode_left_shift:
+        case Opcode_right_shift:
+        case Opcode_assign:
+        case Opcode_add_assign:
+        case Opcode_sub_assign:
+        case Opcode_mul_assign:
+        case Opcode_div_assign:
+        case Opcode_add_ii:
+        case Opcode_sub_ii:
+        case Opcode_mul_ii:
+        case Opcode_mod_ii:
+        case Opcode_less_ii:
+        case Opcode_less_eql_ii:
+        case Opcode_eql_ii:
+        case Opcode_neql_ii:
+        case Opcode_add_ff:
+        case Opcode_sub_ff:
+        case Opcode_mul_ff:
+        case Opcode_div_ff:
+        case Opcode_less_ff:
+        case Opcode_less_eql_ff:
+        case Opcode_concat_ss:
+            // no operands
+            break;
+        default:
+        {
+            auto last_pos = (((unsigned long)stream->Position()) - sizeof(Opcode_t));
+            std::cout << "Unrecognized instruction '" << (int)ins.opcode << "' at position: " << std::hex << last_pos << "\n";
+            return false;
+        }
+        }
+
+        if (stream->Overrun()) {
+            std::cout << "Unexpected end of bytecode\n";
+            return false;
+        }
+
+        code.push_back(ins);
+    }
+
+    // jumping to the very end of the stream finishes execution
+    index_at[stream->Max()] = code.size();
+
+    for (auto &branch : branches) {
+        size_t position = branch.second;
+        if (position > stream->Max() || index_at[position] == NO_INSTRUCTION) {
+            std::cout << "Invalid jump to position: " << std::hex << position << "\n";
+            return false;
+        }
+
+        DecodedInstruction &ins = code[branch.first];
+        if (ins.opcode == Opcode_new_function) {
+            ins.function.address = index_at[position];
+        } else {
+            ins.target = index_at[position];
+        }
+    }
+
+    for (auto &handler : handlers) {
+        uint32_t *positions[4] = { &handler.begin, &handler.end, &handler.handler, &handler.function };
+        for (uint32_t *position : positions) {
+            if (*position == AVM_NO_FUNCTION) {
+                // global code
+                continue;
+            }
+
+            size_t absolute = code_start + *position;
+            if (absolute > stream->Max() || index_at[absolute] == NO_INSTRUCTION) {
+                std::cout << "Invalid exception handler position: " << std::hex << absolute << "\n";
+                return false;
+            }
+            *position = index_at[absolute];
+        }
+    }
+
+#if AVM_SUPERINSTRUCTIONS
+    FuseInstructions();
+#endif
+
+    return true;
+}
+
+/** The sequences were chosen from a histogram of the instruction sequences
+    executed by the example scripts, where these two make up the condition and
+    the increment of most loops. Only the opcode of the first instruction is
+    changed, so the rest of the sequence can still be executed on its own.
+*/
+void Program::FuseInstructions()
+{
+    for (size_t i = 0; i + 3 < code.size(); i++) {
+        DecodedInstruction *seq = &code[i];
+
+        bool is_field = (seq[0].opcode == Opcode_load_field);
+        bool is_global = (seq[0].opcode == Opcode_load_global);
+        if ((!is_field && !is_global) || seq[1].opcode != Opcode_load_integer) {
+            continue;
+        }
+
+        if (seq[2].opcode == Opcode_add_assign && seq[3].opcode == Opcode_pop) {
+            seq[0].opcode = is_field ? Opcode_inc_field : Opcode_inc_global;
+        } else if ((seq[2].opcode == Opcode_less || seq[2].opcode == Opcode_less_ii) &&
+            seq[3].opcode == Opcode_jump_if_false) {
+            seq[0].opcode = is_field ? Opcode_jump_if_not_less_field : Opcode_jump_if_not_less_global;
+        }
+    }
+}
+
+const ExceptionHandler *Program::FindHandler(size_t index, size_t function) const
+{
+    for (const ExceptionHandler &handler : handlers) {
+        if (handler.function == function && index >= handler.begin && index < handler.end) {
+            return &handler;
+        }
+    }
+    return nullptr;
+}
+
+void Program::SetStrings(const std::vector<AVMString_t> &value)
+{
+    strings = value;
+}
+
+bool Program::LoadExceptionTable(ByteStream *stream)
+{
+    uint32_t num_handlers;
+    if (!stream->Read(&num_handlers) ||
+        num_handlers > (stream->Max() - stream->Position()) / (5 * sizeof(uint32_t))) {
+        std::cout << "Invalid exception table\n";
+        return false;
+    }
+
+    handlers.resize(num_handlers);
+    for (auto &handler : handlers) {
+        stream->Read(&handler.begin);
+        stream->Read(&handler.end);
+        stream->Read(&handler.handler);
+        stream->Read(&handler.function);
+        stream->Read(&handler.frame_depth);
+    }
+
+    return true;
+}
+
+bool Program::LoadConstants(ByteStream *stream)
+{
+    uint32_t num_strings;
+    // each string takes its length and at least one byte
+    if (!stream->Read(&num_strings) ||
+        num_strings > (stream->Max() - stream->Position()) / (sizeof(int32_t) + 1)) {
+        std::cout << "Invalid constant pool\n";
+        return false;
+    }
+
+    std::vector<char> buffer;
+    strings.reserve(num_strings);
+    for (uint32_t i = 0; i < num_strings; i++) {
+        int32_t len;
+        if (!stream->Read(&len) || len <= 0 || (size_t)len > stream->Max() - stream->Position()) {
+            std::cout << "Invalid string length at position: " << std::hex << stream->Position() << "\n";
+            return false;
+        }
+
+        buffer.resize(len);
+        stream->Read(&buffer[0], len * sizeof(achar));
+        buffer.back() = '\0';
+        strings.push_back(AVMString_t(&buffer[0]));
+    }
+
+    uint32_t num_floats;
+    if (!stream->Read(&num_floats) ||
+        num_floats > (stream->Max() - stream->Position()) / sizeof(AVMFloat_t)) {
+        std::cout << "Invalid constant pool\n";
+        return false;
+    }
+
+    floats.resize(num_floats);
+    for (uint32_t i = 0; i < num_floats; i++) {
+        stream->Read(&floats[i]);
+    }
+
+    return true;
+}
+} // namespace avm
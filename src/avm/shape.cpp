@@ -0,0 +1,60 @@
+#include <detail/shape.h>
+
+#include <unordered_set>
+
+namespace avm {
+Shape::Shape(const std::shared_ptr<Names> &names, size_t num_members)
+    : names(names), num_members(num_members)
+{
+}
+
+Shape *Shape::Empty()
+{
+    static thread_local Shape *empty = new Shape(std::make_shared<Names>(), 0);
+    return empty;
+}
+
+Shape *Shape::AddMember(const AVMString_t &name)
+{
+    // most shapes have a single transition, which is checked before the members
+    for (auto &&transition : transitions) {
+        if (transition.first == &name || *transition.first == name) {
+            return transition.second.get();
+        }
+    }
+
+    if (Find(name) != -1) {
+        return nullptr;
+    }
+
+    // the list of names is shared with the first child only; later children
+    // copy the part that is this shape's, as the first has appended to it
+    std::shared_ptr<Names> child_names = names;
+    if (names->size() != num_members) {
+        child_names = std::make_shared<Names>(names->begin(), names->begin() + num_members);
+    }
+    const AVMString_t *interned = Intern(name);
+    child_names->push_back(interned);
+
+    transitions.emplace_back(interned, std::unique_ptr<Shape>(new Shape(child_names, num_members + 1)));
+    return transitions.back().second.get();
+}
+
+int Shape::Find(const AVMString_t &name) const
+{
+    const AVMString_t *const *data = names->data();
+    for (size_t i = 0; i < num_members; i++) {
+        if (data[i] == &name || *data[i] == name) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+const AVMString_t *Shape::Intern(const AVMString_t &name)
+{
+    // elements of a set are not moved when it grows
+    static thread_local std::unordered_set<AVMString_t> *interned = new std::unordered_set<AVMString_t>();
+    return &*interned->insert(name).first;
+}
+} // namespace avm
@@ -0,0 +1,232 @@
+#include <detail/slab_allocator.h>
+
+#include <new>
+#include <algorithm>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace avm {
+thread_local SlabAllocator::FreeLists SlabAllocator::free_lists AVM_INITIAL_EXEC_TLS;
+thread_local std::vector<SlabAllocator::Slab> SlabAllocator::slabs;
+
+// No. slabs that were sorted when compaction began. Slabs allocated since are after them
+static thread_local size_t num_sorted = 0;
+
+// Slabs are mapped rather than allocated, so that releasing one returns its memory to the OS
+static char *MapSlab()
+{
+#ifdef _WIN32
+    void *memory = VirtualAlloc(nullptr, AVM_SLAB_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (memory == nullptr) {
+        throw std::bad_alloc();
+    }
+#else
+    void *memory = mmap(nullptr, AVM_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+#endif
+    return static_cast<char*>(memory);
+}
+
+static void UnmapSlab(char *memory)
+{
+#ifdef _WIN32
+    VirtualFree(memory, 0, MEM_RELEASE);
+#else
+    munmap(memory, AVM_SLAB_SIZE);
+#endif
+}
+
+SlabAllocator::FreeBlock *SlabAllocator::Refill(size_t size_class)
+{
+    size_t block_size = (size_class + 1) * ALIGNMENT;
+    size_t num_blocks = AVM_SLAB_SIZE / block_size;
+    char *slab = MapSlab();
+
+    Slab info;
+    info.memory = slab;
+    info.size_class = size_class;
+    info.num_counted = 0;
+    info.num_free = 0;
+    info.evacuate = false;
+    slabs.push_back(info);
+
+    // link the blocks in address order, so that they are handed out in that order
+    FreeBlock *first = reinterpret_cast<FreeBlock*>(slab);
+    for (size_t i = 0; i + 1 < num_blocks; i++) {
+        reinterpret_cast<FreeBlock*>(slab + i * block_size)->next =
+            reinterpret_cast<FreeBlock*>(slab + (i + 1) * block_size);
+    }
+    reinterpret_cast<FreeBlock*>(slab + (num_blocks - 1) * block_size)->next = free_lists.heads[size_class];
+
+    free_lists.heads[size_class] = first;
+    return first;
+}
+
+SlabAllocator::FreeBatch::FreeBatch()
+{
+    for (size_t i = 0; i < NUM_CLASSES; i++) {
+        heads[i] = nullptr;
+        tails[i] = nullptr;
+    }
+}
+
+void SlabAllocator::BeginBatch(FreeBatch *batch)
+{
+    free_lists.batch = batch;
+}
+
+void SlabAllocator::EndBatch()
+{
+    free_lists.batch = nullptr;
+}
+
+void SlabAllocator::FreeToBatch(FreeBatch *batch, FreeBlock *block, size_t size_class)
+{
+    block->next = batch->heads[size_class];
+    if (block->next == nullptr) {
+        batch->tails[size_class] = block;
+    }
+    batch->heads[size_class] = block;
+}
+
+void SlabAllocator::ReleaseBatch(FreeBatch &batch)
+{
+    for (size_t i = 0; i < NUM_CLASSES; i++) {
+        if (batch.heads[i] != nullptr) {
+            batch.tails[i]->next = free_lists.heads[i];
+            free_lists.heads[i] = batch.heads[i];
+            batch.heads[i] = nullptr;
+            batch.tails[i] = nullptr;
+        }
+    }
+}
+
+SlabAllocator::Slab *SlabAllocator::FindSlab(const void *ptr)
+{
+    const char *address = static_cast<const char*>(ptr);
+    auto it = std::upper_bound(slabs.begin(), slabs.begin() + num_sorted, address,
+        [](const char *address, const Slab &slab) { return address < slab.memory; });
+    if (it == slabs.begin()) {
+        return nullptr;
+    }
+    --it;
+    if (address >= it->memory + AVM_SLAB_SIZE) {
+        return nullptr;
+    }
+    return &*it;
+}
+
+void SlabAllocator::BeginCompaction()
+{
+    std::sort(slabs.begin(), slabs.end());
+    num_sorted = slabs.size();
+    for (Slab &slab : slabs) {
+        slab.num_counted = 0;
+        slab.num_free = 0;
+        slab.evacuate = false;
+    }
+}
+
+void SlabAllocator::CountObject(const void *ptr)
+{
+    Slab *slab = FindSlab(ptr);
+    if (slab != nullptr) {
+        ++slab->num_counted;
+    }
+}
+
+/** A size class is only compacted if fewer slabs are needed to hold the objects
+    that are moved than are released.
+*/
+bool SlabAllocator::SelectSparseSlabs(size_t threshold)
+{
+    // blocks freed on this thread may come from the slabs of another
+    for (size_t i = 0; i < NUM_CLASSES; i++) {
+        for (FreeBlock *block = free_lists.heads[i]; block != nullptr; block = block->next) {
+            Slab *slab = FindSlab(block);
+            if (slab != nullptr) {
+                ++slab->num_free;
+            }
+        }
+    }
+
+    bool any = false;
+    for (size_t i = 0; i < NUM_CLASSES; i++) {
+        size_t capacity = AVM_SLAB_SIZE / ((i + 1) * ALIGNMENT);
+        size_t num_sparse = 0;
+        size_t num_moved = 0;
+        size_t room = 0;
+        for (Slab &slab : slabs) {
+            if (slab.size_class != i) {
+                continue;
+            }
+            if (slab.num_counted + slab.num_free == capacity && slab.num_counted * 100 <= capacity * threshold) {
+                slab.evacuate = true;
+                ++num_sparse;
+                num_moved += slab.num_counted;
+            } else {
+                room += slab.num_free;
+            }
+        }
+
+        size_t num_new = (num_moved > room) ? (num_moved - room + capacity - 1) / capacity : 0;
+        if (num_new >= num_sparse) {
+            for (Slab &slab : slabs) {
+                if (slab.size_class == i) {
+                    slab.evacuate = false;
+                }
+            }
+            continue;
+        }
+
+        // take the blocks of the evacuated slabs out of the free list
+        FreeBlock **link = &free_lists.heads[i];
+        while (*link != nullptr) {
+            if (IsEvacuated(*link)) {
+                *link = (*link)->next;
+            } else {
+                link = &(*link)->next;
+            }
+        }
+        any = true;
+    }
+    return any;
+}
+
+bool SlabAllocator::IsEvacuated(const void *ptr)
+{
+    Slab *slab = FindSlab(ptr);
+    return slab != nullptr && slab->evacuate;
+}
+
+void *SlabAllocator::AllocateLike(const void *ptr)
+{
+    size_t size_class = FindSlab(ptr)->size_class;
+    FreeBlock *block = free_lists.heads[size_class];
+    if (block == nullptr) {
+        block = Refill(size_class);
+    }
+    free_lists.heads[size_class] = block->next;
+    return block;
+}
+
+size_t SlabAllocator::EndCompaction()
+{
+    size_t released = 0;
+    for (Slab &slab : slabs) {
+        if (slab.evacuate) {
+            UnmapSlab(slab.memory);
+            released += AVM_SLAB_SIZE;
+        }
+    }
+    slabs.erase(std::remove_if(slabs.begin(), slabs.end(),
+        [](const Slab &slab) { return slab.evacuate; }), slabs.end());
+    num_sorted = 0;
+    return released;
+}
+} // namespace avm
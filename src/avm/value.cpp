@@ -0,0 +1,42 @@
+#include <detail/value.h>
+#include <detail/variable.h>
+
+namespace avm {
+Reference Value::Box(Heap &heap) const
+{
+    if (type == Type_reference) {
+        return Ref();
+    }
+
+    auto ref = Reference(*heap.AllocObject<Variable>());
+
+    auto var = static_cast<Variable*>(ref.Ref());
+    var->AssignInline(*this);
+    var->flags |= Object::FLAG_CONST;
+    var->flags |= Object::FLAG_TEMPORARY;
+
+    return ref;
+}
+
+std::string Value::ToString() const
+{
+    if (type == Type_reference) {
+        return (*ptr != nullptr) ? (*ptr)->ToString() : "<null>";
+    }
+
+    Variable var;
+    var.AssignInline(*this);
+    return var.ToString();
+}
+
+std::string Value::TypeString() const
+{
+    if (type == Type_reference) {
+        return (*ptr != nullptr) ? (*ptr)->TypeString() : "null";
+    }
+
+    Variable var;
+    var.AssignInline(*this);
+    return var.TypeString();
+}
+} // namespace avm
@@ -0,0 +1,26 @@
+#include <detail/value_stack.h>
+
+namespace avm {
+ValueStack::~ValueStack()
+{
+    delete[] first;
+}
+
+void ValueStack::reserve(size_t size)
+{
+    if (size <= capacity()) {
+        return;
+    }
+    Value *values = new Value[size];
+    std::copy(first, last, values);
+    last = values + (last - first);
+    limit = values + size;
+    delete[] first;
+    first = values;
+}
+
+void ValueStack::Grow()
+{
+    reserve(first == limit ? 16 : 2 * capacity());
+}
+} // namespace avm
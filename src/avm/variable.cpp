@@ -1,4 +1,5 @@
 #include <detail/variable.h>
+#include <detail/value.h>
 
 #include <avm.h>
 #include <detail/vm_state.h>
@@ -9,7 +10,6 @@
 namespace avm {
 Variable::Variable()
 {
-    value.Assign(nullptr);
     type = Type_none;
 }
 
@@ -17,6 +17,47 @@ Variable::~Variable()
 {
 }
 
+void Variable::AssignInline(const Value &v)
+{
+    if (type == Type_string || type == Type_native) {
+        // release the held value
+        value = Dynamic();
+    }
+
+    switch (v.type) {
+    case Value::Type_int:
+        SetValue(v.int_value);
+        break;
+    case Value::Type_float:
+        SetValue(v.float_value);
+        break;
+    default:
+        type = Type_none;
+        break;
+    }
+}
+
+bool Variable::ToInline(Value &out) const
+{
+    if (!slots.empty()) {
+        return false;
+    }
+
+    switch (type) {
+    case Type_int:
+        out = Value(stack_value.int_value);
+        return true;
+    case Type_float:
+        out = Value(stack_value.float_value);
+        return true;
+    case Type_none:
+        out = Value();
+        return true;
+    default:
+        return false;
+    }
+}
+
 void Variable::invoke(VMState *state, uint32_t callargs)
 {
     state->HandleException(BadInvokeException(TypeString()));
@@ -33,22 +74,41 @@ Reference Variable::Clone(VMState *state)
     ref.Ref() = var;
 
     // copy all members
-    for (auto &&member : fields) {
-        if (member.second.Ref() != nullptr) {
-            ref.Ref()->AddFieldReference(state, member.first, member.second.Ref()->Clone(state));
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i].Ref() != nullptr) {
+            ref.Ref()->AddFieldReference(state, FieldName(i), slots[i].Ref()->Clone(state));
         }
     }
 
     return ref;
 }
 
+Object *Variable::Relocate(void *memory)
+{
+    Variable *moved = new (memory) Variable();
+    MoveTo(moved);
+    moved->type = type;
+    moved->value = std::move(value);
+    moved->stack_value = stack_value;
+    return moved;
+}
+
+size_t Variable::Size() const
+{
+    size_t size = sizeof(Variable) + FieldsSize();
+    if (type == Type_string) {
+        size += value.Get<std::string>().capacity();
+    }
+    return size;
+}
+
 Variable &Variable::Add(VMState *state, Variable *other)
 {
     if (type == Type_string) {
         auto &str1 = value.Get<AVMString_t&>();
         auto str2 = other->ToString();
 
-        str1 = str1 + str2;
+        str1 += str2;
     } else if ((type == Type_int) && (other->type == Type_int)) {
         auto &v1 = Cast<AVMInteger_t&>();
         auto v2 = other->Cast<AVMInteger_t>();
@@ -550,10 +610,9 @@ std::string Variable::ToString() const
     case Type_struct:
     {
         std::string result = "{ ";
-        for (size_t i = 0; i < fields.size(); i++) {
-            auto &it = fields[i];
-            result += it.first + ": " + it.second.Ref()->ToString();
-            if (i < fields.size() - 1) {
+        for (size_t i = 0; i < slots.size(); i++) {
+            result += FieldName(i) + ": " + slots[i].Ref()->ToString();
+            if (i < slots.size() - 1) {
                 result += ", ";
             }
         }
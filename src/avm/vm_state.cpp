@@ -2,14 +2,26 @@
 #include <cstdio>
 
 namespace avm {
+HeapPolicy::HeapPolicy()
+    : nursery_bytes(AVM_GC_NURSERY_BYTES),
+      min_trigger_bytes(AVM_GC_MIN_TRIGGER_BYTES),
+      min_growth_factor(AVM_GC_MIN_GROWTH_FACTOR),
+      max_growth_factor(AVM_GC_MAX_GROWTH_FACTOR),
+      max_heap_size(AVM_GC_MAX_HEAP_SIZE)
+{
+}
+
 VMState::VMState(VMInstance *vm)
     : vm(vm), 
       frame_level(AVM_LEVEL_GLOBAL), 
       read_level(AVM_LEVEL_GLOBAL),
-      can_handle_exceptions(false),
-      num_objects(0), 
-      max_objects(GC_THRESHOLD_MIN), 
-      max_heap_size(1000) /* in bytes */
+      program(nullptr),
+      pc(0),
+      pc_limit(0),
+      raised_handler(nullptr),
+      raised_call_depth(0),
+      gc_trigger_bytes(AVM_GC_MIN_TRIGGER_BYTES),
+      gc_step_work(AVM_GC_STEP_WORK)
 {
     frames.push_back(new Frame());
     stack.reserve(100);
@@ -25,46 +37,80 @@ VMState::~VMState()
             for (long i = current->locals.size() - 1; i >= 0; i--) {
                 current->locals[i].second.DeleteObject();
             }
-
-            delete frames[start];
-            frames[start] = nullptr;
         }
 
         --start;
     }
+
+    for (auto &&frame : frames) {
+        delete frame;
+    }
+
+    for (auto &&it : natives) {
+        it.second.DeleteObject();
+    }
 }
 
+/** Searches the exception table for a try block around the instruction that
+    raised the exception, then around each call that led to it. Nothing is
+    unwound yet, since the instruction may still use the stack and frames.
+*/
 void VMState::HandleException(const Exception &except)
 {
-    frames[frame_level]->exception_occured = true;
-    if (!can_handle_exceptions) {
-        std::cout << "Unhandled exception: " << except.message << "\n";
-        std::cout << "Type 'd' and press return to display memory dump\n";
-
-        if (std::getchar() == (int)'d') {
-            std::stringstream ss;
-            ss << "Stack:\n";
-            for (auto &&it : stack) {
-                ss << "\t" << it.Ref()->ToString() << "\n";
-            }
-            ss << "\nHeap:\n";
-            heap.DumpHeap(ss);
-
-            ss << "\nFields:\n";
-            for (size_t i = 0; i < frames.size(); i++) {
-                ss << "#" << i << " {\n";
-                Frame *frame = frames[i];
-                for (size_t j = 0; j < frame->locals.size(); j++) {
-                    ss << "\t#" << j << "\t" << frame->locals[j].first << "\n";
-                }
-                ss << "}\n";
+    if (raised_handler != nullptr) {
+        // the instruction has already raised an exception
+        return;
+    }
+
+    if (program != nullptr) {
+        size_t index = pc - 1;
+        size_t depth = calls.size();
+
+        while (true) {
+            size_t function = (depth == 0) ? AVM_NO_FUNCTION : calls[depth - 1].function;
+            raised_handler = program->FindHandler(index, function);
+            if (raised_handler != nullptr || depth == 0) {
+                break;
             }
 
-            std::cout << ss.str();
+            // continue from the instruction that made the call
+            index = calls[depth - 1].return_pc - 1;
+            --depth;
         }
 
-        std::system("pause");
-        std::exit(EXIT_FAILURE);
+        if (raised_handler != nullptr) {
+            raised_call_depth = depth;
+            pc_limit = 0;
+            return;
+        }
     }
+
+    std::cout << "Unhandled exception: " << except.message << "\n";
+    std::cout << "Type 'd' and press return to display memory dump\n";
+
+    if (std::getchar() == (int)'d') {
+        std::stringstream ss;
+        ss << "Stack:\n";
+        for (auto &&it : stack) {
+            ss << "\t" << it.ToString() << "\n";
+        }
+        ss << "\nHeap:\n";
+        heap.DumpHeap(ss);
+
+        ss << "\nFields:\n";
+        for (int i = AVM_LEVEL_GLOBAL; i <= frame_level; i++) {
+            ss << "#" << i << " {\n";
+            Frame *frame = frames[i];
+            for (size_t j = 0; j < frame->locals.size(); j++) {
+                ss << "\t#" << j << "\t" << frame->locals[j].first << "\n";
+            }
+            ss << "}\n";
+        }
+
+        std::cout << ss.str();
+    }
+
+    std::system("pause");
+    std::exit(EXIT_FAILURE);
 }
 }
\ No newline at end of file
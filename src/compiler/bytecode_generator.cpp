@@ -5,11 +5,15 @@
 #include <memory>
 #include <map>
 #include <utility>
+#include <cstring>
 
 namespace avm {
-BytecodeGenerator::BytecodeGenerator(const InstructionStream &bstream, const std::vector<Label> &labels)
+BytecodeGenerator::BytecodeGenerator(const InstructionStream &bstream, const std::vector<Label> &labels,
+    const ConstantPool &constants, const std::vector<CompilerState::ExceptionTableEntry> &exception_table)
     : bstream(bstream),
-      labels(labels)
+      labels(labels),
+      constants(constants),
+      exception_table(exception_table)
 {
 }
 
@@ -19,25 +23,27 @@ bool BytecodeGenerator::Emit(std::ostream &filestream)
     filestream.write(ARES_MAGIC, ARES_MAGIC_LEN);
     filestream.write(ARES_VERSION, ARES_VERSION_LEN);
 
-    uint64_t label_offset = (uint64_t)filestream.tellp();
+    EmitConstants(filestream);
+
+    // location of each label within the instruction stream
+    std::map<unsigned int, unsigned int> label_locations;
     for (Label &label : labels) {
-        label_offset += sizeof(Opcode_t); // cmd type
-        label_offset += sizeof(uint32_t); // blockid
-        label_offset += sizeof(uint64_t); // block pos
+        label_locations[label.id] = label.location;
     }
 
-    for (Label &label : labels) {
-        // store addresses of each label at top of file
-        Opcode_t opcode = Opcode_store_address;
-        uint32_t id = (uint32_t)label.id;
-        uint64_t addr = (uint64_t)label.location + label_offset;
-
-        filestream.write((char*)&opcode, sizeof(Opcode_t));
-        filestream.write((char*)&id, sizeof(uint32_t));
-        filestream.write((char*)&addr, sizeof(uint64_t));
+    if (!EmitExceptionTable(filestream, label_locations)) {
+        return false;
     }
 
+    // position of the current instruction within the instruction stream
+    uint64_t position = 0;
+
     for (Instruction<> &ins : bstream.instructions) {
+        size_t size = 0;
+        for (auto &operand : ins.data) {
+            size += operand.size();
+        }
+
         switch (ins.data.back()[0]) {
             // FALLTHROUGH
         case Opcode_ifl:
@@ -67,15 +73,21 @@ bool BytecodeGenerator::Emit(std::ostream &filestream)
         case Opcode_jump:
         case Opcode_jump_if_true:
         case Opcode_jump_if_false:
-        case Opcode_try_catch_block:
+        case Opcode_new_function:
+            if (!ResolveLabel(ins, position + size, label_locations)) {
+                return false;
+            }
+            ins.Write(filestream);
+            break;
+        // FALLTHROUGH
         case Opcode_store_as_local:
         case Opcode_new_native_object:
         case Opcode_array_index:
         case Opcode_new_member:
         case Opcode_load_member:
         case Opcode_new_structure:
-        case Opcode_new_function:
         case Opcode_invoke_object:
+        case Opcode_tail_invoke:
         case Opcode_return:
         case Opcode_leave:
         case Opcode_break:
@@ -83,6 +95,7 @@ bool BytecodeGenerator::Emit(std::ostream &filestream)
         case Opcode_print:
         case Opcode_load_local:
         case Opcode_load_field:
+        case Opcode_load_global:
         case Opcode_load_integer:
         case Opcode_load_float:
         case Opcode_load_string:
@@ -114,13 +127,103 @@ bool BytecodeGenerator::Emit(std::ostream &filestream)
         case Opcode_sub_assign:
         case Opcode_mul_assign:
         case Opcode_div_assign:
+        case Opcode_add_ii:
+        case Opcode_sub_ii:
+        case Opcode_mul_ii:
+        case Opcode_mod_ii:
+        case Opcode_less_ii:
+        case Opcode_less_eql_ii:
+        case Opcode_eql_ii:
+        case Opcode_neql_ii:
+        case Opcode_add_ff:
+        case Opcode_sub_ff:
+        case Opcode_mul_ff:
+        case Opcode_div_ff:
+        case Opcode_less_ff:
+        case Opcode_less_eql_ff:
+        case Opcode_concat_ss:
             ins.Write(filestream);
             break;
         default:
             std::cout << "Unrecognized code: " << (int)ins.data.back()[0] << "\n";
             return false;
         }
+
+        position += size;
     }
     return true;
 }
+
+void BytecodeGenerator::EmitConstants(std::ostream &filestream)
+{
+    uint32_t num_strings = (uint32_t)constants.strings.size();
+    filestream.write((char*)&num_strings, sizeof(uint32_t));
+    for (const std::string &str : constants.strings) {
+        // length includes the null terminator
+        int32_t len = (int32_t)str.length() + 1;
+        filestream.write((char*)&len, sizeof(int32_t));
+        filestream.write(str.c_str(), len);
+    }
+
+    uint32_t num_floats = (uint32_t)constants.floats.size();
+    filestream.write((char*)&num_floats, sizeof(uint32_t));
+    for (AVMFloat_t value : constants.floats) {
+        filestream.write((char*)&value, sizeof(AVMFloat_t));
+    }
+}
+
+bool BytecodeGenerator::EmitExceptionTable(std::ostream &filestream,
+    const std::map<unsigned int, unsigned int> &label_locations)
+{
+    uint32_t num_entries = (uint32_t)exception_table.size();
+    filestream.write((char*)&num_entries, sizeof(uint32_t));
+
+    for (const CompilerState::ExceptionTableEntry &entry : exception_table) {
+        // positions are relative to the first instruction
+        uint32_t positions[4] = { 0, 0, 0, (uint32_t)-1 };
+        unsigned int ids[4] = { entry.begin_label_id, entry.end_label_id,
+            entry.handler_label_id, entry.function_label_id };
+
+        for (int i = 0; i < 4; i++) {
+            if (ids[i] == 0) {
+                // not within a function
+                continue;
+            }
+
+            auto it = label_locations.find(ids[i]);
+            if (it == label_locations.end()) {
+                std::cout << "Unresolved label: " << ids[i] << "\n";
+                return false;
+            }
+            positions[i] = it->second;
+        }
+
+        filestream.write((char*)positions, sizeof(positions));
+        filestream.write((char*)&entry.frame_depth, sizeof(uint32_t));
+    }
+
+    return true;
+}
+
+bool BytecodeGenerator::ResolveLabel(Instruction<> &ins, uint64_t end_position,
+    const std::map<unsigned int, unsigned int> &label_locations)
+{
+    // the label id is always the last operand
+    std::vector<char> &operand = ins.data.front();
+
+    uint32_t id;
+    std::memcpy(&id, &operand[0], sizeof(id));
+
+    auto it = label_locations.find(id);
+    if (it == label_locations.end()) {
+        std::cout << "Unresolved label: " << id << "\n";
+        return false;
+    }
+
+    // replace the label id with the offset from the end of the instruction
+    int32_t offset = (int32_t)((int64_t)it->second - (int64_t)end_position);
+    std::memcpy(&operand[0], &offset, sizeof(offset));
+
+    return true;
+}
 } // namespace avm
\ No newline at end of file
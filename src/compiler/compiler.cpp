@@ -264,13 +264,13 @@ void Compiler::Accept(AstBinaryOp *node)
             a > b will now be b < a */
         Accept(right.get());
         Accept(left.get());
-        bstream << Instruction<Opcode_t>(Opcode_less);
+        bstream << Instruction<Opcode_t>(SelectOpcode(Opcode_less, right.get(), left.get()));
     } else if (node->op == BinOp_greater_eql) {
         /* reverse placement of operands:
         a >= b will now be b <= a */
         Accept(right.get());
         Accept(left.get());
-        bstream << Instruction<Opcode_t>(Opcode_less_eql);
+        bstream << Instruction<Opcode_t>(SelectOpcode(Opcode_less_eql, right.get(), left.get()));
     } else {
         Accept(left.get());
         Accept(right.get());
@@ -280,20 +280,20 @@ void Compiler::Accept(AstBinaryOp *node)
             bstream << Instruction<Opcode_t>(Opcode_pow);
             break;
         case BinOp_multiply:
-            bstream << Instruction<Opcode_t>(Opcode_mul);
+            bstream << Instruction<Opcode_t>(SelectOpcode(Opcode_mul, left.get(), right.get()));
             break;
         case BinOp_floor_divide:
         case BinOp_divide:
-            bstream << Instruction<Opcode_t>(Opcode_div);
+            bstream << Instruction<Opcode_t>(SelectOpcode(Opcode_div, left.get(), right.get()));
             break;
         case BinOp_modulus:
-            bstream << Instruction<Opcode_t>(Opcode_mod);
+            bstream << Instruction<Opcode_t>(SelectOpcode(Opcode_mod, left.get(), right.get()));
             break;
         case BinOp_add:
-            bstream << Instruction<Opcode_t>(Opcode_add);
+            bstream << Instruction<Opcode_t>(SelectOpcode(Opcode_add, left.get(), right.get()));
             break;
         case BinOp_subtract:
-            bstream << Instruction<Opcode_t>(Opcode_sub);
+            bstream << Instruction<Opcode_t>(SelectOpcode(Opcode_sub, left.get(), right.get()));
             break;
         case BinOp_logand:
             bstream << Instruction<Opcode_t>(Opcode_and);
@@ -302,16 +302,16 @@ void Compiler::Accept(AstBinaryOp *node)
             bstream << Instruction<Opcode_t>(Opcode_or);
             break;
         case BinOp_equals:
-            bstream << Instruction<Opcode_t>(Opcode_eql);
+            bstream << Instruction<Opcode_t>(SelectOpcode(Opcode_eql, left.get(), right.get()));
             break;
         case BinOp_not_equal:
-            bstream << Instruction<Opcode_t>(Opcode_neql);
+            bstream << Instruction<Opcode_t>(SelectOpcode(Opcode_neql, left.get(), right.get()));
             break;
         case BinOp_less:
-            bstream << Instruction<Opcode_t>(Opcode_less);
+            bstream << Instruction<Opcode_t>(SelectOpcode(Opcode_less, left.get(), right.get()));
             break;
         case BinOp_less_eql:
-            bstream << Instruction<Opcode_t>(Opcode_less_eql);
+            bstream << Instruction<Opcode_t>(SelectOpcode(Opcode_less_eql, left.get(), right.get()));
             break;
         case BinOp_bitand:
             bstream << Instruction<Opcode_t>(Opcode_bit_and);
@@ -385,10 +385,10 @@ void Compiler::Accept(AstMemberAccess *node)
         if (node->right->type == Ast_type_member_access) {
             Accept(node->right.get());
             auto right_ast = static_cast<AstMemberAccess*>(node->right.get());
-            bstream << Instruction<Opcode_t, int32_t, const char *>(Opcode_load_member, right_ast->left_str.length() + 1, right_ast->left_str.c_str());
+            bstream << Instruction<Opcode_t, uint32_t>(Opcode_load_member, state.constants.AddString(right_ast->left_str));
         } else if (node->right->type == Ast_type_variable) {
             auto right_ast = static_cast<AstVariable*>(node->right.get());
-            bstream << Instruction<Opcode_t, int32_t, const char *>(Opcode_load_member, right_ast->name.length() + 1, right_ast->name.c_str());
+            bstream << Instruction<Opcode_t, uint32_t>(Opcode_load_member, state.constants.AddString(right_ast->name));
         } else if (node->right->type == Ast_type_function_call) {
             // accept member function call
             auto right_ast = static_cast<AstFunctionCall*>(node->right.get());
@@ -397,7 +397,7 @@ void Compiler::Accept(AstMemberAccess *node)
                 Accept(param.get());
             }
 
-            bstream << Instruction<Opcode_t, int32_t, const char *>(Opcode_load_member, right_ast->name.length() + 1, right_ast->name.c_str());
+            bstream << Instruction<Opcode_t, uint32_t>(Opcode_load_member, state.constants.AddString(right_ast->name));
             bstream << Instruction<Opcode_t, int32_t>(Opcode_invoke_object, right_ast->arguments.size());
         }
     }
@@ -419,7 +419,7 @@ void Compiler::Accept(AstVariableDeclaration *node)
     Accept(node->assignment.get()); // may have side effects, so accept anyway
     if ((config::optimize_remove_unused && UseCount(node) != 0) || !config::optimize_remove_unused) {
         std::string var_name(state.MakeVariableName(node->name, node->module));
-        bstream << Instruction<Opcode_t, int32_t, const char*>(Opcode_store_as_local, var_name.length() + 1, var_name.c_str());
+        StoreLocal(var_name);
     } else {
         // must pop the result of the assignment from the stack
         bstream << Instruction<Opcode_t>(Opcode_pop);
@@ -449,11 +449,7 @@ void Compiler::Accept(AstVariable *node)
             Accept(node->current_value);
         } else {
             std::string var_name(state.MakeVariableName(node->name, node->module));
-            bstream << Instruction<Opcode_t, int32_t, const char*>(Opcode_load_local,
-                var_name.length() + 1, var_name.c_str());
-
-            /*bstream << Instruction<Opcode_t, int32_t, int32_t>(Opcode_load_field,
-                state.level - node->owner_level, node->field_index);*/
+            LoadVariable(var_name);
         }
     }
 }
@@ -465,13 +461,12 @@ void Compiler::Accept(AstInteger *node)
 
 void Compiler::Accept(AstFloat *node)
 {
-    bstream << Instruction<Opcode_t, AVMFloat_t>(Opcode_load_float, node->value);
+    bstream << Instruction<Opcode_t, uint32_t>(Opcode_load_float, state.constants.AddFloat(node->value));
 }
 
 void Compiler::Accept(AstString *node)
 {
-    bstream << Instruction<Opcode_t, int32_t, const char*>(Opcode_load_string,
-        node->value.length() + 1, node->value.c_str());
+    bstream << Instruction<Opcode_t, uint32_t>(Opcode_load_string, state.constants.AddString(node->value));
 }
 
 void Compiler::Accept(AstTrue *node)
@@ -513,7 +508,10 @@ void Compiler::Accept(AstFunctionDefinition *node)
 
             bstream << Instruction<Opcode_t, uint32_t, uint8_t, uint32_t>(Opcode_new_function,
                 node->arguments.size(), 0/*No variadic support yet*/, id);
-            bstream << Instruction<Opcode_t, int32_t, const char*>(Opcode_store_as_local, var_name.length() + 1, var_name.c_str());
+            StoreLocal(var_name);
+
+            // jump to after the function so it isn't executed
+            bstream << Instruction<Opcode_t, int32_t>(Opcode_jump, after_id);
 
             // add the label for the function so that we can jump to it
             Label function_label;
@@ -521,20 +519,26 @@ void Compiler::Accept(AstFunctionDefinition *node)
             function_label.location = bstream.GetPosition();
             state.labels.push_back(function_label);
 
-            // jump to after the function so it isn't executed
-            bstream << Instruction<Opcode_t, int32_t>(Opcode_jump, after_id);
-
             auto *body = dynamic_cast<AstBlock*>(node->block.get());
             if (body) {
                 IncreaseBlock(LevelType::Level_function);
+                unsigned int end_id = state.CurrentLevel().end_label_id = ++state.block_id_counter;
+                state.CurrentLevel().body_label_id = id;
 
                 // create params as local variables
                 for (auto it = node->arguments.rbegin(); it != node->arguments.rend(); ++it) {
                     std::string arg_name = state.MakeVariableName(*it, node->module);
-                    bstream << Instruction<Opcode_t, int32_t, const char*>(Opcode_store_as_local, arg_name.length() + 1, arg_name.c_str());
+                    StoreLocal(arg_name);
                 }
 
                 Accept(body);
+
+                // return statements jump here, before the function's frame is closed
+                Label end_label;
+                end_label.id = end_id;
+                end_label.location = bstream.GetPosition();
+                state.labels.push_back(end_label);
+
                 DecreaseBlock();
 
                 // Return instruction is placed after the block is decreased,
@@ -563,27 +567,35 @@ void Compiler::Accept(AstFunctionExpression *node)
     bstream << Instruction<Opcode_t, uint32_t, uint8_t, uint32_t>(Opcode_new_function,
         node->arguments.size(), 0/*No variadic support yet*/, id);
 
+    // jump to after the function so it isn't executed
+    bstream << Instruction<Opcode_t, int32_t>(Opcode_jump, after_id);
+
     // add the label for the function so that we can jump to it
     Label function_label;
     function_label.id = id;
     function_label.location = bstream.GetPosition();
     state.labels.push_back(function_label);
 
-    // jump to after the function so it isn't executed
-    bstream << Instruction<Opcode_t, int32_t>(Opcode_jump, after_id);
-
     auto *body = dynamic_cast<AstBlock*>(node->block.get());
     if (body) {
         IncreaseBlock(LevelType::Level_function);
+        unsigned int end_id = state.CurrentLevel().end_label_id = ++state.block_id_counter;
+        state.CurrentLevel().body_label_id = id;
 
         // create params as local variables
         for (auto it = node->arguments.rbegin(); it != node->arguments.rend(); ++it) {
             std::string var_name = state.MakeVariableName(*it, node->module);
-            bstream << Instruction<Opcode_t, int32_t, const char*>(Opcode_store_as_local,
-                var_name.length() + 1, var_name.c_str());
+            StoreLocal(var_name);
         }
 
         Accept(body);
+
+        // return statements jump here, before the function's frame is closed
+        Label end_label;
+        end_label.id = end_id;
+        end_label.location = bstream.GetPosition();
+        state.labels.push_back(end_label);
+
         DecreaseBlock();
 
         // Return instruction is placed after the block is decreased,
@@ -617,15 +629,22 @@ void Compiler::Accept(AstFunctionCall *node)
                     ++state.function_level;
                     bstream << Instruction<Opcode_t>(Opcode_irl);
                     IncreaseBlock(LevelType::Level_function);
+                    unsigned int end_id = state.CurrentLevel().end_label_id = ++state.block_id_counter;
+                    state.CurrentLevel().is_inline = true;
 
                     // create params as local variables
                     for (auto it = def->arguments.rbegin(); it != def->arguments.rend(); ++it) {
                         std::string arg_name = state.MakeVariableName(*it, def->module);
-                        bstream << Instruction<Opcode_t, int32_t, const char*>(Opcode_store_as_local,
-                            arg_name.length() + 1, arg_name.c_str());
+                        StoreLocal(arg_name);
                     }
 
                     Accept(def->block.get());
+
+                    Label end_label;
+                    end_label.id = end_id;
+                    end_label.location = bstream.GetPosition();
+                    state.labels.push_back(end_label);
+
                     DecreaseBlock();
                     --state.function_level;
                     inlined = true;
@@ -635,8 +654,7 @@ void Compiler::Accept(AstFunctionCall *node)
 
         if (!inlined) {
             std::string var_name = state.MakeVariableName(node->name, node->module);
-            bstream << Instruction<Opcode_t, int32_t, const char*>(Opcode_load_local,
-                var_name.length() + 1, var_name.c_str());
+            LoadVariable(var_name);
         }
     }
 
@@ -651,7 +669,7 @@ void Compiler::Accept(AstObjectExpression *node)
 {
     bstream << Instruction<Opcode_t>(Opcode_new_structure);
     for (auto &&mem : node->members) {
-        bstream << Instruction<Opcode_t, int32_t, const char*>(Opcode_new_member, mem.first.length() + 1, mem.first.c_str());
+        bstream << Instruction<Opcode_t, uint32_t>(Opcode_new_member, state.constants.AddString(mem.first));
         Accept(mem.second.get());
         bstream << Instruction<Opcode_t>(Opcode_assign);
         bstream << Instruction<Opcode_t>(Opcode_pop);
@@ -668,7 +686,8 @@ void Compiler::Accept(AstIfStmt *node)
     unsigned int after_if_id = ++state.block_id_counter;
 
     Accept(node->conditional.get());
-    // if result is false, then skip to where the else statement is
+    // if result is false, then skip to where the else statement is.
+    // the conditional is popped from the stack by the jump.
     bstream << Instruction<Opcode_t, uint32_t>(Opcode_jump_if_false, after_if_id);
 
     // temporary:
@@ -678,16 +697,19 @@ void Compiler::Accept(AstIfStmt *node)
     Accept(node->block.get());
     DecreaseBlock();
 
+    unsigned int after_else_id = 0;
+    if (node->else_statement) {
+        after_else_id = ++state.block_id_counter;
+        // the if body was executed, so skip to after the else statement
+        bstream << Instruction<Opcode_t, uint32_t>(Opcode_jump, after_else_id);
+    }
+
     Label skip_if_label;
     skip_if_label.id = after_if_id;
     skip_if_label.location = bstream.GetPosition();
     state.labels.push_back(skip_if_label);
 
     if (node->else_statement) {
-        unsigned int after_else_id = ++state.block_id_counter;
-        // if the if result was true, skip to after the else statement
-        bstream << Instruction<Opcode_t, uint32_t>(Opcode_jump_if_true, after_else_id);
-
         // temporary:
         bstream << Instruction<Opcode_t>(Opcode_irl);
 
@@ -700,9 +722,6 @@ void Compiler::Accept(AstIfStmt *node)
         skip_else_label.location = bstream.GetPosition();
         state.labels.push_back(skip_else_label);
     }
-
-    // finally, pop the conditional from the stack:
-    bstream << Instruction<Opcode_t>(Opcode_pop);
 }
 
 void Compiler::Accept(AstPrintStmt *node)
@@ -716,9 +735,6 @@ void Compiler::Accept(AstPrintStmt *node)
 
 void Compiler::Accept(AstReturnStmt *node)
 {
-    // The resulting value will get pushed onto the stack
-    Accept(node->value.get());
-
     int start = state.level;
     int counter = 1;
     LevelInfo *level = &state.levels[start];
@@ -726,7 +742,32 @@ void Compiler::Accept(AstReturnStmt *node)
         ++counter;
         level = &state.levels[--start];
     }
-    bstream << Instruction<Opcode_t, uint8_t>(Opcode_drl, counter);
+
+    // The resulting value will get pushed onto the stack
+    AstFunctionCall *tail_call = GetTailCall(node->value.get(), start);
+    if (tail_call != nullptr) {
+        for (auto &&param : tail_call->arguments) {
+            Accept(param.get());
+        }
+        LoadVariable(state.MakeVariableName(tail_call->name, tail_call->module));
+        // if the callee is not a function of the script, this behaves as 'ivk',
+        // and the instructions below return the result as usual
+        bstream << Instruction<Opcode_t, int32_t>(Opcode_tail_invoke, tail_call->arguments.size());
+    } else {
+        Accept(node->value.get());
+    }
+
+    if (start < compiler_global_level) {
+        // not within a function, so the rest of the program is skipped
+        bstream << Instruction<Opcode_t, uint8_t>(Opcode_drl, counter);
+    } else {
+        // close each block between here and the function body,
+        // then jump straight to the end of the function.
+        for (int i = 1; i < counter; i++) {
+            bstream << Instruction<Opcode_t>(Opcode_leave);
+        }
+        bstream << Instruction<Opcode_t, uint32_t>(Opcode_jump, level->end_label_id);
+    }
 }
 
 void Compiler::Accept(AstForLoop *node)
@@ -743,8 +784,7 @@ void Compiler::Accept(AstForLoop *node)
          bool pos = diff >= 0;
 
          std::string var_name = state.MakeVariableName(node->identifier, node->module);
-         bstream << Instruction<Opcode_t, int32_t, const char*>(Opcode_load_local,
-             var_name.length() + 1, var_name.c_str());
+         bstream << Instruction<Opcode_t, uint32_t>(Opcode_load_local, state.constants.AddString(var_name));
 
          bstream << Instruction<Opcode_t, AVMInteger_t>(Opcode_load_integer, first);
          bstream << Instruction<Opcode_t>(Opcode_assign);
@@ -788,7 +828,7 @@ void Compiler::Accept(AstForLoop *node)
         state.labels.push_back(top_loop_label);
 
         Accept(node->conditional.get());
-        // skip the loop if the condition is false
+        // skip the loop if the condition is false (the conditional is popped by the jump)
         bstream << Instruction<Opcode_t, uint32_t>(Opcode_jump_if_false, bottom_loop_id);
 
         bstream << Instruction<Opcode_t>(Opcode_irl);
@@ -800,9 +840,6 @@ void Compiler::Accept(AstForLoop *node)
         // pop the afterthought from the stack:
         bstream << Instruction<Opcode_t>(Opcode_pop);
 
-        // pop the conditional from the stack:
-        bstream << Instruction<Opcode_t>(Opcode_pop);
-
         // jump to top of loop
         bstream << Instruction<Opcode_t, uint32_t>(Opcode_jump, top_loop_id);
 
@@ -811,9 +848,6 @@ void Compiler::Accept(AstForLoop *node)
         bottom_loop_label.location = bstream.GetPosition();
         state.labels.push_back(bottom_loop_label);
 
-        // pop the final conditional value from the stack
-        bstream << Instruction<Opcode_t>(Opcode_pop);
-
         // end of initializer block
         DecreaseBlock();
     }
@@ -841,7 +875,7 @@ void Compiler::Accept(AstWhileLoop *node)
 
         Accept(node->conditional.get());
 
-        // skip the loop if the condition is false
+        // skip the loop if the condition is false (the conditional is popped by the jump)
         bstream << Instruction<Opcode_t, uint32_t>(Opcode_jump_if_false, bottom_loop_id);
 
         // temporary:
@@ -851,9 +885,6 @@ void Compiler::Accept(AstWhileLoop *node)
         Accept(node->block.get());
         DecreaseBlock();
 
-        // pop the conditional from the stack:
-        bstream << Instruction<Opcode_t>(Opcode_pop);
-
         // jump to top of loop
         bstream << Instruction<Opcode_t, uint32_t>(Opcode_jump, top_loop_id);
 
@@ -861,9 +892,6 @@ void Compiler::Accept(AstWhileLoop *node)
         bottom_loop_label.id = bottom_loop_id;
         bottom_loop_label.location = bstream.GetPosition();
         state.labels.push_back(bottom_loop_label);
-
-        // pop the final conditional value from the stack
-        bstream << Instruction<Opcode_t>(Opcode_pop);
     }
 }
 
@@ -879,16 +907,63 @@ void Compiler::Accept(AstTryCatch *node)
     }
 
     if ((config::optimize_remove_dead_code && !empty_try_body) || !config::optimize_remove_dead_code) {
-        bstream << Instruction<Opcode_t>(Opcode_try_catch_block);
+        // nothing is executed on entering the try block. Instead, its range is
+        // listed in the exception table, which the VM searches when an exception is raised.
+        ExceptionTableEntry entry;
+        entry.begin_label_id = ++state.block_id_counter;
+        entry.end_label_id = ++state.block_id_counter;
+        entry.handler_label_id = ++state.block_id_counter;
+        unsigned int after_catch_id = ++state.block_id_counter;
+
+        // the frame level to return to is relative to the function that is being called
+        int start = state.level;
+        while (start >= compiler_global_level &&
+            (state.levels[start].type != LevelType::Level_function || state.levels[start].is_inline)) {
+            --start;
+        }
+        if (start < compiler_global_level) {
+            entry.frame_depth = state.level - compiler_global_level;
+        } else {
+            entry.function_label_id = state.levels[start].body_label_id;
+            entry.frame_depth = state.level - start + 1;
+        }
 
-        IncreaseBlock(LevelType::Level_default);
+        Label begin_label;
+        begin_label.id = entry.begin_label_id;
+        begin_label.location = bstream.GetPosition();
+        state.labels.push_back(begin_label);
+
+        bstream << Instruction<Opcode_t>(Opcode_irl);
+        IncreaseBlock(LevelType::Level_try);
         Accept(node->try_block.get());
         DecreaseBlock();
 
+        Label end_label;
+        end_label.id = entry.end_label_id;
+        end_label.location = bstream.GetPosition();
+        state.labels.push_back(end_label);
+
+        // no exception occured, so skip the catch block
+        bstream << Instruction<Opcode_t, uint32_t>(Opcode_jump, after_catch_id);
+
+        Label handler_label;
+        handler_label.id = entry.handler_label_id;
+        handler_label.location = bstream.GetPosition();
+        state.labels.push_back(handler_label);
+
+        bstream << Instruction<Opcode_t>(Opcode_irl);
         IncreaseBlock(LevelType::Level_default);
         Accept(node->exception_object.get());
         Accept(node->catch_block.get());
         DecreaseBlock();
+
+        Label after_catch_label;
+        after_catch_label.id = after_catch_id;
+        after_catch_label.location = bstream.GetPosition();
+        state.labels.push_back(after_catch_label);
+
+        // entries of nested try blocks have already been added, so they are found first
+        state.exception_table.push_back(entry);
     }
 }
 
@@ -896,6 +971,161 @@ void Compiler::Accept(AstRange *node)
 {
 }
 
+/** A tail call closes the frames of the calling function before the callee's
+    body is read. Only functions declared in the global block are called this way,
+    since a nested function may look up the locals of its caller by name.
+    A call within a try block is not a tail call either, since exceptions that
+    it raises must still find the try block's handler.
+*/
+AstFunctionCall *Compiler::GetTailCall(AstNode *value, int function_level)
+{
+    if (!config::optimize_tail_calls || value == nullptr) {
+        return nullptr;
+    }
+
+    if (function_level < compiler_global_level || state.levels[function_level].is_inline) {
+        return nullptr;
+    }
+
+    for (int i = state.level; i > function_level; i--) {
+        if (state.levels[i].type == LevelType::Level_try) {
+            return nullptr;
+        }
+    }
+
+    if (value->type == Ast_type_expression) {
+        value = static_cast<AstExpression*>(value)->child.get();
+    }
+
+    if (value == nullptr || value->type != Ast_type_function_call) {
+        return nullptr;
+    }
+
+    auto *call = static_cast<AstFunctionCall*>(value);
+    auto *def = dynamic_cast<AstFunctionDefinition*>(call->definition);
+    if (call->is_alias || def == nullptr || def->is_native || def->HasAttribute("inline")) {
+        return nullptr;
+    }
+
+    // the innermost declaration with this name is the one that is called
+    std::string var_name = state.MakeVariableName(call->name, call->module);
+    for (int start = state.level; start >= compiler_global_level; start--) {
+        LevelInfo &level = state.levels[start];
+        for (auto it = level.locals.rbegin(); it != level.locals.rend(); ++it) {
+            if (it->first == var_name) {
+                return (it->second.owner_level == compiler_global_level) ? call : nullptr;
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+Compiler::StaticType Compiler::GetStaticType(AstNode *node)
+{
+    if (node == nullptr) {
+        return Static_unknown;
+    }
+
+    switch (node->type) {
+    case Ast_type_integer:
+    case Ast_type_true:
+    case Ast_type_false:
+        return Static_int;
+    case Ast_type_float:
+        return Static_float;
+    case Ast_type_string:
+        return Static_string;
+    case Ast_type_expression:
+        return GetStaticType(static_cast<AstExpression*>(node)->child.get());
+    case Ast_type_variable:
+    {
+        // the type is only a guess, because the variable may be changed
+        // later on (in a loop, for example). typed operations check their operands
+        auto *var = static_cast<AstVariable*>(node);
+        if (var->is_literal && var->current_value != nullptr) {
+            return GetStaticType(var->current_value);
+        }
+        return Static_unknown;
+    }
+    case Ast_type_unop:
+    {
+        auto *unop = static_cast<AstUnaryOp*>(node);
+        StaticType child_type = GetStaticType(unop->child.get());
+        if (unop->op == UnOp_negative && child_type != Static_string) {
+            return child_type;
+        }
+        return Static_unknown;
+    }
+    case Ast_type_binop:
+    {
+        auto *binop = static_cast<AstBinaryOp*>(node);
+        StaticType left_type = GetStaticType(binop->left.get());
+        StaticType right_type = GetStaticType(binop->right.get());
+
+        if (left_type == Static_unknown || right_type == Static_unknown) {
+            return Static_unknown;
+        }
+
+        switch (binop->op) {
+        case BinOp_add:
+            if (left_type == Static_string) {
+                return Static_string;
+            }
+            // FALLTHROUGH
+        case BinOp_subtract:
+        case BinOp_multiply:
+        case BinOp_divide:
+        case BinOp_floor_divide:
+            if (left_type == Static_string || right_type == Static_string) {
+                return Static_unknown;
+            }
+            // mixing an int with a float gives a float
+            return (left_type == Static_int && right_type == Static_int) ? Static_int : Static_float;
+        case BinOp_modulus:
+            return (left_type == Static_int && right_type == Static_int) ? Static_int : Static_unknown;
+        case BinOp_less:
+        case BinOp_greater:
+        case BinOp_less_eql:
+        case BinOp_greater_eql:
+        case BinOp_equals:
+        case BinOp_not_equal:
+            if (left_type == Static_string || right_type == Static_string) {
+                return Static_unknown;
+            }
+            return Static_int;
+        default:
+            return Static_unknown;
+        }
+    }
+    default:
+        return Static_unknown;
+    }
+}
+
+Opcode_t Compiler::SelectOpcode(Opcode_t generic, AstNode *left, AstNode *right)
+{
+    if (!config::optimize_typed_operations) {
+        return generic;
+    }
+
+    StaticType type = GetStaticType(left);
+    if (type != GetStaticType(right)) {
+        return generic;
+    }
+
+    switch (type) {
+    case Static_int:
+        return IntegerOpcode(generic);
+    case Static_float:
+        return FloatOpcode(generic);
+    case Static_string:
+        return StringOpcode(generic);
+    default:
+        return generic;
+    }
+}
+
 size_t Compiler::UseCount(AstNode *node)
 {
     if (state.use_counts.find(node) == state.use_counts.end()) {
@@ -919,6 +1149,51 @@ void Compiler::DecreaseBlock()
     bstream << Instruction<Opcode_t>(Opcode_dfl);
 }
 
+void Compiler::StoreLocal(const std::string &var_name)
+{
+    // the local's slot is its index within the frame at run time
+    Symbol symbol;
+    symbol.original_name = var_name;
+    symbol.owner_level = state.level;
+    symbol.field_index = state.CurrentLevel().locals.size();
+    state.CurrentLevel().locals.push_back({ var_name, symbol });
+
+    bstream << Instruction<Opcode_t, uint32_t>(Opcode_store_as_local, state.constants.AddString(var_name));
+}
+
+void Compiler::LoadVariable(const std::string &var_name)
+{
+    // frames of an enclosing function are not at a fixed distance from
+    // the current frame, so only its own blocks and the global block are used.
+    bool in_function = true;
+    for (int start = state.level; start >= compiler_global_level; start--) {
+        LevelInfo &level = state.levels[start];
+
+        for (auto it = level.locals.rbegin(); it != level.locals.rend(); ++it) {
+            if (it->first == var_name) {
+                const Symbol &symbol = it->second;
+                if (symbol.owner_level == compiler_global_level) {
+                    bstream << Instruction<Opcode_t, int32_t>(Opcode_load_global, symbol.field_index);
+                } else if (in_function) {
+                    bstream << Instruction<Opcode_t, int32_t, int32_t>(Opcode_load_field,
+                        state.level - symbol.owner_level, symbol.field_index);
+                } else {
+                    // local of an enclosing function
+                    bstream << Instruction<Opcode_t, uint32_t>(Opcode_load_local, state.constants.AddString(var_name));
+                }
+                return;
+            }
+        }
+
+        if (level.type == LevelType::Level_function) {
+            in_function = false;
+        }
+    }
+
+    // native functions
+    bstream << Instruction<Opcode_t, uint32_t>(Opcode_load_local, state.constants.AddString(var_name));
+}
+
 void Compiler::OptimizeAstNode(std::unique_ptr<AstNode> &node)
 {
     auto optimized = node->Optimize();
@@ -1,5 +1,7 @@
 #include <detail/state.h>
 
+#include <cstring>
+
 namespace avm {
 CompilerState::CompilerState()
     : block_id_counter(0),
@@ -16,7 +18,8 @@ CompilerState::CompilerState(CompilerState &&other)
       levels(other.levels),
       native_function_calls(other.native_function_calls),
       use_counts(other.use_counts),
-      errors(other.errors)
+      errors(other.errors),
+      constants(other.constants)
 {
     typedef std::pair<std::string, std::unique_ptr<AstModule>> ModuleStringPair;
 
@@ -37,6 +40,35 @@ std::string CompilerState::MakeVariableName(const std::string &original, AstNode
     return mangled_name;
 }
 
+uint32_t ConstantPool::AddString(const std::string &str)
+{
+    auto it = string_indices.find(str);
+    if (it != string_indices.end()) {
+        return it->second;
+    }
+
+    uint32_t index = strings.size();
+    strings.push_back(str);
+    string_indices[str] = index;
+    return index;
+}
+
+uint32_t ConstantPool::AddFloat(AVMFloat_t value)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+
+    auto it = float_indices.find(bits);
+    if (it != float_indices.end()) {
+        return it->second;
+    }
+
+    uint32_t index = floats.size();
+    floats.push_back(value);
+    float_indices[bits] = index;
+    return index;
+}
+
 // Returns true if the module is imported. ('module' is the current module).
 bool CompilerState::FindModule(const std::string &name, AstNode *module)
 {